@@ -0,0 +1,141 @@
+#include <math.h>
+#include <string.h>
+
+#include "histogram.h"
+
+/* Percentile lines per halving of the distance to 100%, like HdrHistogram's
+ * default output */
+#define HISTOGRAM_TICKS_PER_HALF 5
+
+static int histogram_index(uint64_t value);
+static uint64_t histogram_value(int index);
+
+int histogram_index(uint64_t value) {
+  if (value < (1 << HISTOGRAM_PRECISION)) {
+    return (int)value;
+  }
+  int exponent = (63 - __builtin_clzll(value)) - (HISTOGRAM_PRECISION - 1);
+  return exponent * HISTOGRAM_HALF + (int)(value >> exponent);
+} /* histogram_index */
+
+/* Highest value that lands in this bucket */
+uint64_t histogram_value(int index) {
+  if (index < (1 << HISTOGRAM_PRECISION)) {
+    return index;
+  }
+  int exponent = index / HISTOGRAM_HALF - 1;
+  uint64_t mantissa = index - exponent * HISTOGRAM_HALF;
+  return ((mantissa + 1) << exponent) - 1;
+} /* histogram_value */
+
+void histogram_init(Histogram *histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min = UINT64_MAX;
+} /* histogram_init */
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+  histogram->counts[histogram_index(value)]++;
+  histogram->total++;
+  if (value < histogram->min) {
+    histogram->min = value;
+  }
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+} /* histogram_record */
+
+void histogram_merge(Histogram *histogram, const Histogram *source) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    histogram->counts[i] += source->counts[i];
+  }
+  histogram->total += source->total;
+  if (source->min < histogram->min) {
+    histogram->min = source->min;
+  }
+  if (source->max > histogram->max) {
+    histogram->max = source->max;
+  }
+} /* histogram_merge */
+
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+  uint64_t wanted = (uint64_t)ceil(percentile / 100.0 * histogram->total);
+  uint64_t seen = 0;
+
+  if (histogram->total == 0) {
+    return 0;
+  }
+  if (wanted == 0) {
+    wanted = 1;
+  }
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= wanted) {
+      uint64_t value = histogram_value(i);
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+  return histogram->max;
+} /* histogram_percentile */
+
+double histogram_mean(const Histogram *histogram) {
+  double sum = 0;
+
+  if (histogram->total == 0) {
+    return 0;
+  }
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (histogram->counts[i] > 0) {
+      sum += (double)histogram->counts[i] * histogram_value(i);
+    }
+  }
+  return sum / histogram->total;
+} /* histogram_mean */
+
+void histogram_print(const Histogram *histogram, FILE *out, double scale) {
+  double mean = histogram_mean(histogram);
+  double variance = 0;
+  double tick = 0;
+  uint64_t seen = 0;
+
+  fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+          "TotalCount", "1/(1-Percentile)");
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS && seen < histogram->total; i++) {
+    if (histogram->counts[i] == 0) {
+      continue;
+    }
+    seen += histogram->counts[i];
+    double value = histogram_value(i);
+    variance += histogram->counts[i] * (value - mean) * (value - mean);
+
+    /* Print a line for each reporting tick this bucket takes us past */
+    double percentile = 100.0 * seen / histogram->total;
+    while (tick <= percentile) {
+      if (seen == histogram->total) {
+        fprintf(out, "%12.3f %14.12f %10llu\n", histogram->max / scale, 1.0,
+                (unsigned long long)seen);
+        break;
+      }
+      fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", value / scale,
+              percentile / 100.0, (unsigned long long)seen,
+              100.0 / (100.0 - percentile));
+
+      /* Ticks get finer as we approach 100%: 5 between 0 and 50%, 5
+       * between 50% and 75%, and so on. */
+      double half = 100.0;
+      while (half / 2 >= 100.0 - tick) {
+        half /= 2;
+      }
+      tick += half / 2 / HISTOGRAM_TICKS_PER_HALF;
+    }
+  }
+
+  double deviation = histogram->total > 0
+    ? sqrt(variance / histogram->total) : 0;
+  fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+          mean / scale, deviation / scale);
+  fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n",
+          histogram->max / scale, (unsigned long long)histogram->total);
+  fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+          64 - HISTOGRAM_PRECISION + 1, HISTOGRAM_HALF);
+} /* histogram_print */
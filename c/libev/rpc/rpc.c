@@ -1,17 +1,35 @@
 #include "rpc.h"
 #include <ev.h>
+#include <pthread.h>
 #include "insist.h"
 #include "msgpack_helpers.h"
 #include "porter.h"
 #include "rpc_service.h"
+#include <stdlib.h>
 #include <string.h>
 #include <zmq.h>
 #include <zmq_utils.h>
 
-static void rpc_call_poll(EV_P_ ev_io *watcher, int revents);
-static void rpc_call_accept_response(rpc_call_t *rpc);
+/* Every client, for rpc_client_get */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static rpc_client_t *clients;
+
+static void rpc_client_poll(EV_P_ ev_io *watcher, int revents);
+static void rpc_client_receive(rpc_client_t *client);
+static uint32_t rpc_client_next_id(rpc_client_t *client);
+static uint32_t rpc_client_track(rpc_client_t *client, rpc_call_t *rpc);
+static void rpc_client_send(rpc_client_t *client, uint32_t id,
+                            msgpack_sbuffer *buffer);
+static void rpc_client_answer(rpc_client_t *client, uint32_t id,
+                              msgpack_object *response);
+static void rpc_batch_ids_free(gpointer ids);
+static void rpc_batch_forget(rpc_call_t *rpc);
+static msgpack_sbuffer *rpc_call_buffer(rpc_call_t *rpc);
+static void rpc_call_start(rpc_call_t *rpc);
+static void rpc_call_timeout(EV_P_ ev_timer *watcher, int revents);
+static void rpc_call_hedge(EV_P_ ev_timer *watcher, int revents);
+static void rpc_call_finish(rpc_call_t *rpc, msgpack_object *response);
 static void rpc_call_free(rpc_call_t *rpc);
-static void rpc_call_handle_response(rpc_call_t *rpc, zmq_msg_t *response);
 
 rpc_call_t *rpc_call_new(void *zmq, struct ev_loop *ev, const char *address,
                          const char *method) {
@@ -19,6 +37,10 @@ rpc_call_t *rpc_call_new(void *zmq, struct ev_loop *ev, const char *address,
   rpc->zmq = zmq;
   rpc->ev = ev;
   rpc->address = address;
+  ev_init(&rpc->timer, rpc_call_timeout);
+  rpc->timer.data = rpc;
+  ev_init(&rpc->hedge_timer, rpc_call_hedge);
+  rpc->hedge_timer.data = rpc;
 
   rpc->pack_buffer = msgpack_sbuffer_new();
   rpc->request = msgpack_packer_new(rpc->pack_buffer, msgpack_sbuffer_write);
@@ -30,123 +52,523 @@ rpc_call_t *rpc_call_new(void *zmq, struct ev_loop *ev, const char *address,
 
   /* The rest of the packing is up to the invoker of the rpc call.
    * Add whatever arguments are necessary later to rpc->request */
-
-  printf("Created new rpc call object targeting %s method %s\n",
-         address, method);
   return rpc;
 } /* rpc_call_new */
 
-/* TODO(sissel): Return an error code instead of insist-aborting */
 void rpc_call(rpc_call_t *rpc, rpc_response *callback, void *data) {
+  insist(rpc != NULL, "rpc cannot be null");
+  rpc_client_call(rpc_client_get(rpc->zmq, rpc->ev, rpc->address), rpc,
+                  callback, data);
+} /* rpc_call */
+
+rpc_client_t *rpc_client_new(void *zmq, struct ev_loop *ev,
+                             const char *address) {
   int rc; /* general-purpose return code collector */
+  rpc_client_t *client = calloc(1, sizeof(rpc_client_t));
+
+  client->zmq = zmq;
+  client->ev = ev;
+  client->address = address;
+  client->calls = g_hash_table_new(g_direct_hash, g_direct_equal);
+  client->batches = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, rpc_batch_ids_free);
+  histogram_init(&client->latency);
+  client->zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
 
-  printf("Calling rpc\n");
-  
   /* Connect to the endpoint */
-  insist(rpc != NULL, "rpc cannot be null");
-  rpc->socket = zmq_socket(rpc->zmq, ZMQ_REQ);
-  insist(rpc->socket != NULL, "zmq_socket returned NULL. zmq error(%d): %s",
+  client->socket = zmq_socket(zmq, ZMQ_DEALER);
+  insist(client->socket != NULL, "zmq_socket returned NULL. zmq error(%d): %s",
          zmq_errno(), zmq_strerror(zmq_errno()));
-  rc = zmq_connect(rpc->socket, rpc->address);
-  insist(rc == 0, 
-         "zmq_bind(\"%s\") returned %d (I expected: 0). zmq error(%d): %s",
-         rpc->address, rc, zmq_errno(), zmq_strerror(zmq_errno()));
+  rc = zmq_connect(client->socket, address);
+  insist(rc == 0,
+         "zmq_connect(\"%s\") returned %d (I expected: 0). zmq error(%d): %s",
+         address, rc, zmq_errno(), zmq_strerror(zmq_errno()));
 
   /* TODO(sissel): Turn this 'get fd' into a method */
   int socket_fd;
   size_t len = sizeof(socket_fd);
-  rc = zmq_getsockopt(rpc->socket, ZMQ_FD, &socket_fd, &len);
+  rc = zmq_getsockopt(client->socket, ZMQ_FD, &socket_fd, &len);
   insist(rc == 0, "zmq_getsockopt(ZMQ_FD) expected to return 0, but got %d",
          rc);
-  printf("Socket fd: %d\n", socket_fd);
 
+  /* Tell libev to call rpc_client_poll when we get a response */
+  ev_io_init(&client->io, rpc_client_poll, socket_fd, EV_READ);
+  ev_io_start(client->ev, &client->io);
+  return client;
+} /* rpc_client_new */
+
+rpc_client_t *rpc_client_get(void *zmq, struct ev_loop *ev,
+                             const char *address) {
+  rpc_client_t *client;
+
+  pthread_mutex_lock(&clients_lock);
+  for (client = clients; client != NULL; client = client->next) {
+    if (client->ev == ev && client->zmq == zmq
+        && strcmp(client->address, address) == 0) {
+      break;
+    }
+  }
+  if (client == NULL) {
+    client = rpc_client_new(zmq, ev, address);
+    client->next = clients;
+    clients = client;
+  }
+  pthread_mutex_unlock(&clients_lock);
+  return client;
+} /* rpc_client_get */
+
+void rpc_client_call(rpc_client_t *client, rpc_call_t *rpc,
+                     rpc_response *callback, void *data) {
   /* Set up callback handler */
+  rpc->client = client;
   rpc->callback = callback;
   rpc->data = data;
+  rpc->id = rpc_client_track(client, rpc);
 
-  /* Tell libev to call rpc_call_poll when we get a response */
-  ev_io_init(&rpc->io, rpc_call_poll, socket_fd, EV_READ);
-  ev_io_start(rpc->ev, &rpc->io);
+  rpc_client_send(client, rpc->id, rpc_call_buffer(rpc));
+  rpc_call_start(rpc);
+} /* rpc_client_call */
 
-  /* Now send the rpc call */
-  zmq_msg_t request;
-  zmq_msg_init_data(&request, rpc->pack_buffer->data, rpc->pack_buffer->size,
-                    free_msgpack_buffer, rpc->pack_buffer);
-  rc = zmq_send(rpc->socket, &request, 0);
-  zmq_msg_close(&request);
+/* An id for a call or a batch envelope that nothing is waiting on */
+uint32_t rpc_client_next_id(rpc_client_t *client) {
+  uint32_t id;
 
+  /* Ids wrap; skip any still waiting on an answer */
+  do {
+    id = client->next_id++;
+  } while (g_hash_table_lookup(client->calls, GUINT_TO_POINTER(id)) != NULL
+           || g_hash_table_lookup(client->batches,
+                                  GUINT_TO_POINTER(id)) != NULL);
+  return id;
+} /* rpc_client_next_id */
 
-  //while (1) {
-    //sleep(5);
-    //printf("Polling\n");
-    //rpc_call_poll(rpc->ev, &rpc->io, 1);
-  //}
-} /* rpc_call */
+/* Wait for the reply to 'rpc' on 'client'; returns the request id to send
+ * it with */
+uint32_t rpc_client_track(rpc_client_t *client, rpc_call_t *rpc) {
+  uint32_t id = rpc_client_next_id(client);
+
+  g_hash_table_insert(client->calls, GUINT_TO_POINTER(id), rpc);
+  return id;
+} /* rpc_client_track */
+
+/* TODO(sissel): Return an error code instead of insist-aborting */
+void rpc_client_send(rpc_client_t *client, uint32_t id,
+                     msgpack_sbuffer *buffer) {
+  zmq_msg_t frame;
+  int rc = 0;
+
+  /* The request id, then the empty delimiter a REQ socket would send, then
+   * the call itself */
+  zmq_msg_init_size(&frame, sizeof(id));
+  memcpy(zmq_msg_data(&frame), &id, sizeof(id));
+  rc |= zmq_send(client->socket, &frame, ZMQ_SNDMORE);
+  zmq_msg_close(&frame);
+
+  zmq_msg_init(&frame);
+  rc |= zmq_send(client->socket, &frame, ZMQ_SNDMORE);
+  zmq_msg_close(&frame);
+
+  zmq_msg_init_data(&frame, buffer->data, buffer->size, free_msgpack_buffer,
+                    buffer);
+  rc |= zmq_send(client->socket, &frame, 0);
+  zmq_msg_close(&frame);
+  insist(rc == 0, "zmq_send to %s failed. zmq error(%d): %s",
+         client->address, zmq_errno(), zmq_strerror(zmq_errno()));
+
+  /* Sending can use up zmq's one notice that a reply is waiting; have the
+   * loop look again rather than wait for a notice that won't come. */
+  ev_feed_event(client->ev, &client->io, EV_READ);
+} /* rpc_client_send */
+
+void rpc_client_free(rpc_client_t *client) {
+  rpc_client_t **link;
+  GList *calls;
+  GList *item;
+  int linger = 0;
+
+  pthread_mutex_lock(&clients_lock);
+  for (link = &clients; *link != NULL; link = &(*link)->next) {
+    if (*link == client) {
+      *link = client->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&clients_lock);
 
-void rpc_call_poll(EV_P_ ev_io *watcher, int revents) {
-  rpc_call_t *rpc = (rpc_call_t *)watcher;
+  ev_io_stop(client->ev, &client->io);
+  zmq_setsockopt(client->socket, ZMQ_LINGER, &linger, sizeof(linger));
+  zmq_close(client->socket);
+
+  /* Nothing will answer these now */
+  calls = g_hash_table_get_values(client->calls);
+  for (item = calls; item != NULL; item = item->next) {
+    rpc_call_t *rpc = item->data;
+    if (rpc->hedge_client == client && rpc->client != client) {
+      /* Only its hedge went here; the call itself may still be answered */
+      g_hash_table_remove(client->calls, GUINT_TO_POINTER(rpc->hedge_id));
+      rpc->hedge_client = NULL;
+    } else {
+      rpc_call_finish(rpc, NULL);
+    }
+  }
+  g_list_free(calls);
+  g_hash_table_destroy(client->calls);
+  g_hash_table_destroy(client->batches);
+  msgpack_zone_free(client->zone);
+  free(client);
+} /* rpc_client_free */
+
+void rpc_client_poll(EV_P_ ev_io *watcher, int revents) {
+  rpc_client_t *client = (rpc_client_t *)watcher;
   int rc;
   int zmqevents;
-  size_t len = sizeof(zmqevents);
-  printf("rpc_call_poll__ %p\n", rpc->socket);
+  size_t len;
 
-  rc = zmq_getsockopt(rpc->socket, ZMQ_EVENTS, &zmqevents, &len);
-  insist(rc == 0 || rc == -1, "zmq_getsockopt(ZMQ_EVENTS) expected to return 0, "
-         "but got %d", rc);
-  printf("zmqevents: %d\n", zmqevents);
+  /* zmq's fd only tells us something changed; take every reply waiting */
+  for (;;) {
+    len = sizeof(zmqevents);
+    rc = zmq_getsockopt(client->socket, ZMQ_EVENTS, &zmqevents, &len);
+    insist(rc == 0, "zmq_getsockopt(ZMQ_EVENTS) expected to return 0, "
+           "but got %d", rc);
 
-  /* Check for zmq events */
-  if ((zmqevents & ZMQ_POLLIN) == 0) {
-    /* No messages to receive */
-    return;
-  }
+    /* Check for zmq events */
+    if ((zmqevents & ZMQ_POLLIN) == 0) {
+      /* No messages to receive */
+      return;
+    }
 
-  /* There's an event ready to read */
-  rpc_call_accept_response(rpc);
-} /* rpc_service_poll */
+    /* There's an event ready to read */
+    rpc_client_receive(client);
+  }
+} /* rpc_client_poll */
 
-void rpc_call_accept_response(rpc_call_t *rpc) {
+void rpc_client_receive(rpc_client_t *client) {
   zmq_msg_t response;
+  msgpack_object response_obj;
+  msgpack_object *answer = &response_obj;
+  GArray *batch;
+  size_t offset = 0;
+  uint32_t id = 0;
+  int frames = 0;
+  int64_t more;
+  size_t len;
   int rc;
 
-  printf("rpc_call_accept_response\n");
-  rc = zmq_msg_init(&response);
-  rc = zmq_recv(rpc->socket, &response, ZMQ_NOBLOCK);
+  /* The request id we sent, the delimiter, then the reply */
+  for (;;) {
+    rc = zmq_msg_init(&response);
+    rc = zmq_recv(client->socket, &response, ZMQ_NOBLOCK);
+    if (rc == -1) {
+      zmq_msg_close(&response);
+      insist_return(errno == EAGAIN, (void)(0),
+                    "zmq_recv: expected success or EAGAIN, got errno %d:%s",
+                    errno, strerror(errno));
+      /* nothing to do, would block */
+      return;
+    }
 
-  insist_return(rc == 0 || errno == EAGAIN, (void)(0),
-                "zmq_recv: expected success or EAGAIN, got errno %d:%s",
-                errno, strerror(errno));
-
-  if (rc == -1 && errno == EAGAIN) {
-    /* nothing to do, would block */
+    len = sizeof(more);
+    rc = zmq_getsockopt(client->socket, ZMQ_RCVMORE, &more, &len);
+    insist(rc == 0, "zmq_getsockopt(ZMQ_RCVMORE) expected to return 0, "
+           "but got %d", rc);
+    if (!more) {
+      break;
+    }
+    if (frames++ == 0 && zmq_msg_size(&response) == sizeof(id)) {
+      memcpy(&id, zmq_msg_data(&response), sizeof(id));
+    }
     zmq_msg_close(&response);
-    return;
   }
 
-  rpc_call_handle_response(rpc, &response);
+  rc = msgpack_unpack(zmq_msg_data(&response), zmq_msg_size(&response),
+                      &offset, client->zone, &response_obj);
+  if (rc != MSGPACK_UNPACK_SUCCESS && rc != MSGPACK_UNPACK_EXTRA_BYTES) {
+    fprintf(stderr, "Failed to unpack message '%.*s'\n",
+            (int)zmq_msg_size(&response), (char *)zmq_msg_data(&response));
+    answer = NULL;
+  }
+
+  batch = g_hash_table_lookup(client->batches, GUINT_TO_POINTER(id));
+  if (batch != NULL && (answer == NULL
+                        || response_obj.type != MSGPACK_OBJECT_ARRAY)) {
+    /* Not one reply per call, like the error for a batch the service
+     * couldn't unpack: every call in it gets that instead. Taken out of the
+     * table first so finishing the calls leaves it alone. */
+    guint i;
+
+    g_hash_table_steal(client->batches, GUINT_TO_POINTER(id));
+    for (i = 0; i < batch->len; i++) {
+      rpc_client_answer(client, g_array_index(batch, uint32_t, i), answer);
+    }
+    g_array_free(batch, TRUE);
+  } else if (answer == NULL) {
+    rpc_client_answer(client, id, NULL);
+  } else if (response_obj.type == MSGPACK_OBJECT_ARRAY) {
+    /* A batch's replies, each carrying the id its call went out with */
+    msgpack_object_array *replies = &response_obj.via.array;
+    uint32_t i;
+
+    for (i = 0; i < replies->size; i++) {
+      msgpack_object *reply_id = rpc_object_get(&replies->ptr[i], "id");
+      if (reply_id == NULL
+          || reply_id->type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        fprintf(stderr, "Dropping batch reply from %s with no id\n",
+                client->address);
+        continue;
+      }
+      rpc_client_answer(client, (uint32_t)reply_id->via.u64,
+                        &replies->ptr[i]);
+    }
+  } else {
+    rpc_client_answer(client, id, &response_obj);
+  }
+  msgpack_zone_clear(client->zone);
   zmq_msg_close(&response);
+} /* rpc_client_receive */
 
-  /* Free the 'rpc' call */
-  rpc_call_free(rpc);
-} /* rpc_call_accept_response */
+/* Hand the call waiting on 'id' its reply, or NULL if it won't get one */
+void rpc_client_answer(rpc_client_t *client, uint32_t id,
+                       msgpack_object *response) {
+  rpc_call_t *rpc = g_hash_table_lookup(client->calls, GUINT_TO_POINTER(id));
+  ev_tstamp sent;
 
-void rpc_call_handle_response(rpc_call_t *rpc, zmq_msg_t *response) {
-  int rc;
-  msgpack_unpacked response_msg;
-  msgpack_unpacked_init(&response_msg);
-  rc = msgpack_unpack_next(&response_msg, zmq_msg_data(response),
-                           zmq_msg_size(response), NULL);
-  insist_return(rc, (void)(0), "Failed to unpack message '%.*s'",
-                (int)zmq_msg_size(response), (char *)zmq_msg_data(response));
-
-  msgpack_object response_obj = response_msg.data;
-  /* TODO(sissel): Call rpc->callback */
-  printf("rpc call response: ");
-  msgpack_object_print(stdout, response_obj);
-  printf("\n");
-} /* rpc_service_handle */
+  if (rpc == NULL) {
+    /* Not a reply to anything we're waiting on: one we gave up on, the
+     * slower of a call and its hedge, or something else entirely. The
+     * hedge's loser comes back for every hedged call, so say nothing. */
+    return;
+  }
+
+  /* A retry reuses the request id, so after one the reply may be to an
+   * earlier attempt and would look far faster than it was; it isn't timed */
+  if (response != NULL
+      && (client == rpc->hedge_client || rpc->attempts == 1)) {
+    sent = client == rpc->hedge_client ? rpc->hedge_sent : rpc->sent;
+    histogram_record(&client->latency,
+                     (uint64_t)((ev_now(client->ev) - sent) * 1000000));
+  }
+  rpc_call_finish(rpc, response);
+} /* rpc_client_answer */
+
+rpc_batch_t *rpc_batch_new(rpc_client_t *client) {
+  rpc_batch_t *batch = calloc(1, sizeof(rpc_batch_t));
+  batch->client = client;
+  return batch;
+} /* rpc_batch_new */
+
+void rpc_batch_add(rpc_batch_t *batch, rpc_call_t *rpc,
+                   rpc_response *callback, void *data) {
+  if (batch->count == batch->size) {
+    batch->size = batch->size > 0 ? batch->size * 2 : 16;
+    batch->calls = realloc(batch->calls, batch->size * sizeof(rpc_call_t *));
+  }
+  rpc->client = batch->client;
+  rpc->callback = callback;
+  rpc->data = data;
+  batch->calls[batch->count++] = rpc;
+} /* rpc_batch_add */
+
+void rpc_batch_flush(rpc_batch_t *batch) {
+  rpc_client_t *client = batch->client;
+  msgpack_sbuffer *buffer;
+  msgpack_packer packer;
+  uint32_t envelope;
+  GArray *ids;
+  size_t i;
+
+  if (batch->count == 0) {
+    return;
+  }
+
+  /* [ { "id": id, "method": ..., "args": ... }, ... ]; each call was packed
+   * as a map of method and args by rpc_call_new, so it is copied in behind
+   * a bigger map header with its id. */
+  envelope = rpc_client_next_id(client);
+  ids = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), batch->count);
+  buffer = msgpack_sbuffer_new();
+  msgpack_packer_init(&packer, buffer, msgpack_sbuffer_write);
+  msgpack_pack_array(&packer, batch->count);
+  for (i = 0; i < batch->count; i++) {
+    rpc_call_t *rpc = batch->calls[i];
+    msgpack_sbuffer *call = rpc->pack_buffer;
+
+    insist(call->size > 0 && (unsigned char)call->data[0] == 0x82,
+           "rpc call to batch doesn't start with a 2 entry map");
+    rpc->id = rpc_client_track(client, rpc);
+    rpc->batched = 1;
+    rpc->batch_id = envelope;
+    g_array_append_val(ids, rpc->id);
+    msgpack_pack_map(&packer, 3); /* id, method, args */
+    msgpack_pack_string(&packer, "id", 2);
+    msgpack_pack_uint32(&packer, rpc->id);
+    msgpack_sbuffer_write(buffer, call->data + 1, call->size - 1);
+    msgpack_sbuffer_free(rpc_call_buffer(rpc));
+  }
+
+  /* The envelope has an id of its own; replies are matched by the calls' */
+  g_hash_table_insert(client->batches, GUINT_TO_POINTER(envelope), ids);
+  rpc_client_send(client, envelope, buffer);
+  for (i = 0; i < batch->count; i++) {
+    rpc_call_start(batch->calls[i]);
+  }
+  batch->count = 0;
+} /* rpc_batch_flush */
+
+void rpc_batch_free(rpc_batch_t *batch) {
+  rpc_batch_flush(batch);
+  free(batch->calls);
+  free(batch);
+} /* rpc_batch_free */
+
+void rpc_batch_ids_free(gpointer ids) {
+  g_array_free(ids, TRUE);
+} /* rpc_batch_ids_free */
+
+/* 'rpc' is done; its batch, if it went out in one, stops waiting on it */
+void rpc_batch_forget(rpc_call_t *rpc) {
+  rpc_client_t *client = rpc->client;
+  GArray *ids = g_hash_table_lookup(client->batches,
+                                    GUINT_TO_POINTER(rpc->batch_id));
+  guint i;
+
+  if (ids == NULL) {
+    return;
+  }
+  for (i = 0; i < ids->len; i++) {
+    if (g_array_index(ids, uint32_t, i) == rpc->id) {
+      g_array_remove_index_fast(ids, i);
+      break;
+    }
+  }
+  if (ids->len == 0) {
+    g_hash_table_remove(client->batches, GUINT_TO_POINTER(rpc->batch_id));
+  }
+} /* rpc_batch_forget */
+
+/* The request to send for 'rpc': the call's own, unless it may be sent
+ * again, in which case a copy */
+msgpack_sbuffer *rpc_call_buffer(rpc_call_t *rpc) {
+  msgpack_sbuffer *buffer = rpc->pack_buffer;
+
+  if (rpc->options.retries > 0 || rpc->options.hedge != NULL) {
+    buffer = msgpack_sbuffer_new();
+    msgpack_sbuffer_write(buffer, rpc->pack_buffer->data,
+                          rpc->pack_buffer->size);
+  } else {
+    rpc->pack_buffer = NULL; /* the sender's now */
+  }
+  return buffer;
+} /* rpc_call_buffer */
+
+/* A call has just gone out for the first time; start its clocks */
+void rpc_call_start(rpc_call_t *rpc) {
+  rpc_call_options *options = &rpc->options;
+  double hedge_delay = options->hedge_delay;
+
+  rpc->sent = ev_now(rpc->ev);
+  rpc->attempts = 1;
+  rpc->backoff = options->backoff;
+  if (options->timeout > 0) {
+    ev_timer_set(&rpc->timer, options->timeout, 0);
+    ev_timer_start(rpc->ev, &rpc->timer);
+  }
+
+  if (options->hedge != NULL
+      && strcmp(options->hedge, rpc->client->address) == 0) {
+    return; /* asking the same place twice gains nothing */
+  }
+  if (options->hedge != NULL && hedge_delay <= 0
+      && rpc->client->latency.total >= RPC_HEDGE_SAMPLES) {
+    hedge_delay = histogram_percentile(&rpc->client->latency, 95) / 1000000.;
+  }
+  if (options->hedge != NULL && hedge_delay > 0) {
+    ev_timer_set(&rpc->hedge_timer, hedge_delay, 0);
+    ev_timer_start(rpc->ev, &rpc->hedge_timer);
+  }
+} /* rpc_call_start */
+
+/* An attempt went unanswered, or the wait before the next one is up */
+void rpc_call_timeout(EV_P_ ev_timer *watcher, int revents) {
+  rpc_call_t *rpc = watcher->data;
+  double wait;
+
+  if (rpc->backing_off) {
+    /* Same request id: a late reply to an earlier attempt answers it too */
+    rpc->backing_off = 0;
+    rpc->attempts++;
+    rpc_client_send(rpc->client, rpc->id, rpc_call_buffer(rpc));
+    rpc->sent = ev_now(EV_A);
+    ev_timer_set(watcher, rpc->options.timeout, 0);
+    ev_timer_start(EV_A_ watcher);
+    return;
+  }
+
+  if (rpc->attempts > rpc->options.retries) {
+    fprintf(stderr, "rpc call to %s unanswered after %d attempts\n",
+            rpc->client->address, rpc->attempts);
+    rpc_call_finish(rpc, NULL);
+    return;
+  }
+
+  /* Back off exponentially, like randomcode/exponential-backoff.c but on a
+   * timer rather than in usleep, waiting somewhere in the top half of the
+   * current backoff */
+  wait = rpc->backoff * (0.5 + 0.5 * random() / RAND_MAX);
+  rpc->backoff *= 2;
+  if (rpc->options.backoff_max > 0
+      && rpc->backoff > rpc->options.backoff_max) {
+    rpc->backoff = rpc->options.backoff_max;
+  }
+  rpc->backing_off = 1;
+  ev_timer_set(watcher, wait, 0);
+  ev_timer_start(EV_A_ watcher);
+} /* rpc_call_timeout */
+
+/* No reply yet; ask the hedge as well */
+void rpc_call_hedge(EV_P_ ev_timer *watcher, int revents) {
+  rpc_call_t *rpc = watcher->data;
+  rpc_client_t *client = rpc_client_get(rpc->zmq, rpc->ev,
+                                        rpc->options.hedge);
+
+  if (client == rpc->client) {
+    /* Both ids would be in one table, and the call finished twice when it
+     * goes */
+    return;
+  }
+  rpc->hedge_client = client;
+  rpc->hedge_id = rpc_client_track(rpc->hedge_client, rpc);
+  rpc_client_send(rpc->hedge_client, rpc->hedge_id, rpc_call_buffer(rpc));
+  rpc->hedge_sent = ev_now(EV_A);
+} /* rpc_call_hedge */
+
+/* The call is done with, answered or not: stop waiting for it anywhere,
+ * give its callback the reply, and free it */
+void rpc_call_finish(rpc_call_t *rpc, msgpack_object *response) {
+  ev_timer_stop(rpc->ev, &rpc->timer);
+  ev_timer_stop(rpc->ev, &rpc->hedge_timer);
+  g_hash_table_remove(rpc->client->calls, GUINT_TO_POINTER(rpc->id));
+  if (rpc->batched) {
+    rpc_batch_forget(rpc);
+  }
+  if (rpc->hedge_client != NULL) {
+    g_hash_table_remove(rpc->hedge_client->calls,
+                        GUINT_TO_POINTER(rpc->hedge_id));
+  }
+
+  if (rpc->callback != NULL) {
+    rpc->callback(rpc, response, rpc->data);
+  } else if (response != NULL) {
+    printf("rpc call response: ");
+    msgpack_object_print(stdout, *response);
+    printf("\n");
+  }
+  rpc_call_free(rpc);
+} /* rpc_call_finish */
 
 static void rpc_call_free(rpc_call_t *rpc) {
-  /* TODO(sissel): Anything else need freeing? */
+  if (rpc->pack_buffer != NULL) { /* never sent, or kept to send again */
+    msgpack_sbuffer_free(rpc->pack_buffer);
+  }
+  msgpack_packer_free(rpc->request);
   free(rpc);
 } /* rpc_call_free */
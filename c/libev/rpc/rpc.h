@@ -3,11 +3,25 @@
 
 #include <ev.h>
 #include <msgpack.h>
+#include <stdint.h>
+#include "histogram.h"
 #include "porter.h"
 
+/* Replies a client must have seen before it trusts its own p95 enough to
+ * hedge by it */
+#define RPC_HEDGE_SAMPLES 20
+
+/** Called with the reply to a call, or with a NULL 'response' if the call
+ * will never get one: its client was freed, it ran out of time, or the
+ * reply was not msgpack. */
 typedef void (rpc_response)(void *context, msgpack_object *response, void *data);
 
-typedef struct {
+/** A connection to one RPC service, shared by every call made to it from
+ * one loop. Calls go out on one DEALER socket, each with a request id in
+ * an envelope frame; the service sends the envelope back with the reply,
+ * so any number of calls can be outstanding and replies are matched to
+ * them in whatever order they come. */
+typedef struct rpc_client {
   /** libev io structure */
   ev_io io;
 
@@ -17,24 +31,152 @@ typedef struct {
   /** The zmq context */
   void *zmq;
 
-  /** The zmq address this call is talking to */
+  /** The zmq address this client is talking to */
   const char *address;
 
   /** The zmq socket */
   void *socket;
 
+  /** The request id the next call goes out with */
+  uint32_t next_id;
+
+  /** Calls sent and not answered yet, by request id */
+  GHashTable *calls;
+
+  /** Batches sent and not answered yet, by the id on their envelope: a
+   * GArray of the request ids of their calls still waiting, so all of them
+   * can be failed if the reply to a batch isn't one per call */
+  GHashTable *batches;
+
+  /** Microseconds from sending a call to its reply coming back, for
+   * hedging by; calls that were retried aren't counted */
+  Histogram latency;
+
+  /** Replies are decoded into this, and it is cleared, not freed, once
+   * their callbacks return */
+  msgpack_zone *zone;
+
+  /** Next in the list rpc_client_get looks clients up in */
+  struct rpc_client *next;
+} rpc_client_t;
+
+/** How long a call may take, and what to do about it. All zero, the
+ * default, waits for a reply for as long as it takes. */
+typedef struct {
+  /** Seconds each attempt gets to be answered; 0 for no limit */
+  double timeout;
+
+  /** Attempts to make after the first times out, waiting 'backoff'
+   * seconds before the first, twice that before the next, and so on up to
+   * 'backoff_max' (0 for no limit). Each wait is jittered down by up to
+   * half, so calls that timed out together don't all retry together. */
+  int retries;
+  double backoff;
+  double backoff_max;
+
+  /** Another address serving the same methods. If no reply has come
+   * 'hedge_delay' seconds after the call is sent, the call is sent there as
+   * well, and the first reply from either is the one used. With a
+   * 'hedge_delay' of 0 it is the p95 of replies on this client so far; no
+   * hedge is sent until there have been RPC_HEDGE_SAMPLES of them, and
+   * none is sent to the call's own address. */
+  const char *hedge;
+  double hedge_delay;
+} rpc_call_options;
+
+typedef struct {
+  /* libev loop */
+  struct ev_loop *ev;
+
+  /** The zmq context */
+  void *zmq;
+
+  /** The zmq address this call is talking to */
+  const char *address;
+
+  /** Set before sending the call */
+  rpc_call_options options;
+
+  /** The client this call went out on, and its request id there */
+  rpc_client_t *client;
+  uint32_t id;
+
+  /** If it went out in a batch, that batch's envelope id */
+  int batched;
+  uint32_t batch_id;
+
+  /** The hedge's client and request id, once it has been sent */
+  rpc_client_t *hedge_client;
+  uint32_t hedge_id;
+
+  /** Times out the attempt in flight, or the wait before the next */
+  ev_timer timer;
+  int attempts;
+  int backing_off;
+  double backoff;
+
+  /** Sends the hedge */
+  ev_timer hedge_timer;
+
+  /** When the call, and its hedge, last went out */
+  ev_tstamp sent;
+  ev_tstamp hedge_sent;
+
   /** The callback invoked when this RPC call gets a reply */
   rpc_response *callback;
 
-  /** msgpack message */
+  /** msgpack message; kept after sending if it may be sent again */
   msgpack_packer *request;
   msgpack_sbuffer *pack_buffer;
 
   /** Arbitrary data to pass to this callback */
   void *data;
 } rpc_call_t;
-                            
+
+/** Calls collected to go out together: one message carrying all of them,
+ * answered with one message carrying all their replies. Each call still
+ * gets its own callback; if the batch is answered with anything but a list
+ * of replies, such as an error for the batch as a whole, every call in it
+ * gets that. */
+typedef struct {
+  rpc_client_t *client;
+  rpc_call_t **calls;
+  size_t count;
+  size_t size;
+} rpc_batch_t;
+
 rpc_call_t *rpc_call_new(void *zmq, struct ev_loop *ev, const char *address,
                          const char *method);
 void rpc_call(rpc_call_t *rpc, rpc_response *callback, void *data);
+
+rpc_client_t *rpc_client_new(void *zmq, struct ev_loop *ev,
+                             const char *address);
+
+/* The client for 'address' on loop 'ev', connecting one the first time;
+ * rpc_call uses this, so calls share one socket per service and loop. */
+rpc_client_t *rpc_client_get(void *zmq, struct ev_loop *ev,
+                             const char *address);
+
+/* Send 'rpc' on 'client'. 'callback' gets its reply, or NULL once its
+ * options say to stop waiting, and 'rpc' is freed after that. */
+void rpc_client_call(rpc_client_t *client, rpc_call_t *rpc,
+                     rpc_response *callback, void *data);
+
+/* Close the client's socket. Calls still outstanding get their callbacks
+ * with a NULL response. */
+void rpc_client_free(rpc_client_t *client);
+
+rpc_batch_t *rpc_batch_new(rpc_client_t *client);
+
+/* Add 'rpc' to the batch, to be sent on the next rpc_batch_flush. As with
+ * rpc_client_call, 'callback' gets its reply and 'rpc' is freed after. Its
+ * retries and hedge, if any, go out on their own rather than batched. */
+void rpc_batch_add(rpc_batch_t *batch, rpc_call_t *rpc,
+                   rpc_response *callback, void *data);
+
+/* Send every call added since the last flush, in one message */
+void rpc_batch_flush(rpc_batch_t *batch);
+
+/* Flush anything left, then free the batch */
+void rpc_batch_free(rpc_batch_t *batch);
 #endif /* _RPC_H_ */
@@ -1,27 +1,99 @@
 #include <ev.h>
+#include <pthread.h>
 #include "insist.h"
 #include "msgpack_helpers.h"
 #include "porter.h"
 #include "rpc_service.h"
 #include <string.h>
+#include <unistd.h>
 #include <zmq.h>
 #include <zmq_utils.h>
 
+/* Salts to try hashing the method names with before giving up. A salt only
+ * fails if two names share a 32 bit hash, so the first nearly always does. */
+#define RPC_METHOD_SALTS 16
+
+/* Seeds to try per bucket of names before trying another salt */
+#define RPC_METHOD_SEEDS 65536
+
 static void rpc_service_poll(EV_P_ ev_io *watcher, int revents);
 static void rpc_service_receive(rpc_service_t *service);
-static void rpc_service_handle(rpc_service_t *service, zmq_msg_t *request);
-static int rpc_name_cmp(const void *a, const void *b);
+static void rpc_service_handle(rpc_service_t *service, rpc_reply_t *reply,
+                               zmq_msg_t *request);
+static void rpc_service_handle_batch(rpc_service_t *service,
+                                     rpc_reply_t *batch, zmq_msg_t *request,
+                                     msgpack_object *request_obj);
+static rpc_method *rpc_service_dispatch(rpc_service_t *service,
+                                        rpc_reply_t *reply,
+                                        msgpack_object *request);
+static void rpc_service_send_replies(EV_P_ ev_async *watcher, int revents);
+static void rpc_service_send_reply(rpc_service_t *service,
+                                   rpc_reply_t *reply);
+static void rpc_service_send(rpc_service_t *service, rpc_reply_t *reply);
+static void rpc_batch_done(rpc_service_t *service, rpc_reply_t *batch);
+static msgpack_zone *rpc_service_zone_take(rpc_service_t *service);
+static void rpc_service_zone_give(rpc_service_t *service, msgpack_zone *zone);
+static rpc_reply_t *rpc_reply_new(rpc_service_t *service,
+                                  msgpack_sbuffer *buffer);
+static void rpc_reply_begin(rpc_reply_t *reply, msgpack_object *id);
+static void rpc_reply_detach(rpc_reply_t *reply);
+static void rpc_reply_free(rpc_reply_t *reply);
+static int rpc_reply_error_write(void *data, const char *buf,
+                                 unsigned int len);
+static void rpc_reply_finish(rpc_reply_t *reply);
+static void rpc_queue_init(rpc_queue *queue);
+static void rpc_queue_push(rpc_queue *queue, rpc_reply_t *reply);
+static rpc_reply_t *rpc_queue_pop(rpc_queue *queue);
+static void rpc_workers_start(rpc_queue *queue, int count);
+static void *rpc_worker(void *data);
+static void rpc_reply_run(rpc_reply_t *reply);
 
-void rpc_m_list_methods(void *context, msgpack_object *request,
-                        msgpack_packer *result, msgpack_packer *error,
-                        void *data);
+/* The call a worker is running the handler of, and whether the handler
+ * deferred it. Once deferred, the reply can be sent and freed by another
+ * thread before the handler even returns, so the worker goes by this and
+ * never looks at the reply again. */
+static __thread rpc_reply_t *worker_reply;
+static __thread int worker_deferred;
+static rpc_method *rpc_service_lookup(rpc_service_t *service,
+                                      const char *name, size_t len);
+static void rpc_service_hash_methods(rpc_service_t *service,
+                                     const rpc_method *methods, size_t count);
+static int rpc_methods_place(const rpc_method *methods, size_t count,
+                             uint32_t salt, rpc_method *slots,
+                             uint32_t *seeds);
+static uint32_t rpc_name_hash(uint32_t salt, const char *name, size_t len);
+static size_t rpc_method_slot(uint32_t hash, uint32_t seed, size_t count);
+static rpc_args *rpc_args_compile(const rpc_arg *schema, size_t size);
+static void rpc_args_call(void *context, msgpack_object *request,
+                          msgpack_packer *result, msgpack_packer *error,
+                          void *data);
+static const char *rpc_args_extract(const rpc_args *args,
+                                    msgpack_object *given, void *out,
+                                    rpc_name *bad);
+static int rpc_arg_store(const rpc_arg_op *op, msgpack_object *value,
+                         void *out);
+
+void rpc_m_stats(void *context, void *args, msgpack_packer *result,
+                 msgpack_packer *error, void *data);
 void rpc_m_echo(void *context, msgpack_object *request,
                 msgpack_packer *result, msgpack_packer *error, void *data);
 
+typedef struct {
+  int reset;
+} rpc_stats_args;
+
+static const rpc_arg rpc_stats_schema[] = {
+  RPC_ARG_OPTIONAL(rpc_stats_args, reset, RPC_ARG_BOOL),
+  RPC_ARGS_END
+};
+
 rpc_service_t *rpc_service_new(const char *address) {
   rpc_service_t *service = calloc(1, sizeof(rpc_service_t));
-  service->methods = g_tree_new(rpc_name_cmp);
   service->address = address;
+  pthread_mutex_init(&service->reply_lock, NULL);
+  service->replies_tail = &service->replies;
+  rpc_queue_init(&service->pool);
+  service->zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
   return service;
 } /* rpc_service_new */
 
@@ -29,7 +101,10 @@ void rpc_service_start(rpc_service_t *service, struct ev_loop *ev) {
   int rc;
 
   printf("Starting RPC service on %s\n", service->address);
-  void *socket = zmq_socket(service->zmq, ZMQ_REP);
+
+  /* ROUTER, not REP: any number of calls can be in flight, and each reply
+   * finds its way back by the envelope its call came with. */
+  void *socket = zmq_socket(service->zmq, ZMQ_ROUTER);
   insist(socket != NULL, "zmq_socket returned NULL. zmq error(%d): %s",
          zmq_errno(), zmq_strerror(zmq_errno()));
 
@@ -45,7 +120,8 @@ void rpc_service_start(rpc_service_t *service, struct ev_loop *ev) {
   insist(rc == 0, "zmq_getsockopt(ZMQ_FD) expected to return 0, but got %d",
          rc);
 
-  rpc_service_register(service, "list_methods", rpc_m_list_methods, service);
+  rpc_service_register_args(service, "stats", rpc_m_stats, service,
+                            rpc_stats_schema, sizeof(rpc_stats_args));
   rpc_service_register(service, "echo", rpc_m_echo, NULL);
 
   service->socket = socket;
@@ -53,6 +129,10 @@ void rpc_service_start(rpc_service_t *service, struct ev_loop *ev) {
   ev_io_init(&service->io, rpc_service_poll, socket_fd, EV_READ);
   ev_io_start(service->ev, &service->io);
 
+  ev_async_init(&service->reply_async, rpc_service_send_replies);
+  service->reply_async.data = service;
+  ev_async_start(service->ev, &service->reply_async);
+
   printf("RPC/API started\n");
 } /* rpc_service_start */
 
@@ -60,218 +140,1068 @@ void rpc_service_poll(EV_P_ ev_io *watcher, int revents) {
   rpc_service_t *service = (rpc_service_t *)watcher;
   int rc;
   int zmqevents;
-  size_t len = sizeof(zmqevents);
-  printf("rpc_service_poll\n");
+  size_t len;
 
-  rc = zmq_getsockopt(service->socket, ZMQ_EVENTS, &zmqevents, &len);
-  insist(rc == 0, "zmq_getsockopt(ZMQ_EVENTS) expected to return 0, "
-         "but got %d", rc);
+  /* zmq's fd only tells us something changed, not how much; take every
+   * call that is waiting, or we won't hear about the rest. */
+  for (;;) {
+    len = sizeof(zmqevents);
+    rc = zmq_getsockopt(service->socket, ZMQ_EVENTS, &zmqevents, &len);
+    insist(rc == 0, "zmq_getsockopt(ZMQ_EVENTS) expected to return 0, "
+           "but got %d", rc);
 
-  /* Check for zmq events */
-  if ((zmqevents & ZMQ_POLLIN) == 0) {
-    /* No messages to receive */
-    return;
-  }
+    /* Check for zmq events */
+    if ((zmqevents & ZMQ_POLLIN) == 0) {
+      /* No messages to receive */
+      return;
+    }
 
-  /* There's an event ready to read */
-  rpc_service_receive(service);
+    /* There's an event ready to read */
+    rpc_service_receive(service);
+  }
 } /* rpc_service_poll */
 
 void rpc_service_receive(rpc_service_t *service) {
   zmq_msg_t request;
   int rc;
+  int64_t more;
+  size_t len;
+  size_t frames = 0;
+  rpc_reply_t *reply = rpc_reply_new(service, NULL);
 
-  rc = zmq_msg_init(&request);
-  rc = zmq_recv(service->socket, &request, ZMQ_NOBLOCK);
-  printf("rpc_service_receive: %.*s\n", (int) zmq_msg_size(&request), (char *) zmq_msg_data(&request));
+  /* Every frame but the last is envelope: who sent the call and, from REQ
+   * peers, an empty delimiter. Keep them to send the reply back with. */
+  for (;;) {
+    rc = zmq_msg_init(&request);
+    rc = zmq_recv(service->socket, &request, ZMQ_NOBLOCK);
+    if (rc == -1) {
+      zmq_msg_close(&request);
+      rpc_reply_free(reply);
+      insist_return(errno == EAGAIN, (void)(0),
+                    "zmq_recv: expected success or EAGAIN, got errno %d:%s",
+                    errno, strerror(errno));
+      /* nothing to do, would block */
+      return;
+    }
 
-  insist_return(rc == 0 || errno == EAGAIN, (void)(0),
-                "zmq_recv: expected success or EAGAIN, got errno %d:%s",
-                errno, strerror(errno));
+    len = sizeof(more);
+    rc = zmq_getsockopt(service->socket, ZMQ_RCVMORE, &more, &len);
+    insist(rc == 0, "zmq_getsockopt(ZMQ_RCVMORE) expected to return 0, "
+           "but got %d", rc);
+    if (!more) {
+      break;
+    }
 
-  if (rc == -1 && errno == EAGAIN) {
-    /* nothing to do, would block */
+    frames++;
+    if (reply->envelope_count < RPC_ENVELOPE_MAX) {
+      zmq_msg_init(&reply->envelope[reply->envelope_count]);
+      zmq_msg_move(&reply->envelope[reply->envelope_count], &request);
+      reply->envelope_count++;
+    }
     zmq_msg_close(&request);
-    return;
   }
 
-  rpc_service_handle(service, &request);
+  if (frames > RPC_ENVELOPE_MAX) {
+    /* Nowhere we could send a reply back to */
+    fprintf(stderr, "Dropping call with a %zu frame envelope (at most %d)\n",
+            frames, RPC_ENVELOPE_MAX);
+    rpc_reply_free(reply);
+  } else {
+    rpc_service_handle(service, reply, &request);
+  }
   zmq_msg_close(&request);
 } /* rpc_service_receive */
 
-void rpc_service_handle(rpc_service_t *service, zmq_msg_t *request) {
-  /* Parse the msgpack */
-  zmq_msg_t response;
+void rpc_service_handle(rpc_service_t *service, rpc_reply_t *reply,
+                        zmq_msg_t *request) {
+  /* Parse the msgpack, into the zone every call shares */
   int rc;
-  msgpack_unpacked request_msg;
-  msgpack_unpacked_init(&request_msg);
-  rc = msgpack_unpack_next(&request_msg, zmq_msg_data(request),
-                           zmq_msg_size(request), NULL);
-  insist_return(rc, (void)(0), "Failed to unpack message '%.*s'",
-                (int)zmq_msg_size(request), (char *)zmq_msg_data(request));
+  int unpacked;
+  size_t offset = 0;
+  msgpack_object *request_obj = msgpack_zone_malloc(service->zone,
+                                                    sizeof(msgpack_object));
+  rc = msgpack_unpack(zmq_msg_data(request), zmq_msg_size(request), &offset,
+                      service->zone, request_obj);
+  unpacked = rc == MSGPACK_UNPACK_SUCCESS || rc == MSGPACK_UNPACK_EXTRA_BYTES;
+
+  if (!unpacked) {
+    fprintf(stderr, "Failed to unpack message '%.*s'\n",
+            (int)zmq_msg_size(request), (char *)zmq_msg_data(request));
+  } else if (request_obj->type == MSGPACK_OBJECT_ARRAY) {
+    rpc_service_handle_batch(service, reply, request, request_obj);
+    return;
+  }
+
+  /* The response is packed exactly once, straight into the buffer zmq
+   * sends from */
+  rpc_reply_begin(reply, NULL);
+  rpc_method *rpcmethod = rpc_service_dispatch(service, reply,
+                                               unpacked ? request_obj : NULL);
+  if (rpcmethod != NULL) {
+    /* The method runs on a worker, which owns the call from here */
+    zmq_msg_init(&reply->request);
+    zmq_msg_move(&reply->request, request);
+    reply->zone = rpc_service_zone_take(service);
+    reply->request_obj = request_obj;
+    rpc_queue_push(rpcmethod->queue, reply);
+    return;
+  }
+
+  if (!reply->deferred) {
+    rpc_service_send_reply(service, reply);
+  }
+  msgpack_zone_clear(service->zone);
+} /* rpc_service_handle */
+
+/* Run every call in a batch, packing the replies of those answered inline
+ * straight into the batch's reply. The batch's reply keeps the request,
+ * which every call in it points into, until the last call is answered. */
+void rpc_service_handle_batch(rpc_service_t *service, rpc_reply_t *batch,
+                              zmq_msg_t *request,
+                              msgpack_object *request_obj) {
+  msgpack_object_array *calls = &request_obj->via.array;
+  uint32_t i;
 
-  msgpack_object request_obj = request_msg.data;
+  zmq_msg_init(&batch->request);
+  zmq_msg_move(&batch->request, request);
+  batch->zone = rpc_service_zone_take(service);
+
+  /* One more than there are calls, so the batch isn't sent out from under
+   * us by the last call to be answered inline */
+  batch->pending = calls->size + 1;
+  msgpack_pack_array(&batch->result, calls->size);
+
+  for (i = 0; i < calls->size; i++) {
+    msgpack_object *call = &calls->ptr[i];
+    rpc_reply_t *reply = rpc_reply_new(service, batch->buffer);
+    rpc_method *rpcmethod;
+
+    reply->batch = batch;
+    rpc_reply_begin(reply, rpc_object_get(call, "id"));
+    rpcmethod = rpc_service_dispatch(service, reply, call);
+    if (rpcmethod != NULL) {
+      /* Packed on a worker, so not into the batch as it goes */
+      rpc_reply_detach(reply);
+      reply->request_obj = call;
+      rpc_queue_push(rpcmethod->queue, reply);
+    } else if (!reply->deferred) {
+      rpc_service_send_reply(service, reply);
+    }
+  }
+
+  rpc_batch_done(service, batch);
+} /* rpc_service_handle_batch */
+
+/* Start answering 'request' (NULL if it wasn't msgpack) into 'reply': pack
+ * the error if it names no method we have, or run its method if that runs
+ * inline. Returns the method if it runs off the loop instead. */
+rpc_method *rpc_service_dispatch(rpc_service_t *service, rpc_reply_t *reply,
+                                 msgpack_object *request) {
+  msgpack_packer *result = &reply->result;
+  msgpack_packer *error = &reply->error;
+  msgpack_object *method = NULL;
 
   /* Find the method name */
-  char *method = NULL;
-  size_t method_len = -1;
-  rc = obj_get(&request_obj, "method", MSGPACK_OBJECT_RAW, &method, &method_len);
+  if (request != NULL) {
+    method = rpc_object_get(request, "method");
+    if (method != NULL && method->type != MSGPACK_OBJECT_RAW) {
+      method = NULL;
+    }
+  }
+
+  reply->clock = zmq_stopwatch_start();
 
-  msgpack_sbuffer *response_buffer = msgpack_sbuffer_new();
-  msgpack_sbuffer *result_buffer = msgpack_sbuffer_new();
-  msgpack_sbuffer *error_buffer = msgpack_sbuffer_new();
+  if (method == NULL) { /* not msgpack, or no method */
+    msgpack_pack_nil(result); /* result is nil on error */
+    msgpack_pack_map(error, 2);
+    msgpack_pack_string(error, "error", -1);
+    if (request == NULL) {
+      msgpack_pack_string(error, "Message was not msgpack", -1);
+      msgpack_pack_string(error, "request", -1);
+      msgpack_pack_nil(error);
+    } else {
+      msgpack_pack_string(error, "Message had no 'method' field", -1);
+      msgpack_pack_string(error, "request", -1);
+      msgpack_pack_object(error, *request);
+    }
+    return NULL;
+  }
 
-  msgpack_packer *response_msg = msgpack_packer_new(response_buffer, msgpack_sbuffer_write);
-  msgpack_packer *result = msgpack_packer_new(result_buffer, msgpack_sbuffer_write);
-  msgpack_packer *error = msgpack_packer_new(error_buffer, msgpack_sbuffer_write);
+  rpc_method *rpcmethod = rpc_service_lookup(service, method->via.raw.ptr,
+                                             method->via.raw.size);
 
-  //printf("Method: %.*s\n", method_len, method);
+  if (rpcmethod != NULL && rpcmethod->callback != NULL) {
+    reply->stats = rpcmethod->stats;
+  }
 
-  void *clock = zmq_stopwatch_start();
-  double duration;
+  if (rpcmethod != NULL && rpcmethod->callback != NULL
+      && rpcmethod->queue != NULL) {
+    reply->callback = rpcmethod->callback;
+    reply->data = rpcmethod->data;
+    return rpcmethod;
+  }
 
-  if (rc != 0) { /* method not found */
+  /* if we found a valid rpc method and the args check passed ... */
+  if (rpcmethod != NULL && rpcmethod->callback != NULL) {
+    /* the callback is responsible for filling in the 'result' and 'error' 
+     * objects, now or, if it defers the reply, later. */
+    rpcmethod->callback(reply, request, result, error, rpcmethod->data);
+  } else {
     msgpack_pack_nil(result); /* result is nil on error */
+
     msgpack_pack_map(error, 2);
     msgpack_pack_string(error, "error", -1);
-    msgpack_pack_string(error, "Message had no 'method' field", -1);
+    msgpack_pack_string(error, "No such method requested", -1);
     msgpack_pack_string(error, "request", -1);
-    msgpack_pack_object(error, request_obj);
-  } else { /* valid method, keep going */
-    //printf("The method is: '%.*s'\n", (int)method_len, method);
-    rpc_name name;
-    name.name = method;
-    name.len = method_len;
+    msgpack_pack_object(error, *request);
+  }
+  return NULL;
+} /* rpc_service_dispatch */
 
-    rpc_method *rpcmethod = g_tree_lookup(service->methods, &name);
+rpc_reply_t *rpc_defer(void *context) {
+  rpc_reply_t *reply = context;
+  if (reply == worker_reply) {
+    worker_deferred = 1;
+  }
+  reply->deferred = 1;
+  if (reply->batch != NULL && reply->buffer == reply->batch->buffer) {
+    /* The batch's buffer moves on to the next call without it */
+    rpc_reply_detach(reply);
+  }
+  return reply;
+} /* rpc_defer */
 
-    /* if we found a valid rpc method and the args check passed ... */
-    if (rpcmethod != NULL) {
-      /* the callback is responsible for filling in the 'result' and 'error' 
-       * objects. */
-      rpcmethod->callback(NULL, &request_obj, result, error, rpcmethod->data);
-    } else {
-      msgpack_pack_nil(result); /* result is nil on error */
+void rpc_reply_send(rpc_reply_t *reply) {
+  rpc_service_t *service = reply->service;
 
-      /* TODO(sissel): allow methods to register themselves */
-      //fprintf(stderr, "Invalid request '%.*s' (unknown method): ",
-              //method_len, method);
-      //msgpack_object_print(stderr, request_obj);
-      //fprintf(stderr, "\n");
+  /* zmq sockets belong to one thread; the loop's sends it */
+  reply->next = NULL;
+  pthread_mutex_lock(&service->reply_lock);
+  *service->replies_tail = reply;
+  service->replies_tail = &reply->next;
+  pthread_mutex_unlock(&service->reply_lock);
+  ev_async_send(service->ev, &service->reply_async);
+} /* rpc_reply_send */
 
-      msgpack_pack_map(error, 2);
-      msgpack_pack_string(error, "error", -1);
-      msgpack_pack_string(error, "No such method requested", -1);
-      msgpack_pack_string(error, "request", -1);
-      msgpack_pack_object(error, request_obj);
-    }
-  } /* valid/invalid method handling */
-
-  duration = zmq_stopwatch_stop(clock) / 1000000.;
-  //printf("method '%.*s' took %lf seconds\n", (int)method_len, method);
-
-  msgpack_unpacked result_unpacked;
-  msgpack_unpacked error_unpacked;
-  msgpack_unpacked response_unpacked;
-  msgpack_unpacked_init(&result_unpacked);
-  msgpack_unpacked_init(&error_unpacked);
-  msgpack_unpacked_init(&response_unpacked);
-
-  /* TODO(sissel): If this unpack test fails, we should return an error to the calling
-   * client indicating that some internal error has occurred */
-  //fprintf(stderr, "Result payload: '%.*s'\n", result_buffer->size,
-  //result_buffer->data);
-  rc = msgpack_unpack_next(&result_unpacked, result_buffer->data,
-                           result_buffer->size, NULL);
-  insist(rc == true, "msgpack_unpack_next failed on 'result' buffer"
-         " of request '%.*s'", (int)method_len, method);
-  rc = msgpack_unpack_next(&error_unpacked, error_buffer->data,
-                           error_buffer->size, NULL);
-  insist(rc == true, "msgpack_unpack_next failed on 'error' buffer"
-         " of request '%.*s'", (int)method_len, method);
-
-  msgpack_pack_map(response_msg, 3); /* result, error, duration */
-  msgpack_pack_string(response_msg, "result", 6);
-  msgpack_pack_object(response_msg, result_unpacked.data);
-  msgpack_pack_string(response_msg, "error", 5);
-  msgpack_pack_object(response_msg, error_unpacked.data);
-  msgpack_pack_string(response_msg, "duration", 8);
-  msgpack_pack_double(response_msg, duration);
-
-  rc = msgpack_unpack_next(&response_unpacked, response_buffer->data,
-                           response_buffer->size, NULL);
-  insist(rc == true, "msgpack_unpack_next failed on full response buffer"
-         " of request '%.*s'", (int)method_len, method);
-
-  //printf("request: ");
-  //msgpack_object_print(stdout, request_obj);
-  //printf("\n");
-  //printf("response: ");
-  //msgpack_object_print(stdout, response_unpacked.data);
-  //printf("\n");
-
-  zmq_msg_init_data(&response, response_buffer->data, response_buffer->size,
-                    free_msgpack_buffer, response_buffer);
+void rpc_service_send_replies(EV_P_ ev_async *watcher, int revents) {
+  rpc_service_t *service = watcher->data;
+  rpc_reply_t *reply;
+
+  pthread_mutex_lock(&service->reply_lock);
+  reply = service->replies;
+  service->replies = NULL;
+  service->replies_tail = &service->replies;
+  pthread_mutex_unlock(&service->reply_lock);
+
+  while (reply != NULL) {
+    rpc_reply_t *next = reply->next;
+    rpc_service_send_reply(service, reply);
+    reply = next;
+  }
+
+  /* Sending can use up zmq's one notice that calls are waiting */
+  rpc_service_poll(EV_A_ &service->io, 0);
+} /* rpc_service_send_replies */
+
+/* Finish a reply and send it back along its envelope, then free it. The
+ * reply to a call in a batch goes into the batch's reply instead, which is
+ * sent once every call in it is answered. */
+void rpc_service_send_reply(rpc_service_t *service, rpc_reply_t *reply) {
+  rpc_reply_t *batch = reply->batch;
+
+  rpc_reply_finish(reply);
+  if (batch == NULL) {
+    rpc_service_send(service, reply);
+    return;
+  }
+
+  if (reply->buffer == batch->buffer) {
+    reply->buffer = NULL; /* packed in place */
+  } else {
+    msgpack_sbuffer_write(batch->buffer, reply->buffer->data,
+                          reply->buffer->size);
+  }
+  rpc_reply_free(reply);
+  rpc_batch_done(service, batch);
+} /* rpc_service_send_reply */
+
+/* One more call in 'batch' is answered; send it if that was the last */
+void rpc_batch_done(rpc_service_t *service, rpc_reply_t *batch) {
+  if (--batch->pending > 0) {
+    return;
+  }
+  rpc_service_send(service, batch);
+} /* rpc_batch_done */
+
+/* Send a reply's buffer back along its envelope, then free it */
+void rpc_service_send(rpc_service_t *service, rpc_reply_t *reply) {
+  zmq_msg_t response;
+  size_t i;
+
+  for (i = 0; i < reply->envelope_count; i++) {
+    zmq_send(service->socket, &reply->envelope[i], ZMQ_SNDMORE);
+  }
+
+  /* zmq frees the buffer once it is sent */
+  zmq_msg_init_data(&response, reply->buffer->data, reply->buffer->size,
+                    free_msgpack_buffer, reply->buffer);
+  reply->buffer = NULL;
   zmq_send(service->socket, &response, 0);
   zmq_msg_close(&response);
 
-  msgpack_packer_free(error);
-  msgpack_packer_free(result);
-  msgpack_sbuffer_free(error_buffer);
-  msgpack_sbuffer_free(result_buffer);
-  msgpack_packer_free(response_msg);
-  msgpack_unpacked_destroy(&request_msg);
-} /* rpc_service_handle */
+  rpc_reply_free(reply);
+} /* rpc_service_send */
+
+void rpc_service_set_policy(rpc_service_t *service, const char *method_name,
+                            rpc_policy policy) {
+  rpc_method *method = rpc_service_lookup(service, method_name,
+                                          strlen(method_name));
+
+  insist(method != NULL && method->callback != NULL,
+         "Method '%s' must be registered before setting its policy",
+         method_name);
+  insist(method->queue == NULL, "Method '%s' already runs off the loop",
+         method_name);
+
+  switch (policy) {
+    case RPC_INLINE:
+      break;
+    case RPC_POOL:
+      if (!service->pool_started) {
+        int workers = service->workers;
+        if (workers <= 0) {
+          workers = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        rpc_workers_start(&service->pool, workers > 0 ? workers : 1);
+        service->pool_started = 1;
+      }
+      method->queue = &service->pool;
+      break;
+    case RPC_THREAD:
+      /* Not freed: like the thread, it lasts as long as the method */
+      method->queue = calloc(1, sizeof(rpc_queue));
+      rpc_queue_init(method->queue);
+      rpc_workers_start(method->queue, 1);
+      break;
+  }
+} /* rpc_service_set_policy */
+
+void rpc_queue_init(rpc_queue *queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->ready, NULL);
+  queue->head = NULL;
+  queue->tail = &queue->head;
+} /* rpc_queue_init */
+
+void rpc_queue_push(rpc_queue *queue, rpc_reply_t *reply) {
+  reply->next = NULL;
+  pthread_mutex_lock(&queue->lock);
+  *queue->tail = reply;
+  queue->tail = &reply->next;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+} /* rpc_queue_push */
+
+rpc_reply_t *rpc_queue_pop(rpc_queue *queue) {
+  rpc_reply_t *reply;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->head == NULL) {
+    pthread_cond_wait(&queue->ready, &queue->lock);
+  }
+  reply = queue->head;
+  queue->head = reply->next;
+  if (queue->head == NULL) {
+    queue->tail = &queue->head;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return reply;
+} /* rpc_queue_pop */
+
+void rpc_workers_start(rpc_queue *queue, int count) {
+  pthread_t thread;
+  int i;
+  int rc;
+
+  for (i = 0; i < count; i++) {
+    rc = pthread_create(&thread, NULL, rpc_worker, queue);
+    insist(rc == 0, "pthread_create failed, error(%d): %s", rc,
+           strerror(rc));
+    pthread_detach(thread);
+  }
+} /* rpc_workers_start */
+
+void *rpc_worker(void *data) {
+  rpc_queue *queue = data;
+
+  for (;;) {
+    rpc_reply_run(rpc_queue_pop(queue));
+  }
+  return NULL;
+} /* rpc_worker */
+
+/* Run a queued call's handler, then send its reply back to the loop
+ * unless the handler deferred it further */
+void rpc_reply_run(rpc_reply_t *reply) {
+  int deferred;
+
+  worker_reply = reply;
+  worker_deferred = 0;
+  reply->callback(reply, reply->request_obj, &reply->result, &reply->error,
+                  reply->data);
+  deferred = worker_deferred;
+  worker_reply = NULL;
+
+  if (!deferred) {
+    rpc_reply_send(reply);
+  }
+} /* rpc_reply_run */
+
+/* A reply packing into 'buffer', or into one of its own if NULL */
+rpc_reply_t *rpc_reply_new(rpc_service_t *service, msgpack_sbuffer *buffer) {
+  rpc_reply_t *reply = calloc(1, sizeof(rpc_reply_t));
+
+  reply->service = service;
+  reply->buffer = buffer != NULL ? buffer : msgpack_sbuffer_new();
+  msgpack_packer_init(&reply->result, reply->buffer, msgpack_sbuffer_write);
+  msgpack_packer_init(&reply->error, reply, rpc_reply_error_write);
+  return reply;
+} /* rpc_reply_new */
+
+/* Start a reply: { "id": id, "result": <the next object packed> ...
+ * "id" only for calls in a batch; nil if the call had none. */
+void rpc_reply_begin(rpc_reply_t *reply, msgpack_object *id) {
+  reply->start = reply->buffer->size;
+  if (reply->batch != NULL) {
+    msgpack_pack_map(&reply->result, 4); /* id, result, error, duration */
+    msgpack_pack_string(&reply->result, "id", 2);
+    if (id != NULL) {
+      msgpack_pack_object(&reply->result, *id);
+    } else {
+      msgpack_pack_nil(&reply->result);
+    }
+  } else {
+    msgpack_pack_map(&reply->result, 3); /* result, error, duration */
+  }
+  msgpack_pack_string(&reply->result, "result", 6);
+  reply->result_start = reply->buffer->size;
+} /* rpc_reply_begin */
+
+/* Move what a call in a batch has packed so far out of the batch's buffer
+ * into one of its own, for a reply that will be finished later */
+void rpc_reply_detach(rpc_reply_t *reply) {
+  msgpack_sbuffer *shared = reply->buffer;
+
+  reply->buffer = msgpack_sbuffer_new();
+  msgpack_sbuffer_write(reply->buffer, shared->data + reply->start,
+                        shared->size - reply->start);
+  shared->size = reply->start;
+  reply->result_start -= reply->start;
+  reply->start = 0;
+  msgpack_packer_init(&reply->result, reply->buffer, msgpack_sbuffer_write);
+} /* rpc_reply_detach */
+
+void rpc_reply_free(rpc_reply_t *reply) {
+  size_t i;
+
+  for (i = 0; i < reply->envelope_count; i++) {
+    zmq_msg_close(&reply->envelope[i]);
+  }
+  if (reply->buffer != NULL) { /* never sent */
+    msgpack_sbuffer_free(reply->buffer);
+  }
+  if (reply->zone != NULL) { /* the call it kept */
+    zmq_msg_close(&reply->request);
+    rpc_service_zone_give(reply->service, reply->zone);
+  }
+  free(reply);
+} /* rpc_reply_free */
+
+/* The zone calls are being decoded into, for a call to keep; the service
+ * decodes into a spare from here on */
+msgpack_zone *rpc_service_zone_take(rpc_service_t *service) {
+  msgpack_zone *zone = service->zone;
+
+  if (service->spare_count > 0) {
+    service->zone = service->spare_zones[--service->spare_count];
+  } else {
+    service->zone = msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  }
+  return zone;
+} /* rpc_service_zone_take */
+
+/* A zone a call is done with, cleared for the next call to take */
+void rpc_service_zone_give(rpc_service_t *service, msgpack_zone *zone) {
+  if (service->spare_count < RPC_SPARE_ZONES) {
+    msgpack_zone_clear(zone);
+    service->spare_zones[service->spare_count++] = zone;
+  } else {
+    msgpack_zone_free(zone);
+  }
+} /* rpc_service_zone_give */
+
+/* The 'error' packer's writer. The "error" key goes in ahead of the first
+ * thing packed into it, and a nil result ahead of that if nothing was
+ * packed into 'result'. */
+int rpc_reply_error_write(void *data, const char *buf, unsigned int len) {
+  rpc_reply_t *reply = data;
+
+  if (!reply->error_started) {
+    reply->error_started = 1;
+    reply->failed = !(len == 1 && (unsigned char)buf[0] == 0xc0); /* nil */
+    if (reply->buffer->size == reply->result_start) {
+      msgpack_pack_nil(&reply->result);
+    }
+    msgpack_pack_string(&reply->result, "error", 5);
+  }
+  return msgpack_sbuffer_write(reply->buffer, buf, len);
+} /* rpc_reply_error_write */
+
+/* Fill in whatever the handler left out, and how long the call took */
+void rpc_reply_finish(rpc_reply_t *reply) {
+  unsigned long usec = zmq_stopwatch_stop(reply->clock);
+  double duration = usec / 1000000.;
+
+  if (!reply->error_started) {
+    msgpack_pack_nil(&reply->error);
+  }
+  if (reply->stats != NULL) {
+    reply->stats->calls++;
+    reply->stats->errors += reply->failed;
+    histogram_record(&reply->stats->latency, usec);
+  }
+  msgpack_pack_string(&reply->result, "duration", 8);
+  msgpack_pack_double(&reply->result, duration);
+} /* rpc_reply_finish */
+
+msgpack_object *rpc_object_get(msgpack_object *obj, const char *key) {
+  size_t len = strlen(key);
+  uint32_t i;
+
+  if (obj->type != MSGPACK_OBJECT_MAP) {
+    return NULL;
+  }
+  for (i = 0; i < obj->via.map.size; i++) {
+    msgpack_object *k = &obj->via.map.ptr[i].key;
+    if (k->type == MSGPACK_OBJECT_RAW && k->via.raw.size == len
+        && memcmp(k->via.raw.ptr, key, len) == 0) {
+      return &obj->via.map.ptr[i].val;
+    }
+  }
+  return NULL;
+} /* rpc_object_get */
 
 void rpc_service_register(rpc_service_t *service, const char *method_name,
                           rpc_callback *callback, void *data) {
-  rpc_method *method = calloc(1, sizeof(rpc_method));
-  rpc_name *name = calloc(1, sizeof(rpc_method));
+  size_t len = strlen(method_name);
+  rpc_method *method = rpc_service_lookup(service, method_name, len);
 
-  name->name = method_name;
-  name->len = strlen(method_name);
+  printf("Registering method '%.*s'\n", (int)len, method_name);
+  if (method == NULL) {
+    /* A name we haven't seen; hash them all again with it */
+    size_t count = service->method_count + 1;
+    rpc_method *methods = calloc(count, sizeof(rpc_method));
+    size_t i;
+
+    for (i = 0; i < service->method_count; i++) {
+      methods[i] = service->methods[i];
+    }
+    methods[i].name.name = method_name;
+    methods[i].name.len = len;
+    rpc_service_hash_methods(service, methods, count);
+    free(methods);
 
+    method = rpc_service_lookup(service, method_name, len);
+  }
+
+  /* Registering a name again replaces it, like it always has */
   method->callback = callback;
   method->data = data;
-  printf("Registering method '%.*s'\n", (int)name->len, name->name);
-  g_tree_replace(service->methods, name, method);
+  if (method->stats == NULL) {
+    method->stats = calloc(1, sizeof(rpc_method_stats));
+    histogram_init(&method->stats->latency);
+  }
 } /* rpc_service_register */
 
-void rpc_m_list_methods(void *context, msgpack_object *request,
-                        msgpack_packer *result, msgpack_packer *error,
-                        void *data) {
+void rpc_service_register_args(rpc_service_t *service,
+                               const char *method_name,
+                               rpc_args_callback *callback, void *data,
+                               const rpc_arg *schema, size_t size) {
+  rpc_args *args = rpc_args_compile(schema, size);
 
-  //msgpack_pack_array(result, 1);
-  msgpack_pack_string(result, "danced", 6);
-  msgpack_pack_nil(error);
-} /* rpc_m_list_methods */
+  /* The method proper checks its arguments, then calls 'callback' */
+  args->callback = callback;
+  args->data = data;
+  rpc_service_register(service, method_name, rpc_args_call, args);
+} /* rpc_service_register_args */
 
-void rpc_m_echo(void *context, msgpack_object *request,
-                msgpack_packer *result, msgpack_packer *error, void *data) {
-  int i;
+/* Not freed: like the method, the schema is registered for good */
+rpc_args *rpc_args_compile(const rpc_arg *schema, size_t size) {
+  static const size_t sizes[] = {
+    [RPC_ARG_INT] = sizeof(int64_t),
+    [RPC_ARG_UINT] = sizeof(uint64_t),
+    [RPC_ARG_DOUBLE] = sizeof(double),
+    [RPC_ARG_BOOL] = sizeof(int),
+    [RPC_ARG_STRING] = sizeof(rpc_name),
+    [RPC_ARG_ARRAY] = sizeof(msgpack_object *),
+    [RPC_ARG_MAP] = sizeof(msgpack_object *),
+    [RPC_ARG_ANY] = sizeof(msgpack_object *),
+  };
+  size_t count = 0;
+  size_t i;
+  rpc_args *args;
 
-  /* Hack to get the 'args' object from the msgpack and ship it back to the
-   * requester */
-  for (i = 0; i < request->via.map.size; i++) {
-    msgpack_object *key = (msgpack_object *)&(request->via.map.ptr[i].key);
-    if (strncmp("args", key->via.raw.ptr, key->via.raw.size)) {
-      continue;
+  while (schema[count].name != NULL) {
+    count++;
+  }
+  insist(count <= RPC_ARGS_MAX, "A schema can have at most %d arguments, "
+         "not %zu", RPC_ARGS_MAX, count);
+
+  args = calloc(1, sizeof(rpc_args) + count * sizeof(rpc_arg_op));
+  args->size = size;
+  args->count = count;
+  for (i = 0; i < count; i++) {
+    const rpc_arg *arg = &schema[i];
+    insist(arg->type <= RPC_ARG_ANY, "Argument '%s' has unknown type %d",
+           arg->name, arg->type);
+    insist(arg->offset + sizes[arg->type] <= size, "Argument '%s' doesn't "
+           "fit in a %zu byte struct", arg->name, size);
+    args->ops[i].name = arg->name;
+    args->ops[i].len = strlen(arg->name);
+    args->ops[i].type = arg->type;
+    args->ops[i].offset = arg->offset;
+    if (!arg->optional) {
+      args->required |= (uint64_t)1 << i;
     }
+  }
+  return args;
+} /* rpc_args_compile */
+
+/* The callback of every method registered with a schema */
+void rpc_args_call(void *context, msgpack_object *request,
+                   msgpack_packer *result, msgpack_packer *error,
+                   void *data) {
+  rpc_args *args = data;
+  uint64_t values[args->size / sizeof(uint64_t) + 1]; /* aligned for any */
+  rpc_name bad = { NULL, 0 };
+  const char *problem;
 
-    msgpack_object *curvalue = (msgpack_object *)&(request->via.map.ptr[i].val);
-    msgpack_pack_object(result, *curvalue);
-    msgpack_pack_nil(error);
-    break;
+  problem = rpc_args_extract(args, rpc_object_get(request, "args"), values,
+                             &bad);
+  if (problem != NULL) {
+    msgpack_pack_nil(result); /* result is nil on error */
+    msgpack_pack_map(error, 3);
+    msgpack_pack_string(error, "error", -1);
+    msgpack_pack_string(error, problem, -1);
+    msgpack_pack_string(error, "argument", -1);
+    if (bad.name != NULL) {
+      msgpack_pack_string(error, bad.name, bad.len);
+    } else {
+      msgpack_pack_nil(error);
+    }
+    msgpack_pack_string(error, "request", -1);
+    msgpack_pack_object(error, *request);
+    return;
   }
-} /* rpc_m_echo */
+  args->callback(context, values, result, error, args->data);
+} /* rpc_args_call */
 
-int rpc_name_cmp(const void *a, const void *b) {
-  const rpc_name *ma = a;
-  const rpc_name *mb = b;
+/* Check the arguments a call was 'given' against 'args', filling 'out'
+ * in. Returns what was wrong, naming the argument in 'bad', or NULL if
+ * nothing was. One pass over what was given, whether array or map. */
+const char *rpc_args_extract(const rpc_args *args, msgpack_object *given,
+                             void *out, rpc_name *bad) {
+  uint64_t seen = 0;
+  uint32_t i;
+  size_t j;
 
-  if (ma->len < mb->len) {
-    return strncmp(ma->name, mb->name, ma->len);
+  memset(out, 0, args->size);
+  if (given == NULL || given->type == MSGPACK_OBJECT_NIL) {
+    /* No arguments at all */
+  } else if (given->type == MSGPACK_OBJECT_ARRAY) {
+    if (given->via.array.size > args->count) {
+      return "Too many arguments";
+    }
+    for (i = 0; i < given->via.array.size; i++) {
+      if (given->via.array.ptr[i].type == MSGPACK_OBJECT_NIL) {
+        continue;
+      }
+      if (!rpc_arg_store(&args->ops[i], &given->via.array.ptr[i], out)) {
+        bad->name = args->ops[i].name;
+        bad->len = args->ops[i].len;
+        return "Argument has the wrong type";
+      }
+      seen |= (uint64_t)1 << i;
+    }
+  } else if (given->type == MSGPACK_OBJECT_MAP) {
+    for (i = 0; i < given->via.map.size; i++) {
+      msgpack_object *key = &given->via.map.ptr[i].key;
+      const rpc_arg_op *op = NULL;
+
+      if (key->type == MSGPACK_OBJECT_RAW) {
+        for (j = 0; j < args->count; j++) {
+          if (args->ops[j].len == key->via.raw.size
+              && memcmp(args->ops[j].name, key->via.raw.ptr,
+                        key->via.raw.size) == 0) {
+            op = &args->ops[j];
+            break;
+          }
+        }
+      }
+      if (op == NULL) {
+        if (key->type == MSGPACK_OBJECT_RAW) {
+          bad->name = key->via.raw.ptr;
+          bad->len = key->via.raw.size;
+        }
+        return "No such argument";
+      }
+      if (given->via.map.ptr[i].val.type == MSGPACK_OBJECT_NIL) {
+        continue;
+      }
+      if (!rpc_arg_store(op, &given->via.map.ptr[i].val, out)) {
+        bad->name = op->name;
+        bad->len = op->len;
+        return "Argument has the wrong type";
+      }
+      seen |= (uint64_t)1 << (op - args->ops);
+    }
   } else {
-    return strncmp(ma->name, mb->name, mb->len);
+    return "Arguments must be an array or a map";
+  }
+
+  if ((seen & args->required) != args->required) {
+    j = __builtin_ctzll(args->required & ~seen);
+    bad->name = args->ops[j].name;
+    bad->len = args->ops[j].len;
+    return "Missing argument";
+  }
+  return NULL;
+} /* rpc_args_extract */
+
+/* Store one argument in its field, if it is of the right type. Returns 0
+ * if it isn't. */
+int rpc_arg_store(const rpc_arg_op *op, msgpack_object *value, void *out) {
+  char *field = (char *)out + op->offset;
+
+  switch (op->type) {
+    case RPC_ARG_INT:
+      if (value->type == MSGPACK_OBJECT_POSITIVE_INTEGER
+          && value->via.u64 <= INT64_MAX) {
+        *(int64_t *)field = (int64_t)value->via.u64;
+      } else if (value->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        *(int64_t *)field = value->via.i64;
+      } else {
+        return 0;
+      }
+      break;
+    case RPC_ARG_UINT:
+      if (value->type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        return 0;
+      }
+      *(uint64_t *)field = value->via.u64;
+      break;
+    case RPC_ARG_DOUBLE:
+      if (value->type == MSGPACK_OBJECT_DOUBLE) {
+        *(double *)field = value->via.dec;
+      } else if (value->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+        *(double *)field = (double)value->via.u64;
+      } else if (value->type == MSGPACK_OBJECT_NEGATIVE_INTEGER) {
+        *(double *)field = (double)value->via.i64;
+      } else {
+        return 0;
+      }
+      break;
+    case RPC_ARG_BOOL:
+      if (value->type != MSGPACK_OBJECT_BOOLEAN) {
+        return 0;
+      }
+      *(int *)field = value->via.boolean;
+      break;
+    case RPC_ARG_STRING:
+      if (value->type != MSGPACK_OBJECT_RAW) {
+        return 0;
+      }
+      ((rpc_name *)field)->name = value->via.raw.ptr;
+      ((rpc_name *)field)->len = value->via.raw.size;
+      break;
+    case RPC_ARG_ARRAY:
+    case RPC_ARG_MAP:
+      if (value->type != (op->type == RPC_ARG_ARRAY ? MSGPACK_OBJECT_ARRAY
+                                                    : MSGPACK_OBJECT_MAP)) {
+        return 0;
+      }
+      *(msgpack_object **)field = value;
+      break;
+    case RPC_ARG_ANY:
+      *(msgpack_object **)field = value;
+      break;
+  }
+  return 1;
+} /* rpc_arg_store */
+
+void rpc_service_load_methods(rpc_service_t *service,
+                              const rpc_method_table *table) {
+  size_t i;
+
+  insist(service->method_count == 0, "Method tables must be loaded before "
+         "any method is registered");
+  service->methods = calloc(table->count, sizeof(rpc_method));
+  service->method_seeds = calloc(table->count, sizeof(uint32_t));
+  service->method_count = table->count;
+  service->method_salt = table->salt;
+  for (i = 0; i < table->count; i++) {
+    service->methods[i].name.name = table->names[i];
+    service->methods[i].name.len = strlen(table->names[i]);
+    service->method_seeds[i] = table->seeds[i];
+  }
+
+  /* A table printed from another version of this hash would send lookups
+   * to the wrong slots; make sure every name is where the table says. */
+  for (i = 0; i < table->count; i++) {
+    rpc_name *name = &service->methods[i].name;
+    insist(rpc_service_lookup(service, name->name, name->len)
+           == &service->methods[i], "Method table entry '%s' is not in the "
+           "slot its hash picks; regenerate the table", name->name);
+  }
+} /* rpc_service_load_methods */
+
+void rpc_service_print_methods(rpc_service_t *service, FILE *out,
+                               const char *prefix) {
+  size_t i;
+
+  fprintf(out, "/* Generated by rpc_service_print_methods */\n");
+  fprintf(out, "static const uint32_t %s_seeds[] = {", prefix);
+  for (i = 0; i < service->method_count; i++) {
+    fprintf(out, "%s%s%u", i == 0 ? "" : ",", i % 8 == 0 ? "\n  " : " ",
+            service->method_seeds[i]);
+  }
+  fprintf(out, "\n};\n");
+
+  fprintf(out, "static const char *%s_names[] = {\n", prefix);
+  for (i = 0; i < service->method_count; i++) {
+    rpc_name *name = &service->methods[i].name;
+    fprintf(out, "  \"%.*s\",\n", (int)name->len, name->name);
+  }
+  fprintf(out, "};\n");
+
+  fprintf(out, "static const rpc_method_table %s = {\n"
+          "  %u, %zu, %s_seeds, %s_names\n};\n", prefix,
+          service->method_salt, service->method_count, prefix, prefix);
+} /* rpc_service_print_methods */
+
+/* Find the slot for 'name': the bucket its hash falls in gives the seed
+ * that sends it to its slot. Names that were never registered land on some
+ * other name's slot, or a slot loaded from a table and not yet registered,
+ * and the caller sees that. */
+rpc_method *rpc_service_lookup(rpc_service_t *service, const char *name,
+                               size_t len) {
+  uint32_t hash;
+  uint32_t seed;
+  rpc_method *method;
+
+  if (service->method_count == 0) {
+    return NULL;
+  }
+
+  hash = rpc_name_hash(service->method_salt, name, len);
+  seed = service->method_seeds[hash % service->method_count];
+  method = &service->methods[rpc_method_slot(hash, seed,
+                                             service->method_count)];
+  if (method->name.len != len || memcmp(method->name.name, name, len) != 0) {
+    return NULL;
   }
-} /* rpc_name_cmp */
+  return method;
+} /* rpc_service_lookup */
+
+/* Replace the service's method table with one laying out 'methods' */
+void rpc_service_hash_methods(rpc_service_t *service,
+                              const rpc_method *methods, size_t count) {
+  rpc_method *slots = calloc(count, sizeof(rpc_method));
+  uint32_t *seeds = calloc(count, sizeof(uint32_t));
+  uint32_t salt;
+
+  for (salt = 0; salt < RPC_METHOD_SALTS; salt++) {
+    memset(seeds, 0, count * sizeof(uint32_t));
+    if (rpc_methods_place(methods, count, salt, slots, seeds) == 0) {
+      break;
+    }
+  }
+  insist(salt < RPC_METHOD_SALTS, "Couldn't find a perfect hash for %zu "
+         "method names", count);
+
+  free(service->methods);
+  free(service->method_seeds);
+  service->methods = slots;
+  service->method_seeds = seeds;
+  service->method_count = count;
+  service->method_salt = salt;
+} /* rpc_service_hash_methods */
+
+/* Hash and displace: group the names into buckets by their hash, then,
+ * biggest bucket first, find a seed that moves every name in the bucket
+ * into a free slot. Returns 0, or -1 if some bucket has no such seed. */
+int rpc_methods_place(const rpc_method *methods, size_t count, uint32_t salt,
+                      rpc_method *slots, uint32_t *seeds) {
+  uint32_t *hashes = calloc(count, sizeof(uint32_t));
+  size_t *start = calloc(count + 1, sizeof(size_t)); /* each bucket's first */
+  size_t *order = calloc(count, sizeof(size_t)); /* names, by bucket */
+  size_t *placed = calloc(count, sizeof(size_t)); /* one bucket's slots */
+  char *taken = calloc(count, 1);
+  size_t biggest = 0;
+  size_t i;
+  size_t size;
+  size_t bucket;
+  int rc = 0;
+
+  for (i = 0; i < count; i++) {
+    hashes[i] = rpc_name_hash(salt, methods[i].name.name,
+                              methods[i].name.len);
+    start[hashes[i] % count + 1]++;
+  }
+  for (bucket = 0; bucket < count; bucket++) {
+    size = start[bucket + 1];
+    biggest = size > biggest ? size : biggest;
+    start[bucket + 1] += start[bucket];
+    placed[bucket] = start[bucket];
+  }
+  for (i = 0; i < count; i++) {
+    order[placed[hashes[i] % count]++] = i;
+  }
+
+  for (size = biggest; size > 0; size--) {
+    for (bucket = 0; bucket < count; bucket++) {
+      size_t first = start[bucket];
+      uint32_t seed;
+
+      if (start[bucket + 1] - first != size) {
+        continue;
+      }
+
+      for (seed = 1; seed <= RPC_METHOD_SEEDS; seed++) {
+        size_t n;
+        for (n = 0; n < size; n++) {
+          size_t slot = rpc_method_slot(hashes[order[first + n]], seed, count);
+          size_t k;
+
+          for (k = 0; k < n && placed[k] != slot; k++);
+          if (taken[slot] || k < n) {
+            break;
+          }
+          placed[n] = slot;
+        }
+        if (n == size) {
+          break;
+        }
+      }
+      if (seed > RPC_METHOD_SEEDS) {
+        rc = -1;
+        goto done;
+      }
+
+      seeds[bucket] = seed;
+      for (i = 0; i < size; i++) {
+        taken[placed[i]] = 1;
+        slots[placed[i]] = methods[order[first + i]];
+      }
+    }
+  }
+
+done:
+  free(hashes);
+  free(start);
+  free(order);
+  free(placed);
+  free(taken);
+  return rc;
+} /* rpc_methods_place */
+
+/* FNV-1a */
+uint32_t rpc_name_hash(uint32_t salt, const char *name, size_t len) {
+  uint32_t hash = 2166136261u ^ salt;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+} /* rpc_name_hash */
+
+/* Mix the seed into the name's hash (murmur3's finalizer) so each seed
+ * sends the same name somewhere else */
+size_t rpc_method_slot(uint32_t hash, uint32_t seed, size_t count) {
+  hash ^= seed * 0x9e3779b9u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash % count;
+} /* rpc_method_slot */
+
+/* Every registered method's counts and latency:
+ *   { "<method>": { "calls": n, "errors": n,
+ *                   "latency_usec": { "mean": us, "p50": us, "p90": us,
+ *                                     "p99": us, "p99.9": us, "max": us } },
+ *     ... }
+ * Called with args { "reset": true }, everything is zeroed once reported.
+ * Reads what the loop writes, so it must stay inline. */
+void rpc_m_stats(void *context, void *args, msgpack_packer *result,
+                 msgpack_packer *error, void *data) {
+  static const double percentiles[] = { 50, 90, 99, 99.9 };
+  static const char *percentile_names[] = { "p50", "p90", "p99", "p99.9" };
+  rpc_service_t *service = data;
+  rpc_stats_args *stats_args = args;
+  size_t count = 0;
+  size_t i;
+  int p;
+
+  for (i = 0; i < service->method_count; i++) {
+    count += service->methods[i].stats != NULL;
+  }
+
+  msgpack_pack_map(result, count);
+  for (i = 0; i < service->method_count; i++) {
+    rpc_method *method = &service->methods[i];
+    rpc_method_stats *stats = method->stats;
+    if (stats == NULL) { /* in a loaded table, but not registered */
+      continue;
+    }
+
+    msgpack_pack_string(result, method->name.name, method->name.len);
+    msgpack_pack_map(result, 3);
+    msgpack_pack_string(result, "calls", -1);
+    msgpack_pack_uint64(result, stats->calls);
+    msgpack_pack_string(result, "errors", -1);
+    msgpack_pack_uint64(result, stats->errors);
+    msgpack_pack_string(result, "latency_usec", -1);
+    msgpack_pack_map(result, 6);
+    msgpack_pack_string(result, "mean", -1);
+    msgpack_pack_double(result, histogram_mean(&stats->latency));
+    for (p = 0; p < 4; p++) {
+      msgpack_pack_string(result, percentile_names[p], -1);
+      msgpack_pack_uint64(result, histogram_percentile(&stats->latency,
+                                                       percentiles[p]));
+    }
+    msgpack_pack_string(result, "max", -1);
+    msgpack_pack_uint64(result, stats->latency.max);
+
+    if (stats_args->reset) {
+      stats->calls = 0;
+      stats->errors = 0;
+      histogram_init(&stats->latency);
+    }
+  }
+  msgpack_pack_nil(error);
+} /* rpc_m_stats */
+
+/* Ship the 'args' object back to the requester, whatever it is */
+void rpc_m_echo(void *context, msgpack_object *request,
+                msgpack_packer *result, msgpack_packer *error, void *data) {
+  msgpack_object *args = rpc_object_get(request, "args");
+
+  if (args != NULL) {
+    msgpack_pack_object(result, *args);
+  }
+  msgpack_pack_nil(error);
+} /* rpc_m_echo */
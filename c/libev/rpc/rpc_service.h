@@ -3,8 +3,138 @@
 
 #include <ev.h>
 #include <msgpack.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <zmq.h>
+#include "histogram.h"
 #include "porter.h"
 
+/* Most envelope frames a call may come with: one per ROUTER it passed
+ * through on the way here, and an empty delimiter */
+#define RPC_ENVELOPE_MAX 8
+
+/* Decoding zones a service keeps cleared and ready, beyond the one in use */
+#define RPC_SPARE_ZONES 16
+
+/* Most arguments one schema can describe */
+#define RPC_ARGS_MAX 64
+
+/** A method. It packs one object, its result, into 'result', then one
+ * into 'error': nil, or what went wrong. Both go straight into the
+ * response; anything left unpacked is sent as nil. To answer later
+ * instead, it passes 'context' to rpc_defer. */
+typedef void (rpc_callback)(void *context, msgpack_object *request,
+                            msgpack_packer *result, msgpack_packer *error,
+                            void *data);
+                            
+typedef struct {
+  const char *name;
+  size_t len;
+} rpc_name;
+
+/** The type of an argument, and what its field in the method's arguments
+ * struct is */
+typedef enum {
+  RPC_ARG_INT, /* int64_t */
+  RPC_ARG_UINT, /* uint64_t */
+  RPC_ARG_DOUBLE, /* double; integers are converted */
+  RPC_ARG_BOOL, /* int */
+  RPC_ARG_STRING, /* rpc_name, pointing into the request */
+  RPC_ARG_ARRAY, /* msgpack_object *, into the request */
+  RPC_ARG_MAP, /* msgpack_object *, into the request */
+  RPC_ARG_ANY /* msgpack_object *, into the request */
+} rpc_arg_type;
+
+/** One argument of a method's schema. Arguments come either as an array,
+ * in schema order, or as a map by name. An optional argument that is left
+ * out, or nil, is left zero. */
+typedef struct {
+  const char *name;
+  rpc_arg_type type;
+  size_t offset; /* of its field in the arguments struct */
+  int optional;
+} rpc_arg;
+
+#define RPC_ARG(struct_type, field, arg_type) \
+  { #field, arg_type, offsetof(struct_type, field), 0 }
+#define RPC_ARG_OPTIONAL(struct_type, field, arg_type) \
+  { #field, arg_type, offsetof(struct_type, field), 1 }
+#define RPC_ARGS_END { NULL, 0, 0, 0 }
+
+/** A method with a schema. It gets its arguments already checked and
+ * filled into a struct of the schema's type, and answers like any other
+ * method. The struct lasts as long as 'request' would. */
+typedef void (rpc_args_callback)(void *context, void *args,
+                                 msgpack_packer *result,
+                                 msgpack_packer *error, void *data);
+
+/** A schema compiled for checking calls against: one step per argument,
+ * with everything about it worked out ahead of time */
+typedef struct {
+  const char *name;
+  size_t len;
+  rpc_arg_type type;
+  size_t offset;
+} rpc_arg_op;
+
+typedef struct {
+  rpc_args_callback *callback;
+  void *data;
+  size_t size; /* of the arguments struct */
+  uint64_t required; /* a bit per op that must be given */
+  size_t count;
+  rpc_arg_op ops[];
+} rpc_args;
+
+/** Where a method runs */
+typedef enum {
+  RPC_INLINE = 0, /* on the service's loop, as the call comes in */
+  RPC_POOL, /* on the service's pool of worker threads */
+  RPC_THREAD /* on a thread of the method's own, one call at a time */
+} rpc_policy;
+
+/** Calls waiting for a worker thread */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct rpc_reply *head;
+  struct rpc_reply **tail;
+} rpc_queue;
+
+/** What a method has done since it was registered or its stats were last
+ * reset. Replies are only ever finished on the loop, so only the loop
+ * writes these and there is nothing to lock. */
+typedef struct {
+  uint64_t calls;
+  uint64_t errors; /* calls answered with an error that wasn't nil */
+
+  /** Microseconds from its handler being called to its reply being sent */
+  Histogram latency;
+} rpc_method_stats;
+
+typedef struct {
+  rpc_name name;
+  rpc_callback *callback;
+  void *data;
+
+  /** Kept apart from the method, so rebuilding the table doesn't move it */
+  rpc_method_stats *stats;
+
+  /** Where calls wait for the thread that runs them; NULL to run inline */
+  rpc_queue *queue;
+} rpc_method;
+
+/** A method table worked out ahead of time, for methods known when the
+ * service is compiled. rpc_service_print_methods writes one out as C;
+ * load it with rpc_service_load_methods before registering those methods
+ * and registering them costs no rebuild. */
+typedef struct {
+  uint32_t salt;
+  size_t count;
+  const uint32_t *seeds;
+  const char **names; /* in slot order */
+} rpc_method_table;
+
 typedef struct {
   /** libev io structure */
   ev_io io;
@@ -21,30 +151,134 @@ typedef struct {
   /** The zmq socket */
   void *socket;
 
-  /** All registered methods .
-   * this is a tree of string type -> rpc_method type
-   */
-  GTree *methods;
+  /** All registered methods, each in the slot a minimal perfect hash of its
+   * name picks, so looking one up is one hash of the name and one compare.
+   * Rebuilt whenever a new method is registered. */
+  rpc_method *methods;
+  size_t method_count;
+
+  /** Hash seed per bucket of names, and the salt the bucket hash was
+   * computed with; see rpc_service_lookup */
+  uint32_t *method_seeds;
+  uint32_t method_salt;
+
+  /** Deferred replies finished on other threads, waiting for the loop to
+   * send them; see rpc_reply_send */
+  ev_async reply_async;
+  pthread_mutex_t reply_lock;
+  struct rpc_reply *replies;
+  struct rpc_reply **replies_tail;
+
+  /** Calls to RPC_POOL methods, and how many threads take them: set before
+   * the first method is put in the pool; 0 for one per CPU */
+  rpc_queue pool;
+  int workers;
+  int pool_started;
+
+  /** Every call is decoded into 'zone', which is cleared, not freed, once
+   * the call is answered. A call kept past that, for a worker or for the
+   * rest of its batch, takes the zone with it and the next call is decoded
+   * into a spare; the zone is cleared and spared again when the call is
+   * done. Only the loop touches these. */
+  msgpack_zone *zone;
+  msgpack_zone *spare_zones[RPC_SPARE_ZONES];
+  size_t spare_count;
 } rpc_service_t;
 
-typedef void (rpc_callback)(void *context, msgpack_object *request,
-                            msgpack_packer *result, msgpack_packer *error,
-                            void *data);
-                            
-typedef struct {
-  const char *name;
-  size_t len;
-} rpc_name;
+/** The reply to one call, packed as the call is answered:
+ *   { "result": ..., "error": ..., "duration": seconds }
+ * and sent back along the envelope the call came with.
+ *
+ * A batch, an array of calls each with an "id" in place of one call, gets
+ * an array of replies, each with the "id" of its call, in one message.
+ * The batch's own reply carries the envelope and the array; the reply to
+ * each of its calls packs straight into the array, unless the call runs
+ * off the loop or is deferred, in which case it is packed apart and added
+ * when done. Replies come in the order their calls finish. */
+typedef struct rpc_reply {
+  /** Pack the result into 'result', then the error into 'error'; both write
+   * straight into 'buffer' */
+  msgpack_packer result;
+  msgpack_packer error;
 
-typedef struct {
+  /** The service the call came to */
+  rpc_service_t *service;
+
+  /** Every frame of the call before its body */
+  zmq_msg_t envelope[RPC_ENVELOPE_MAX];
+  size_t envelope_count;
+
+  msgpack_sbuffer *buffer;
+  size_t start; /* where this reply starts in 'buffer' */
+  size_t result_start; /* where the result starts in 'buffer' */
+  int error_started;
+  int failed; /* what was packed into 'error' wasn't nil */
+
+  /** The method called, counted when the reply is finished; NULL if there
+   * was no such method */
+  rpc_method_stats *stats;
+
+  /** Set by rpc_defer: the handler returning doesn't send this reply */
+  int deferred;
+
+  /** Times the call, from its handler being called to its reply being sent */
+  void *clock;
+
+  /** For calls run off the loop, and batches: the call and the zone it was
+   * decoded into, kept until the reply is sent, and the handler */
+  zmq_msg_t request;
+  msgpack_zone *zone;
+  msgpack_object *request_obj;
   rpc_callback *callback;
   void *data;
-} rpc_method;
+
+  /** For a call in a batch, the batch's reply; for a batch, how many of
+   * its calls are still to be answered */
+  struct rpc_reply *batch;
+  size_t pending;
+
+  /** Next in the service's queue of replies to send */
+  struct rpc_reply *next;
+} rpc_reply_t;
 
 rpc_service_t *rpc_service_new(const char *address);
 void rpc_service_start(rpc_service_t *service, struct ev_loop *ev);
 void rpc_service_register(rpc_service_t *service, const char *method_name,
                           rpc_callback *callback, void *data);
+/* Register a method taking the arguments 'schema' (ended by RPC_ARGS_END)
+ * describes, into a struct 'size' bytes long. Calls whose arguments don't
+ * match are answered with an error naming the argument, and never reach
+ * 'callback'. */
+void rpc_service_register_args(rpc_service_t *service,
+                               const char *method_name,
+                               rpc_args_callback *callback, void *data,
+                               const rpc_arg *schema, size_t size);
+void rpc_service_load_methods(rpc_service_t *service,
+                              const rpc_method_table *table);
+void rpc_service_print_methods(rpc_service_t *service, FILE *out,
+                               const char *prefix);
+
+/* Methods run inline unless told otherwise here. Off the loop, the loop
+ * only decodes a call and queues it; the worker runs the handler and its
+ * reply comes back to the loop to be sent as if deferred. A method's
+ * policy can only be set once. */
+void rpc_service_set_policy(rpc_service_t *service, const char *method_name,
+                            rpc_policy policy);
+
+/* Answer a call later. A handler passes its 'context' here and returns
+ * without packing anything; the reply returned is how the call is
+ * continued. Pack its result and error from any thread, then hand it to
+ * rpc_reply_send. The request is freed when the handler returns, so copy
+ * anything needed from it first. */
+rpc_reply_t *rpc_defer(void *context);
+
+/* Queue a deferred reply for the service's loop to send. Safe from any
+ * thread; the reply belongs to the service again afterwards. */
+void rpc_reply_send(rpc_reply_t *reply);
+
+/* The value of 'key' in the map 'obj', or NULL if it has none or isn't a
+ * map */
+msgpack_object *rpc_object_get(msgpack_object *obj, const char *key);
 
 #define DEFINE_RPC_METHOD(name) \
   void name(void *context, msgpack_object *request, \
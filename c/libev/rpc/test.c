@@ -0,0 +1,88 @@
+#include <ev.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zmq.h>
+
+#include "rpc.h"
+#include "rpc_service.h"
+
+/* A method on the worker pool that defers its reply and has another thread
+ * send it straight away, while the handler is still running. The worker
+ * must not touch the reply once it has been deferred: by the time the
+ * handler returns, the loop may already have sent and freed it. Run this
+ * under valgrind or built with -fsanitize=address to catch that.
+ *
+ *   gcc -g -pthread test.c rpc.c rpc_service.c histogram.c \
+ *     $(pkg-config --cflags --libs glib-2.0) -lev -lzmq -lmsgpack -lm
+ */
+
+#define ADDRESS "inproc://rpc-test"
+#define CALLS 200
+
+static int answered;
+static int failed;
+
+static void *reply_now(void *data) {
+  rpc_reply_t *reply = data;
+
+  msgpack_pack_true(&reply->result);
+  rpc_reply_send(reply);
+  return NULL;
+} /* reply_now */
+
+static DEFINE_RPC_METHOD(handoff) {
+  rpc_reply_t *reply = rpc_defer(context);
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, reply_now, reply);
+  pthread_detach(thread);
+
+  /* Give the loop time to send the reply before we return */
+  usleep(1000);
+} /* handoff */
+
+static void got(void *context, msgpack_object *response, void *data) {
+  msgpack_object *result = rpc_object_get(response, "result");
+
+  if (result == NULL || result->type != MSGPACK_OBJECT_BOOLEAN) {
+    failed++;
+  }
+  if (++answered == CALLS) {
+    ev_break(EV_DEFAULT_ EVBREAK_ALL);
+  }
+} /* got */
+
+static void give_up(EV_P_ ev_timer *timer, int revents) {
+  ev_break(EV_A_ EVBREAK_ALL);
+} /* give_up */
+
+int main(void) {
+  struct ev_loop *loop = EV_DEFAULT;
+  void *zmq = zmq_init(1);
+  rpc_service_t *service = rpc_service_new(ADDRESS);
+  ev_timer timeout;
+  int i;
+
+  service->zmq = zmq;
+  service->workers = 4;
+  rpc_service_start(service, loop);
+  rpc_service_register(service, "handoff", handoff, NULL);
+  rpc_service_set_policy(service, "handoff", RPC_POOL);
+
+  for (i = 0; i < CALLS; i++) {
+    rpc_call_t *rpc = rpc_call_new(zmq, loop, ADDRESS, "handoff");
+    msgpack_pack_nil(rpc->request);
+    rpc_call(rpc, got, NULL);
+  }
+
+  ev_timer_init(&timeout, give_up, 10, 0);
+  ev_timer_start(loop, &timeout);
+  ev_run(loop, 0);
+
+  /* Let the last reply threads finish before we go */
+  usleep(10000);
+  printf("%d of %d calls answered, %d wrongly\n", answered, CALLS, failed);
+  return answered == CALLS && failed == 0 ? 0 : 1;
+} /* main */
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE /* for open_memstream */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "insist.h"
+#include "server.h"
+#include "stats.h"
+#include "status.h"
+
+static void *admin_listen(void *data);
+static void *admin_serve(void *data);
+static int admin_reply(int fd, const char *request);
+
+void admin_start(const char *address) {
+  pthread_t thread;
+  Status rc;
+
+  if (address == NULL) {
+    return;
+  }
+
+  /* A Server of its own, for the address parsing and listening; it never
+   * has sessions. */
+  Server *admin = server_new(address, ADMIN_DEFAULT_PORT);
+  rc = server_listen(admin, 0);
+  insist(rc == GREAT_SUCCESS, "Failed to listen for stats on %s", address);
+
+  stats_enable();
+
+  int err = pthread_create(&thread, NULL, admin_listen, admin);
+  insist(err == 0, "pthread_create failed, error(%d): %s", err, strerror(err));
+  pthread_detach(thread);
+} /* admin_start */
+
+/* Admin connections are rare, so each just gets a thread */
+void *admin_listen(void *data) {
+  Server *admin = data;
+  pthread_t thread;
+
+  for (;;) {
+    int fd = server_accept_next(admin, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "stats accept failed, errno(%d): %s\n", errno,
+                strerror(errno));
+      }
+      continue;
+    }
+    int err = pthread_create(&thread, NULL, admin_serve,
+                             (void *)(intptr_t)fd);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create failed, error(%d): %s\n", err,
+              strerror(err));
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+} /* admin_listen */
+
+/* Answer requests, one per line, until the client hangs up */
+void *admin_serve(void *data) {
+  int fd = (intptr_t)data;
+  char request[ADMIN_REQUEST_MAX];
+  size_t length = 0;
+  ssize_t bytes;
+
+  while ((bytes = read(fd, request + length, sizeof(request) - length)) > 0) {
+    length += bytes;
+
+    char *line = request;
+    char *newline;
+    while ((newline = memchr(line, '\n', request + length - line)) != NULL) {
+      *newline = '\0';
+      if (newline > line && newline[-1] == '\r') {
+        newline[-1] = '\0';
+      }
+      if (admin_reply(fd, line) != 0) {
+        goto done;
+      }
+      line = newline + 1;
+    }
+    length -= line - request;
+    memmove(request, line, length);
+    if (length == sizeof(request)) {
+      break; /* not a request we know */
+    }
+  }
+
+done:
+  close(fd);
+  return NULL;
+} /* admin_serve */
+
+/* Returns -1 if the client should be hung up on */
+int admin_reply(int fd, const char *request) {
+  char *reply;
+  size_t length;
+  FILE *out = open_memstream(&reply, &length);
+
+  insist_return(out != NULL, -1, "open_memstream failed, errno(%d): %s",
+                errno, strerror(errno));
+  if (strcmp(request, "") == 0 || strcmp(request, "stats") == 0) {
+    stats_text(out);
+  } else if (strcmp(request, "msgpack") == 0) {
+    stats_msgpack(out);
+  } else {
+    fprintf(out, "unknown request '%s'; try 'stats' or 'msgpack'\n\n",
+            request);
+  }
+  fclose(out);
+
+  /* Written directly rather than through an Output, so serving stats
+   * doesn't count towards them. */
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t bytes = send(fd, reply + sent, length - sent, MSG_NOSIGNAL);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      free(reply);
+      return -1;
+    }
+    sent += bytes;
+  }
+  free(reply);
+  return 0;
+} /* admin_reply */
@@ -0,0 +1,17 @@
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+/* Port the admin socket listens on if its address doesn't name one */
+#define ADMIN_DEFAULT_PORT 7001
+
+/* Longest request line an admin client may send */
+#define ADMIN_REQUEST_MAX 256
+
+/* Serve live statistics (see stats.h) on a listening socket of their own at
+ * 'address' (host, host:port or [ipv6]:port, as for -L), from a thread of
+ * its own. Each line a client sends is a request: "stats" (or an empty
+ * line) for plain text, "msgpack" for the same as one msgpack map. Does
+ * nothing if 'address' is NULL. */
+void admin_start(const char *address);
+
+#endif /* _ADMIN_H_ */
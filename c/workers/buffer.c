@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "insist.h"
+
+#define BUFFER_MIN_SHIFT 12
+#define BUFFER_MAX_SHIFT 20
+#define BUFFER_CLASSES (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+
+/* How many free blocks of each size a thread keeps around */
+#define BUFFER_POOL_DEPTH 64
+
+/* Free blocks are chained through their first bytes */
+typedef struct slab {
+  struct slab *next;
+} Slab;
+
+/* Per-thread pool of free blocks, one list per size class. Blocks may be
+ * returned on a different thread than they were taken on; they simply join
+ * that thread's pool. */
+static __thread Slab *pool[BUFFER_CLASSES];
+static __thread size_t pool_count[BUFFER_CLASSES];
+static __thread int pool_registered;
+
+/* Frees a thread's pool when the thread exits */
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void pool_key_create(void);
+static void pool_destroy(void *unused);
+static int size_class(size_t capacity);
+static char *slab_get(size_t capacity);
+static void slab_put(char *data, size_t capacity);
+static void buffer_resize(Buffer *buffer, size_t capacity);
+
+void pool_key_create(void) {
+  pthread_key_create(&pool_key, pool_destroy);
+} /* pool_key_create */
+
+void pool_destroy(void *unused) {
+  for (int class = 0; class < BUFFER_CLASSES; class++) {
+    while (pool[class] != NULL) {
+      Slab *slab = pool[class];
+      pool[class] = slab->next;
+      free(slab);
+    }
+    pool_count[class] = 0;
+  }
+} /* pool_destroy */
+
+int size_class(size_t capacity) {
+  int class = 0;
+  while (((size_t)BUFFER_MIN_SIZE << class) < capacity) {
+    class++;
+  }
+  return class;
+} /* size_class */
+
+char *slab_get(size_t capacity) {
+  int class = size_class(capacity);
+  Slab *slab = pool[class];
+
+  if (slab != NULL) {
+    pool[class] = slab->next;
+    pool_count[class]--;
+    return (char *)slab;
+  }
+
+  char *data = malloc(capacity);
+  insist(data != NULL, "malloc(%zd) failed", capacity);
+  return data;
+} /* slab_get */
+
+void slab_put(char *data, size_t capacity) {
+  int class = size_class(capacity);
+
+  if (pool_count[class] >= BUFFER_POOL_DEPTH) {
+    free(data);
+    return;
+  }
+  if (!pool_registered) {
+    /* Make sure this thread's pool is freed if the thread exits */
+    pthread_once(&pool_key_once, pool_key_create);
+    pthread_setspecific(pool_key, (void *)1);
+    pool_registered = 1;
+  }
+  ((Slab *)data)->next = pool[class];
+  pool[class] = (Slab *)data;
+  pool_count[class]++;
+} /* slab_put */
+
+char *buffer_block_get(size_t capacity) {
+  return slab_get(capacity);
+} /* buffer_block_get */
+
+void buffer_block_put(char *data, size_t capacity) {
+  slab_put(data, capacity);
+} /* buffer_block_put */
+
+void buffer_init(Buffer *buffer) {
+  buffer->data = NULL;
+  buffer->capacity = 0;
+  buffer->start = 0;
+  buffer->length = 0;
+} /* buffer_init */
+
+void buffer_release(Buffer *buffer) {
+  if (buffer->data != NULL) {
+    slab_put(buffer->data, buffer->capacity);
+  }
+  buffer_init(buffer);
+} /* buffer_release */
+
+void buffer_trim(Buffer *buffer) {
+  if (buffer->length == 0) {
+    buffer_release(buffer);
+  }
+} /* buffer_trim */
+
+/* Move the contents into fresh storage of 'capacity' bytes, unwrapping them
+ * so they start at offset 0. */
+void buffer_resize(Buffer *buffer, size_t capacity) {
+  char *data = slab_get(capacity);
+  size_t first = buffer->capacity - buffer->start;
+
+  if (buffer->length == 0) {
+    /* nothing to move */
+  } else if (first >= buffer->length) {
+    memcpy(data, buffer->data + buffer->start, buffer->length);
+  } else {
+    memcpy(data, buffer->data + buffer->start, first);
+    memcpy(data + first, buffer->data, buffer->length - first);
+  }
+
+  if (buffer->data != NULL) {
+    slab_put(buffer->data, buffer->capacity);
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  buffer->start = 0;
+} /* buffer_resize */
+
+char *buffer_write_space(Buffer *buffer, size_t *available) {
+  if (buffer->length == buffer->capacity) {
+    if (buffer->capacity == BUFFER_MAX_SIZE) {
+      *available = 0;
+      return NULL;
+    }
+    buffer_resize(buffer, buffer->capacity == 0
+                  ? BUFFER_MIN_SIZE : buffer->capacity * 2);
+  }
+
+  size_t end = buffer->start + buffer->length;
+  if (end < buffer->capacity) {
+    /* Free space runs from the end of the data to the end of the ring */
+    *available = buffer->capacity - end;
+  } else {
+    /* Data wraps around; free space is between its end and its start */
+    end -= buffer->capacity;
+    *available = buffer->start - end;
+  }
+  return buffer->data + end;
+} /* buffer_write_space */
+
+void buffer_commit(Buffer *buffer, size_t bytes) {
+  buffer->length += bytes;
+} /* buffer_commit */
+
+size_t buffer_append(Buffer *buffer, const char *data, size_t length) {
+  size_t appended = 0;
+
+  while (appended < length) {
+    size_t available;
+    char *space = buffer_write_space(buffer, &available);
+    if (space == NULL) {
+      break;
+    }
+    if (available > length - appended) {
+      available = length - appended;
+    }
+    memcpy(space, data + appended, available);
+    buffer_commit(buffer, available);
+    appended += available;
+  }
+  return appended;
+} /* buffer_append */
+
+void buffer_consume(Buffer *buffer, size_t bytes) {
+  buffer->length -= bytes;
+  if (buffer->length == 0) {
+    /* Starting over at 0 keeps the next frame from wrapping */
+    buffer->start = 0;
+  } else {
+    buffer->start = (buffer->start + bytes) & (buffer->capacity - 1);
+  }
+} /* buffer_consume */
+
+int buffer_next_line(Buffer *buffer, char **line, size_t *length) {
+  size_t first = buffer->capacity - buffer->start;
+  char *newline;
+
+  if (buffer->length == 0) {
+    return 0;
+  }
+
+  if (first >= buffer->length) {
+    /* Not wrapped, one search does it */
+    newline = memchr(buffer->data + buffer->start, '\n', buffer->length);
+  } else {
+    newline = memchr(buffer->data + buffer->start, '\n', first);
+    if (newline == NULL
+        && memchr(buffer->data, '\n', buffer->length - first) != NULL) {
+      /* The line wraps around the end of the ring. Straighten it out so it
+       * can be handed out in one piece. */
+      buffer_straighten(buffer);
+      newline = memchr(buffer->data, '\n', buffer->length);
+    }
+  }
+
+  if (newline == NULL) {
+    if (buffer->length < BUFFER_MAX_SIZE) {
+      return 0; /* wait for more data */
+    }
+    /* A full buffer with no newline will never see one; hand it all over. */
+    *line = buffer_take_all(buffer, length);
+    return 1;
+  }
+
+  *line = buffer->data + buffer->start;
+  *length = newline - *line;
+  buffer_consume(buffer, *length + 1);
+  return 1;
+} /* buffer_next_line */
+
+char *buffer_take_all(Buffer *buffer, size_t *length) {
+  char *data;
+
+  buffer_straighten(buffer);
+  data = buffer->data + buffer->start;
+  *length = buffer->length;
+  buffer_consume(buffer, buffer->length);
+  return data;
+} /* buffer_take_all */
+
+char *buffer_peek(Buffer *buffer, size_t *length) {
+  size_t first = buffer->capacity - buffer->start;
+
+  *length = first < buffer->length ? first : buffer->length;
+  return buffer->data + buffer->start;
+} /* buffer_peek */
+
+void buffer_straighten(Buffer *buffer) {
+  if (buffer->start + buffer->length > buffer->capacity) {
+    buffer_resize(buffer, buffer->capacity);
+  }
+} /* buffer_straighten */
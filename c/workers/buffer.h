@@ -0,0 +1,77 @@
+#ifndef _BUFFER_H_
+#define _BUFFER_H_
+
+#include <stddef.h>
+
+/* Smallest and largest storage a buffer will use. Storage comes in power of
+ * two sizes between these two. */
+#define BUFFER_MIN_SIZE (4 << 10)
+#define BUFFER_MAX_SIZE (1 << 20)
+
+/* A growable ring buffer.
+ *
+ * Storage is drawn from a per-thread pool of power-of-two sized blocks, and
+ * is only held while there is unconsumed data (see buffer_trim), so idle
+ * sessions cost nothing but this struct.
+ *
+ * Data is read straight into the ring (buffer_write_space + buffer_commit)
+ * and handed out in place (buffer_next_line, buffer_take_all) without
+ * copying, except in the rare case that a frame wraps around the end of the
+ * ring. */
+typedef struct buffer {
+  char *data;
+  size_t capacity;
+  size_t start; /* offset of the first unconsumed byte */
+  size_t length; /* number of unconsumed bytes */
+} Buffer;
+
+void buffer_init(Buffer *buffer);
+
+/* Give this buffer's storage back to the pool, dropping any data. */
+void buffer_release(Buffer *buffer);
+
+/* Give storage back to the pool if the buffer is empty. */
+void buffer_trim(Buffer *buffer);
+
+/* Get a contiguous region to write into, growing the buffer if needed.
+ * Returns NULL if the buffer is full and already at BUFFER_MAX_SIZE. */
+char *buffer_write_space(Buffer *buffer, size_t *available);
+
+/* Mark 'bytes' bytes written into the region from buffer_write_space. */
+void buffer_commit(Buffer *buffer, size_t bytes);
+
+/* Copy data in, growing as needed. Returns how much was copied, which is
+ * less than 'length' only if the buffer reached BUFFER_MAX_SIZE. */
+size_t buffer_append(Buffer *buffer, const char *data, size_t length);
+
+/* Consume the next newline-terminated line. On success, returns 1 and points
+ * 'line' at the data (without the newline) inside the buffer. If the buffer
+ * is full without any newline, the whole buffer is returned as one line.
+ *
+ * The line is only valid until the buffer is next written to or the next
+ * frame is requested. */
+int buffer_next_line(Buffer *buffer, char **line, size_t *length);
+
+/* Consume everything in the buffer as one contiguous region. Same validity
+ * rules as buffer_next_line. */
+char *buffer_take_all(Buffer *buffer, size_t *length);
+
+/* Look at unconsumed data without consuming it. Returns the first contiguous
+ * region, which is all of it unless the data wraps around the end of the
+ * ring; buffer_straighten fixes that. */
+char *buffer_peek(Buffer *buffer, size_t *length);
+
+/* Move the data so it is contiguous. This copies, so only do it when a frame
+ * actually straddles the end of the ring. */
+void buffer_straighten(Buffer *buffer);
+
+/* Advance past 'bytes' bytes of data. */
+void buffer_consume(Buffer *buffer, size_t bytes);
+
+/* Raw blocks from the same per-thread pool, for other structures that want
+ * pooled storage (see output.c). 'capacity' must be a power of two from
+ * BUFFER_MIN_SIZE to BUFFER_MAX_SIZE, and the same when putting it back. */
+char *buffer_block_get(size_t capacity);
+void buffer_block_put(char *data, size_t capacity);
+
+#endif /* _BUFFER_H_ */
@@ -1,78 +1,466 @@
-#define _BSD_SOURCE /* for inet_aton, etc */
-#include <arpa/inet.h>
+#define _GNU_SOURCE /* for getaddrinfo, ppoll, etc */
 #include <errno.h>
-#include <fcntl.h>
-#include <netinet/in.h>
-#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/socket.h>
-#include <sys/socket.h>
-#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+
+#include "histogram.h"
 #include "insist.h"
 #include "status.h"
 
-int main(int argc, char **argv) {
-  int rc;
+#define NSEC_PER_SEC 1000000000LL
+
+/* Settings for one load thread; every thread's are the same but for its
+ * share of the connections and requests */
+typedef struct load_config {
+  struct addrinfo *address;
+  long connections; /* per thread */
+  long requests; /* per thread; 0 means run for 'duration' */
+  double duration; /* seconds */
+  double rate; /* requests/sec per thread; 0 means as fast as possible */
+  int churn; /* new connection for every request */
+  int wait_reply; /* wait for a line back after each request */
+  char *payload;
+  size_t payload_size;
+} LoadConfig;
+
+/* Where a connection is with its request */
+typedef enum {
+  LOAD_IDLE = 0, /* no request; fd may be open, or -1 */
+  LOAD_OPENING, /* connecting ahead of any request */
+  LOAD_CONNECTING, /* connecting for a request */
+  LOAD_SENDING,
+  LOAD_RECEIVING
+} LoadState;
+
+/* One connection and the request it has in flight, if any */
+typedef struct load_connection {
+  int fd;
+  LoadState state;
+  size_t offset; /* payload bytes sent so far */
+  int64_t intended; /* when its request was due to start */
+} LoadConnection;
+
+/* One load thread, its connections and what it measured */
+typedef struct load_thread {
+  pthread_t thread;
+  LoadConfig config;
+  LoadConnection *connections;
+  uint64_t sent;
+  uint64_t errors;
+  uint64_t unfinished; /* still in flight at the deadline */
+  uint64_t missed; /* came due, but never had a connection free */
+  Histogram latency;
+} LoadThread;
+
+static int64_t now_ns(void);
+static Status load_connect(const LoadConfig *config,
+                           LoadConnection *connection, LoadState state);
+static Status load_progress(const LoadConfig *config,
+                            LoadConnection *connection, short revents);
+static void load_done(LoadThread *load_thread, LoadConnection *connection,
+                      Status rc);
+static void *load_thread_run(void *data);
 
-  if (argc < 3) {
-    printf("Usage: %s address port\n", argv[0]);
-    return 1;
+int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+} /* now_ns */
+
+/* Start connecting without waiting for it to finish */
+Status load_connect(const LoadConfig *config, LoadConnection *connection,
+                    LoadState state) {
+  struct addrinfo *address = config->address;
+  int fd = socket(address->ai_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    return TERRIBLE_FAILURE;
+  }
+  if (connect(fd, address->ai_addr, address->ai_addrlen) == -1
+      && errno != EINPROGRESS) {
+    close(fd);
+    return TERRIBLE_FAILURE;
   }
+  connection->fd = fd;
+  connection->state = state;
+  return GREAT_SUCCESS;
+} /* load_connect */
 
-  const char *address = argv[1];
-  unsigned short port = (unsigned short)atoi(argv[2]);
+/* Move a connection along as far as its socket allows without blocking.
+ * Returns TERRIBLE_FAILURE if it broke; it is done with its request (or with
+ * opening) once it is back to LOAD_IDLE. */
+Status load_progress(const LoadConfig *config, LoadConnection *connection,
+                     short revents) {
+  char reply[4096];
 
-  /* Assume ipv6, we'll shrink to ipv4 if needed later */
-  socklen_t socklen = sizeof(struct sockaddr_in6);
-  struct sockaddr *sockaddr = malloc(socklen);
+  if (revents & (POLLERR | POLLNVAL)) {
+    return TERRIBLE_FAILURE;
+  }
 
-  /* Try IPv6 first ... */
-  if (inet_pton(AF_INET6, address,
-                &((struct sockaddr_in6 *)sockaddr)->sin6_addr) == 1) {
-    /* This appears to be a valid ipv6 address */
-    sockaddr->sa_family = AF_INET6;
-    ((struct sockaddr_in6 *)sockaddr)->sin6_port = htons(port);
-    //printf("Using ipv6\n");
-  } else {
-    /* Shrink down to ipv4 */
-    socklen = sizeof(struct sockaddr_in);
-    sockaddr = realloc(sockaddr, socklen);
-    if (inet_pton(AF_INET, address, 
-                  &((struct sockaddr_in *)sockaddr)->sin_addr) == 1) {
-      /* This appears to be a valid ipv4 address */
-      sockaddr->sa_family = AF_INET;
-      //printf("Using ipv4\n");
-      ((struct sockaddr_in *)sockaddr)->sin_port = htons(port);
-    } else {
-      free(sockaddr);
-      fprintf(stderr, "Invalid address: %s, can't listen.\n", address);
+  if (connection->state == LOAD_OPENING
+      || connection->state == LOAD_CONNECTING) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (!(revents & POLLOUT)) {
+      return GREAT_SUCCESS;
+    }
+    if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1
+        || error != 0) {
+      return TERRIBLE_FAILURE;
+    }
+    connection->state = connection->state == LOAD_OPENING ? LOAD_IDLE
+                                                          : LOAD_SENDING;
+  }
+
+  while (connection->state == LOAD_SENDING) {
+    ssize_t bytes = send(connection->fd, config->payload + connection->offset,
+                         config->payload_size - connection->offset,
+                         MSG_NOSIGNAL);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? GREAT_SUCCESS : TERRIBLE_FAILURE;
+    }
+    connection->offset += bytes;
+    if (connection->offset == config->payload_size) {
+      connection->state = config->wait_reply ? LOAD_RECEIVING : LOAD_IDLE;
+    }
+  }
+
+  while (connection->state == LOAD_RECEIVING) {
+    ssize_t bytes = recv(connection->fd, reply, sizeof(reply), 0);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? GREAT_SUCCESS : TERRIBLE_FAILURE;
+    }
+    if (bytes == 0) {
       return TERRIBLE_FAILURE;
     }
-  } /* parse ipv4/ipv6 address */
+    if (memchr(reply, '\n', bytes) != NULL) {
+      connection->state = LOAD_IDLE;
+    }
+  }
+  return GREAT_SUCCESS;
+} /* load_progress */
+
+/* Count a request that finished or failed, and free its connection up */
+void load_done(LoadThread *load_thread, LoadConnection *connection,
+               Status rc) {
+  if (rc == GREAT_SUCCESS) {
+    histogram_record(&load_thread->latency, now_ns() - connection->intended);
+    load_thread->sent++;
+  } else {
+    load_thread->errors++;
+  }
+  if (connection->fd != -1
+      && (rc != GREAT_SUCCESS || load_thread->config.churn)) {
+    /* Reconnect for the next request */
+    close(connection->fd);
+    connection->fd = -1;
+  }
+  connection->state = LOAD_IDLE;
+} /* load_done */
+
+/* Issue requests on a fixed schedule and record how late each one finished.
+ *
+ * Latency is measured from when a request was *supposed* to start, not from
+ * when we got around to sending it. If the server stalls, requests queue up
+ * behind the stall and each of them is charged for the wait, the way real
+ * clients arriving at that rate would be. Measuring from the actual send
+ * time instead hides stalls (coordinated omission): a blocked load generator
+ * simply stops asking, so the slow period shows up as one bad sample.
+ *
+ * Every connection can have a request in flight; they are all driven from
+ * one ppoll, which never waits past the deadline. A request that comes due
+ * while every connection is busy starts on the next one free, late. At the
+ * deadline, requests still in flight, and those that came due and never
+ * started, are charged for the wait so far: a server that stops answering
+ * altogether shows up as slow requests, not as no requests. */
+void *load_thread_run(void *data) {
+  LoadThread *load_thread = data;
+  const LoadConfig *config = &load_thread->config;
+  LoadConnection *connections = load_thread->connections;
+  long count = config->connections;
+  int64_t interval = config->rate > 0 ? (int64_t)(NSEC_PER_SEC / config->rate)
+                                      : 0;
+  int64_t start = now_ns();
+  int64_t deadline = start + (int64_t)(config->duration * NSEC_PER_SEC);
+  struct pollfd *fds = calloc(count, sizeof(*fds));
+  uint64_t issued = 0;
+
+  insist(fds != NULL, "calloc failed: %s", strerror(errno));
+  histogram_init(&load_thread->latency);
+  for (long i = 0; i < count; i++) {
+    connections[i].fd = -1;
+    if (!config->churn
+        && load_connect(config, &connections[i], LOAD_OPENING) != GREAT_SUCCESS) {
+      load_thread->errors++;
+    }
+  }
+
+  for (;;) {
+    int64_t now = now_ns();
+    int64_t wake = deadline;
+    int nfds = 0;
+
+    if (now >= deadline) {
+      break;
+    }
+
+    for (long i = 0; i < count; i++) {
+      LoadConnection *connection = &connections[i];
 
-  //printf("Family: %d\n", sockaddr->sa_family);
+      if (connection->state == LOAD_IDLE
+          && (config->requests == 0 || issued < (uint64_t)config->requests)) {
+        /* Closed loop: each request starts when a connection is free */
+        int64_t intended = interval > 0 ? start + (int64_t)issued * interval
+                                        : now;
+        if (intended > now) {
+          if (intended < wake) {
+            wake = intended;
+          }
+          continue;
+        }
+        issued++;
+        connection->intended = intended;
+        connection->offset = 0;
+        if (connection->fd != -1) {
+          connection->state = LOAD_SENDING;
+        } else if (load_connect(config, connection, LOAD_CONNECTING)
+                   != GREAT_SUCCESS) {
+          load_done(load_thread, connection, TERRIBLE_FAILURE);
+          continue;
+        }
+      }
+
+      if (connection->state != LOAD_IDLE) {
+        fds[nfds].fd = connection->fd;
+        fds[nfds].events = connection->state == LOAD_RECEIVING ? POLLIN
+                                                               : POLLOUT;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+    }
 
-  int count = 10000;
+    if (nfds == 0 && config->requests > 0
+        && issued >= (uint64_t)config->requests) {
+      break;
+    }
 
-  for (int i = 0; i < count; i++) {
-    if (i % 500 == 0) { 
-      printf("Count: %d\n", i);
+    int64_t wait = wake - now;
+    struct timespec timeout = { wait / NSEC_PER_SEC, wait % NSEC_PER_SEC };
+    int ready = ppoll(fds, nfds, &timeout, NULL);
+    if (ready <= 0) {
+      insist(ready == 0 || errno == EINTR, "ppoll failed: %s",
+             strerror(errno));
+      continue;
     }
-    int fd = socket(sockaddr->sa_family, SOCK_STREAM, 0);
-    insist_return(fd != -1, TERRIBLE_FAILURE,
-                  "socket() call failed; error(%d): %s", errno, strerror(errno))
 
-    rc = connect(fd, sockaddr, socklen);
-    insist_return(rc == 0, TERRIBLE_FAILURE, "listen(%d, 5) failed, "
-                  "error(%d): %s", fd, errno, strerror(errno));
+    /* Connections are polled in order, skipping idle ones */
+    nfds = 0;
+    for (long i = 0; i < count; i++) {
+      LoadConnection *connection = &connections[i];
+      if (connection->state == LOAD_IDLE) {
+        continue;
+      }
+      short revents = fds[nfds++].revents;
+      if (revents == 0) {
+        continue;
+      }
+
+      if (connection->state == LOAD_OPENING) {
+        if (load_progress(config, connection, revents) != GREAT_SUCCESS) {
+          load_thread->errors++;
+          close(connection->fd);
+          connection->fd = -1;
+          connection->state = LOAD_IDLE;
+        }
+        continue;
+      }
+      Status rc = load_progress(config, connection, revents);
+      if (rc != GREAT_SUCCESS || connection->state == LOAD_IDLE) {
+        load_done(load_thread, connection, rc);
+      }
+    }
   }
 
-  printf("Connected %d times to %s:%hu\n", count, address, port);
+  for (long i = 0; i < count; i++) {
+    if (connections[i].state != LOAD_IDLE
+        && connections[i].state != LOAD_OPENING) {
+      histogram_record(&load_thread->latency,
+                       deadline - connections[i].intended);
+      load_thread->unfinished++;
+    }
+    if (connections[i].fd != -1) {
+      close(connections[i].fd);
+    }
+  }
 
-  return GREAT_SUCCESS;
+  if (interval > 0) {
+    uint64_t due = (deadline - start + interval - 1) / interval;
+    if (config->requests > 0 && due > (uint64_t)config->requests) {
+      due = config->requests;
+    }
+    for (; issued < due; issued++) {
+      histogram_record(&load_thread->latency,
+                       deadline - (start + (int64_t)issued * interval));
+      load_thread->missed++;
+    }
+  }
+  free(fds);
+  return NULL;
+} /* load_thread_run */
+
+int main(int argc, char **argv) {
+  LoadConfig config;
+  long nthreads = 1;
+  long connections = 0;
+  long requests = 0;
+  double rate = 0;
+  size_t payload_size = 64;
+  struct addrinfo hints;
+  int opt;
+  int rc;
+
+  memset(&config, 0, sizeof(config));
+  config.duration = 10;
+
+  while ((opt = getopt(argc, argv, "t:c:n:d:r:s:Cw")) != -1) {
+    switch (opt) {
+      case 't': nthreads = atol(optarg); break;
+      case 'c': connections = atol(optarg); break;
+      case 'n': requests = atol(optarg); break;
+      case 'd': config.duration = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 's': payload_size = atol(optarg); break;
+      case 'C': config.churn = 1; break;
+      case 'w': config.wait_reply = 1; break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [options] address port\n"
+                "  -t threads      load threads (default 1)\n"
+                "  -c connections  connections, spread over the threads "
+                "(default one per thread)\n"
+                "  -n requests     total requests to send, stopping early at "
+                "-d (default: run\n"
+                "                  for -d seconds)\n"
+                "  -d seconds      how long to run at most (default 10)\n"
+                "  -r rate         total requests/sec, on a fixed schedule "
+                "(default: as fast as\n"
+                "                  replies come back)\n"
+                "  -s bytes        request size, including the newline "
+                "(default 64)\n"
+                "  -C              open a new connection for every request\n"
+                "  -w              wait for a line in reply to each request\n",
+                argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: %s [options] address port\n", argv[0]);
+    return TERRIBLE_FAILURE;
+  }
+  insist_return(nthreads > 0, TERRIBLE_FAILURE,
+                "Need at least one thread, got %ld", nthreads);
+  insist_return(payload_size > 0, TERRIBLE_FAILURE,
+                "Requests need at least one byte, got %zd", payload_size);
+  if (requests > 0 && nthreads > requests) {
+    nthreads = requests; /* a thread with no requests would run for -d */
+  }
+  if (connections < nthreads) {
+    connections = nthreads;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &config.address);
+  insist_return(rc == 0, TERRIBLE_FAILURE, "Invalid address %s port %s: %s",
+                argv[optind], argv[optind + 1], gai_strerror(rc));
+
+  /* Each request is a line of 'x' */
+  config.payload_size = payload_size;
+  config.payload = malloc(payload_size);
+  memset(config.payload, 'x', payload_size - 1);
+  config.payload[payload_size - 1] = '\n';
+
+  config.rate = rate / nthreads;
+
+  LoadThread *load_threads = calloc(nthreads, sizeof(*load_threads));
+  int64_t start = now_ns();
+  for (long i = 0; i < nthreads; i++) {
+    /* Split evenly, the first few threads taking one more of what's left */
+    load_threads[i].config = config;
+    load_threads[i].config.connections = connections / nthreads
+                                         + (i < connections % nthreads);
+    load_threads[i].config.requests = requests / nthreads
+                                      + (i < requests % nthreads);
+    load_threads[i].connections = calloc(load_threads[i].config.connections,
+                                         sizeof(LoadConnection));
+    rc = pthread_create(&load_threads[i].thread, NULL, load_thread_run,
+                        &load_threads[i]);
+    insist_return(rc == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", rc, strerror(rc));
+  }
+
+  Histogram *latency = malloc(sizeof(*latency));
+  uint64_t sent = 0;
+  uint64_t errors = 0;
+  uint64_t unfinished = 0;
+  uint64_t missed = 0;
+  histogram_init(latency);
+  for (long i = 0; i < nthreads; i++) {
+    pthread_join(load_threads[i].thread, NULL);
+    histogram_merge(latency, &load_threads[i].latency);
+    sent += load_threads[i].sent;
+    errors += load_threads[i].errors;
+    unfinished += load_threads[i].unfinished;
+    missed += load_threads[i].missed;
+    free(load_threads[i].connections);
+  }
+  double elapsed = (double)(now_ns() - start) / NSEC_PER_SEC;
+
+  printf("# %s:%s, %ld threads, %ld connections%s, %zd byte requests%s\n",
+         argv[optind], argv[optind + 1], nthreads,
+         connections, config.churn ? " (churn)" : "",
+         payload_size, config.wait_reply ? ", waiting for replies" : "");
+  printf("# %llu requests, %llu errors in %.2f seconds: %.0f requests/sec\n",
+         (unsigned long long)sent, (unsigned long long)errors, elapsed,
+         sent / elapsed);
+  if (unfinished > 0) {
+    printf("# %llu requests still in flight at the deadline\n",
+           (unsigned long long)unfinished);
+  }
+  if (missed > 0) {
+    printf("# %llu requests came due with every connection busy and never "
+           "went out\n", (unsigned long long)missed);
+  }
+  if (rate > 0) {
+    printf("# target rate %.0f requests/sec\n", rate);
+  }
+  printf("# latency in microseconds%s: p50 %.1f, p99 %.1f, p99.9 %.1f, "
+         "max %.1f\n", rate > 0 ? ", from each request's scheduled start" : "",
+         histogram_percentile(latency, 50) / 1000.0,
+         histogram_percentile(latency, 99) / 1000.0,
+         histogram_percentile(latency, 99.9) / 1000.0, latency->max / 1000.0);
+  histogram_print(latency, stdout, 1000.0);
+
+  free(latency);
+  free(load_threads);
+  free(config.payload);
+  freeaddrinfo(config.address);
+  return errors > 0 ? TERRIBLE_FAILURE : GREAT_SUCCESS;
 } /* main */
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE /* for accept4, etc */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "eventlog.h"
+#include "frame.h"
+#include "insist.h"
+#include "session.h"
+#include "server.h"
+#include "status.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28) /* linux 4.5+ */
+#endif
+
+#define EPOLLED_MAX_EVENTS 256
+
+/* One epoll instance and the thread running it. All threads share the one
+ * listening socket. */
+typedef struct epoll_loop {
+  pthread_t thread;
+  int epoll_fd;
+  Server *server;
+  /** Set when the last accept batch stopped before the socket ran dry */
+  int accept_pending;
+} EpollLoop;
+
+static void server_accept_batch(EpollLoop *epoll_loop);
+static int server_accept_listener(EpollLoop *epoll_loop, int listen_fd);
+static void session_ready(Session *session, uint32_t events);
+static int session_read_ready(Session *session);
+static int session_send(Session *session);
+static void *epoll_loop_run(void *data);
+
+/* Accept up to SERVER_ACCEPT_BATCH connections from each listener.
+ *
+ * The listeners are edge-triggered, so the kernel won't tell us again about
+ * connections we leave behind. If we stop because the batch is used up,
+ * remember that and come back after serving the other ready sessions. We
+ * don't track which listener woke us; checking the others costs one accept
+ * returning EAGAIN each. */
+void server_accept_batch(EpollLoop *epoll_loop) {
+  Server *server = epoll_loop->server;
+  int drained = 0;
+
+  for (int l = 0; l < server->listeners; l++) {
+    drained += server_accept_listener(epoll_loop, server->fds[l]);
+  }
+  epoll_loop->accept_pending = drained < server->listeners;
+} /* server_accept_batch */
+
+/* Returns 1 if the listener ran dry, 0 if we stopped at the batch limit */
+int server_accept_listener(EpollLoop *epoll_loop, int listen_fd) {
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+  struct epoll_event event;
+  int rc;
+
+  for (int i = 0; i < SERVER_ACCEPT_BATCH; i++) {
+    int fd = accept4(listen_fd, (struct sockaddr *)&address, &address_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      /* EAGAIN means we have everything; with several threads on one
+       * listener, another thread may have taken what we were woken for. */
+      insist(errno == EAGAIN, "accept4(%d, ...) failed, errno(%d): %s",
+             listen_fd, errno, strerror(errno));
+      return 1;
+    }
+
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    address_len = sizeof(address);
+    session->data = epoll_loop;
+    session->protocol = &epoll_loop->server->protocol;
+
+    /* Edge-triggered EPOLLOUT costs nothing while we aren't writing: TCP
+     * only reports the socket writable again after a send has filled it. */
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = session;
+    rc = epoll_ctl(epoll_loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    insist(rc == 0, "epoll_ctl(ADD, %d) failed, errno(%d): %s", fd, errno,
+           strerror(errno));
+  }
+  return 0;
+} /* server_accept_listener */
+
+/* Something happened on a session's socket. */
+void session_ready(Session *session, uint32_t events) {
+  /* Once a send has hit EAGAIN, wait for EPOLLOUT before trying again. An
+   * error or hangup counts too; the send is how we find out about it. */
+  int writable = (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    || !(session->flags & SESSION_WRITE_WAITING);
+
+  for (;;) {
+    int rc = 0;
+    if (!(session->flags & (SESSION_READ_PAUSED | SESSION_CLOSING))) {
+      rc = session_read_ready(session);
+      if (rc < 0) {
+        return;
+      }
+    }
+
+    /* Everything this batch of input produced goes out together */
+    if (writable) {
+      if (session_send(session) != 0) {
+        return;
+      }
+      writable = !(session->flags & SESSION_WRITE_WAITING);
+    }
+
+    if (session->output.length > SESSION_OUTPUT_LOW_WATER) {
+      if (rc == 1) {
+        /* Reading stopped at the high-water mark; stay stopped until the
+         * peer takes some of its output. */
+        session->flags |= SESSION_READ_PAUSED;
+      }
+      return;
+    }
+    if (rc != 1 && !(session->flags & SESSION_READ_PAUSED)) {
+      return;
+    }
+    /* Output is down to the low-water mark again. Edge-triggered, so input
+     * we left unread won't be announced again; go get it now. */
+    session->flags &= ~SESSION_READ_PAUSED;
+  }
+} /* session_ready */
+
+/* Edge-triggered: read until EAGAIN or we won't hear about this data again.
+ * Returns 0 once the socket is drained (or at EOF), 1 if we stopped early
+ * because SESSION_OUTPUT_HIGH_WATER bytes of output are waiting, or -1 if
+ * the session was closed. */
+int session_read_ready(Session *session) {
+  ssize_t bytes;
+
+  while (session->output.length < SESSION_OUTPUT_HIGH_WATER) {
+    bytes = session_read(session);
+    if (bytes == 0) {
+      /* EOF, flush any unterminated last line. The peer may only have shut
+       * down its side, so answer what it sent before closing up. */
+      session_frames_finish(session);
+      session->flags |= SESSION_CLOSING;
+      return 0;
+    } else if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                         errno);
+        session_free(session);
+        return -1;
+      }
+      buffer_trim(&session->input);
+      return 0;
+    }
+
+    if (session_frames(session) != 0) {
+      /* Input that can't be framed; hang up */
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                       EPROTO);
+      session_free(session);
+      return -1;
+    }
+  }
+  return 1;
+} /* session_read_ready */
+
+/* Send what the socket will take. Returns -1 if the session was closed,
+ * because of an error or because it was closing and is now done. */
+int session_send(Session *session) {
+  int rc = session_flush(session);
+
+  if (rc < 0) {
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_WRITE_ERROR, session, errno);
+    session_free(session);
+    return -1;
+  }
+  if (rc > 0) {
+    session->flags |= SESSION_WRITE_WAITING;
+  } else {
+    session->flags &= ~SESSION_WRITE_WAITING;
+  }
+
+  if ((session->flags & SESSION_CLOSING) && session->output.length == 0) {
+    /* Closing the fd also removes it from the epoll set */
+    session_free(session);
+    return -1;
+  }
+  return 0;
+} /* session_send */
+
+void *epoll_loop_run(void *data) {
+  EpollLoop *epoll_loop = data;
+  struct epoll_event events[EPOLLED_MAX_EVENTS];
+
+  for (;;) {
+    /* Don't sleep if there are connections left over from the last batch */
+    int count = epoll_wait(epoll_loop->epoll_fd, events, EPOLLED_MAX_EVENTS,
+                           epoll_loop->accept_pending ? 0 : -1);
+    if (count == -1) {
+      insist(errno == EINTR, "epoll_wait failed, errno(%d): %s", errno,
+             strerror(errno));
+      continue;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == NULL) {
+        epoll_loop->accept_pending = 1;
+      } else {
+        session_ready(events[i].data.ptr, events[i].events);
+      }
+    }
+
+    if (epoll_loop->accept_pending) {
+      server_accept_batch(epoll_loop);
+    }
+  }
+  return NULL;
+} /* epoll_loop_run */
+
+int main(int argc, char **argv) {
+  Server *server = server_new("0.0.0.0", 7000);
+  long nthreads = 1;
+  int exclusive = 1;
+  int opt;
+  Status rc;
+
+  while ((opt = getopt(argc, argv, "t:X" SERVER_OPTIONS)) != -1) {
+    switch (opt) {
+      case 't': nthreads = atol(optarg); break;
+      case 'X': exclusive = 0; break;
+      default:
+        if (server_option(server, opt, optarg) == GREAT_SUCCESS) {
+          break;
+        }
+        fprintf(stderr, "Usage: %s [-t threads] [-X] [options]\n"
+                "  -t threads   number of epoll threads sharing the "
+                "listeners\n"
+                "  -X           don't use EPOLLEXCLUSIVE on the listeners; "
+                "every thread wakes\n"
+                "               for every connection\n"
+                SERVER_USAGE, argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+  insist_return(nthreads > 0, TERRIBLE_FAILURE,
+                "Need at least one thread, got %ld", nthreads);
+
+  eventlog_start();
+  admin_start(server->stats_address);
+  rc = server_listen(server, 1);
+  insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
+
+  EpollLoop *epoll_loops = calloc(nthreads, sizeof(*epoll_loops));
+  for (long i = 0; i < nthreads; i++) {
+    EpollLoop *epoll_loop = &epoll_loops[i];
+    struct epoll_event event;
+
+    epoll_loop->server = server;
+    epoll_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    insist_return(epoll_loop->epoll_fd != -1, TERRIBLE_FAILURE,
+                  "epoll_create1 failed, errno(%d): %s", errno,
+                  strerror(errno));
+
+    /* With EPOLLEXCLUSIVE, a new connection wakes one waiting thread
+     * instead of all of them. */
+    for (int l = 0; l < server->listeners; l++) {
+      event.events = EPOLLIN | EPOLLET | (exclusive ? EPOLLEXCLUSIVE : 0);
+      event.data.ptr = NULL; /* marks a listener */
+      insist_return(epoll_ctl(epoll_loop->epoll_fd, EPOLL_CTL_ADD,
+                              server->fds[l], &event) == 0, TERRIBLE_FAILURE,
+                    "epoll_ctl(ADD, %d) failed, errno(%d): %s",
+                    server->fds[l], errno, strerror(errno));
+    }
+  }
+
+  for (long i = 1; i < nthreads; i++) {
+    int err = pthread_create(&epoll_loops[i].thread, NULL, epoll_loop_run,
+                             &epoll_loops[i]);
+    insist_return(err == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", err, strerror(err));
+  }
+  epoll_loops[0].thread = pthread_self();
+  epoll_loop_run(&epoll_loops[0]);
+  return 0;
+} /* main */
@@ -1,87 +1,464 @@
-#define _BSD_SOURCE /* for inet_aton, etc */
+#define _GNU_SOURCE /* for inet_aton, pthread_setaffinity_np, etc */
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "admin.h"
+#include "eventlog.h"
+#include "frame.h"
+#include "handoff.h"
 #include "insist.h"
 #include "session.h"
 #include "server.h"
 #include "status.h"
+#include "timerwheel.h"
+
+/* One event loop, its own listening socket and all sessions it accepted */
+typedef struct event_loop {
+  pthread_t thread;
+  struct ev_loop *loop;
+  Server *server;
+  int cpu; /* CPU to pin this loop's thread to, -1 for none */
+
+  /** Session timeouts. One ev_timer drives the wheel, rather than one per
+   * session, so idle sessions cost nothing until they expire. */
+  TimerWheel wheel;
+  ev_timer tick;
+
+  /** Sessions open on this loop, so a draining loop knows when it's done */
+  size_t sessions;
+  /** Signalled once our listening sockets have been handed off */
+  ev_async drain;
+  int draining;
+} EventLoop;
+
+static EventLoop *event_loops;
+static long nloops = 1;
 
 static void server_connect_cb(EV_P_ ev_io *io, int revents);
-static void session_read_cb(EV_P_ ev_io *io, int revents);
+static void session_io_cb(EV_P_ ev_io *io, int revents);
+static int session_send(EV_P_ Session *session);
+static void session_watch(EV_P_ Session *session);
+static void session_close(EV_P_ Session *session);
+static void session_timer_update(EventLoop *event_loop, Session *session);
+static void session_timer_expired(Timer *timer, void *data);
+static void timer_tick_cb(EV_P_ ev_timer *timer, int revents);
+static void event_loop_drain_cb(EV_P_ ev_async *async, int revents);
+static void event_loops_drain(void *data);
+static int event_loops_adopt(const char *path);
+static void event_loops_handoff(const char *path, int handle);
+static Status event_loop_start(EventLoop *event_loop, int reuseport);
+static void *event_loop_run(void *data);
 
 /* Called when a new connection occurs. This method sets up handling for the
  * new connection. */
 void server_connect_cb(struct ev_loop *loop, ev_io *io, int revents) {
   Server *server = (struct server *)io->data;
 
-  struct sockaddr address;
+  struct sockaddr_storage address;
   socklen_t address_len = sizeof(address);
 
-  /* Try to accept all pending connections */
-  int fd;
-  while ((fd = accept(server->fd, &address, &address_len)) >= 0) {
+  /* Accept a batch of pending connections. accept4 gives us non-blocking
+   * sockets directly (session_io_cb reads until EAGAIN, so they must be).
+   * Anything past the batch waits for the next loop iteration; the watcher
+   * is level-triggered, so a connection storm can't starve the sessions we
+   * already have. */
+  for (int i = 0; i < SERVER_ACCEPT_BATCH; i++) {
+    int fd = accept4(io->fd, (struct sockaddr *)&address, &address_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      insist_return(errno == EAGAIN || errno == EINTR
+                    || errno == ECONNABORTED, (void)(0),
+                    "Expected accept4() to fail eventually with EAGAIN, "
+                    "but errno(%d): %s", errno, strerror(errno));
+      return;
+    }
+
     /* Create a new session and set it up with libev */
-    Session *session = session_new(fd, &address, address_len);
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    address_len = sizeof(address);
     session->io = calloc(1, sizeof(*session->io));
     session->io->data = session;
     session->data = server;
-    ev_io_init(session->io, session_read_cb, fd, EV_READ);
+    session->protocol = &server->protocol;
+    ev_io_init(session->io, session_io_cb, fd, EV_READ);
     ev_io_start(loop, session->io);
+    session_timer_update(server->data, session);
+    ((EventLoop *)server->data)->sessions++;
     //printf("New session from %s:%hu\n", server->address, server->port);
   }
-
-  insist_return(fd == -1 && errno == EAGAIN, (void)(0),
-                "Expected accept() to fail eventually and errno to be EAGAIN, "
-                "but fd is %d, errno(%d): %s", fd, errno, strerror(errno));
 } /* server_connect_cb */
 
-void session_read_cb(struct ev_loop *loop, ev_io *io, int revents) {
-  static ssize_t bufsize = 4096;
-  static char buffer[4096];
+void session_io_cb(struct ev_loop *loop, ev_io *io, int revents) {
   Session *session = io->data;
   ssize_t bytes;
-  int done = 0;
 
-  while (!done) {
-    bytes = read(io->fd, buffer, bufsize);
+  /* Reads stop while too much output is waiting, so a peer that sends
+   * faster than it reads can't make us queue without limit. */
+  while ((revents & EV_READ) && !(session->flags & SESSION_READ_PAUSED)
+         && session->output.length < SESSION_OUTPUT_HIGH_WATER) {
+    bytes = session_read(session);
     if (bytes == 0) {
-      /* EOF, close up... */
-      ev_io_stop(loop, io);
-      session_free(session);
-      done = 1;
+      /* EOF, flush any unterminated last line. The peer may only have shut
+       * down its side, so answer what it sent before closing up. */
+      session_frames_finish(session);
+      session->flags |= SESSION_CLOSING;
+      break;
     } else if (bytes < 0) {
       /* EAGAIN occurs when the socket has no more data to read */
       if (errno != EAGAIN) {
-        fprintf(stderr, "read(%d, ...) error(%d): %s\n", io->fd,
-                errno, strerror(errno));
+        eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                         errno);
+        session_close(loop, session);
+        return;
+      }
+      /* Don't sit on an empty buffer while the peer is idle */
+      buffer_trim(&session->input);
+      break;
+    } else if (session_frames(session) != 0) {
+      /* Handle every complete frame we have, straight out of the buffer.
+       * If the input can't be framed, there's no recovering; hang up. */
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                       EPROTO);
+      session_close(loop, session);
+      return;
+    }
+  }
+
+  /* Everything this batch of input produced goes out together. If we were
+   * already waiting for the socket to drain, only EV_WRITE says when. */
+  if ((revents & EV_WRITE) || !(session->flags & SESSION_WRITE_WAITING)) {
+    if (session_send(loop, session) != 0) {
+      return;
+    }
+  }
+  session_watch(loop, session);
+
+  /* Activity only pushes deadlines back, which the timer finds out about
+   * when it fires. A frame starting can bring one forward, though. */
+  if (session_touch(session, timer_now_ms())) {
+    session_timer_update(((Server *)session->data)->data, session);
+  }
+} /* session_io_cb */
+
+/* Send what the socket will take. Returns -1 if the session was closed,
+ * because of an error or because it was closing and is now done. */
+int session_send(struct ev_loop *loop, Session *session) {
+  int rc = session_flush(session);
+
+  if (rc < 0) {
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_WRITE_ERROR, session, errno);
+    session_close(loop, session);
+    return -1;
+  }
+  if (rc > 0) {
+    session->flags |= SESSION_WRITE_WAITING;
+  } else {
+    session->flags &= ~SESSION_WRITE_WAITING;
+  }
+
+  if ((session->flags & SESSION_CLOSING) && session->output.length == 0) {
+    session_close(loop, session);
+    return -1;
+  }
+  return 0;
+} /* session_send */
+
+/* Point the watcher at whatever this session is waiting for. EV_WRITE is
+ * only asked for while the kernel's send buffer is full; otherwise every
+ * loop iteration would report the socket writable. Reading pauses at the
+ * high-water mark and resumes once output is down to the low one. */
+void session_watch(struct ev_loop *loop, Session *session) {
+  ev_io *io = session->io;
+  int events = 0;
+
+  if (session->output.length >= SESSION_OUTPUT_HIGH_WATER) {
+    session->flags |= SESSION_READ_PAUSED;
+  } else if (session->output.length <= SESSION_OUTPUT_LOW_WATER) {
+    session->flags &= ~SESSION_READ_PAUSED;
+  }
+
+  if (!(session->flags & (SESSION_READ_PAUSED | SESSION_CLOSING))) {
+    events |= EV_READ;
+  }
+  if (session->flags & SESSION_WRITE_WAITING) {
+    events |= EV_WRITE;
+  }
+  /* libev keeps flags of its own in io->events */
+  if (events == (io->events & (EV_READ | EV_WRITE)) && ev_is_active(io)) {
+    return;
+  }
+
+  ev_io_stop(loop, io);
+  ev_io_set(io, session->fd, events);
+  if (events != 0) {
+    ev_io_start(loop, io);
+  }
+} /* session_watch */
+
+void session_close(struct ev_loop *loop, Session *session) {
+  EventLoop *event_loop = ((Server *)session->data)->data;
+
+  timerwheel_cancel(&event_loop->wheel, &session->timer);
+  ev_io_stop(loop, session->io);
+  free(session->io);
+  session_free(session);
+
+  event_loop->sessions--;
+  if (event_loop->draining && event_loop->sessions == 0) {
+    ev_break(loop, EVBREAK_ALL);
+  }
+} /* session_close */
+
+/* Make sure the session's timer fires no later than its deadline */
+void session_timer_update(EventLoop *event_loop, Session *session) {
+  uint64_t deadline = session_deadline(session,
+                                       &event_loop->server->timeouts);
+  uint64_t tick = (deadline + SESSION_TIMER_TICK_MS - 1)
+    / SESSION_TIMER_TICK_MS;
+
+  if (deadline == 0) {
+    return;
+  }
+  if (!timer_pending(&session->timer) || tick < session->timer.expires) {
+    timerwheel_schedule(&event_loop->wheel, &session->timer, tick);
+  }
+} /* session_timer_update */
+
+/* The deadline the timer was set for may have moved on since; if so, wait
+ * for the new one. Otherwise the session's time is up. */
+void session_timer_expired(Timer *timer, void *data) {
+  EventLoop *event_loop = data;
+  Session *session = timer_container(timer, Session, timer);
+  uint64_t deadline = session_deadline(session,
+                                       &event_loop->server->timeouts);
+  uint64_t tick = (deadline + SESSION_TIMER_TICK_MS - 1)
+    / SESSION_TIMER_TICK_MS;
+
+  if (tick > event_loop->wheel.now) {
+    timerwheel_schedule(&event_loop->wheel, timer, tick);
+    return;
+  }
+  eventlog_session(EVENTLOG_INFO, EVENT_SESSION_TIMEOUT, session, ETIMEDOUT);
+  session_close(event_loop->loop, session);
+} /* session_timer_expired */
+
+void timer_tick_cb(struct ev_loop *loop, ev_timer *timer, int revents) {
+  EventLoop *event_loop = timer->data;
+
+  timerwheel_advance(&event_loop->wheel,
+                     timer_now_ms() / SESSION_TIMER_TICK_MS,
+                     session_timer_expired, event_loop);
+} /* timer_tick_cb */
+
+/* Our listening sockets are someone else's now: stop accepting, and stop
+ * the loop once the sessions we have are finished. The sockets themselves
+ * stay open until we exit; closing them would be no different for the new
+ * server, which has them too. */
+void event_loop_drain_cb(struct ev_loop *loop, ev_async *async,
+                         int revents) {
+  EventLoop *event_loop = async->data;
+  Server *server = event_loop->server;
+
+  for (int i = 0; i < server->listeners; i++) {
+    ev_io_stop(loop, &server->io[i]);
+  }
+  event_loop->draining = 1;
+  if (event_loop->sessions == 0) {
+    ev_break(loop, EVBREAK_ALL);
+  }
+} /* event_loop_drain_cb */
+
+/* Called on the handoff thread once our replacement is accepting */
+void event_loops_drain(void *data) {
+  fprintf(stderr, "Listening sockets handed off; draining\n");
+  for (long i = 0; i < nloops; i++) {
+    ev_async_send(event_loops[i].loop, &event_loops[i].drain);
+  }
+} /* event_loops_drain */
+
+/* Take over the listening sockets of the server at 'path', if there is
+ * one, before the loops start. The loops deal them out between them; if
+ * there are fewer sockets than loops, loops share sockets, which works,
+ * just with every loop sharing one woken for each connection. Returns the
+ * handle to acknowledge the handoff on, or -1 if there was none. */
+int event_loops_adopt(const char *path) {
+  int fds[HANDOFF_MAX_FDS];
+  int handle;
+  int count = handoff_receive(path, fds, &handle);
+
+  if (count == 0) {
+    return -1;
+  }
+  for (long i = 0; i < nloops; i++) {
+    int taken[SERVER_MAX_LISTENERS];
+    int ntaken = 0;
+    if (count >= nloops) {
+      for (long j = i; j < count && ntaken < SERVER_MAX_LISTENERS;
+           j += nloops) {
+        taken[ntaken++] = fds[j];
       }
-      done = 1;
     } else {
-      printf("%s:%hu => '%.*s'\n", session->peer_address, session->peer_port,
-             (int)bytes, buffer);
+      taken[ntaken++] = fds[i % count];
     }
-  } /* looping forever */
-} /* session_read_cb */
+    server_adopt(event_loops[i].server, taken, ntaken, 1);
+  }
+  printf("Took over %d listening sockets from %s\n", count, path);
+  return handle;
+} /* event_loops_adopt */
 
-int main(void) {
-  struct ev_loop *loop = EV_DEFAULT;
-  Server *server = server_new("0.0.0.0", 7000);
-  //Server *server = server_new("", 7000);
+/* Once the loops are accepting: offer every loop's sockets to our own
+ * replacement, then let the server we took over from, if any, drain. */
+void event_loops_handoff(const char *path, int handle) {
+  int fds[HANDOFF_MAX_FDS];
+  int count = 0;
+
+  for (long i = 0; i < nloops; i++) {
+    Server *server = event_loops[i].server;
+    for (int j = 0; j < server->listeners; j++) {
+      /* Loops may share sockets; hand each over once */
+      int seen = 0;
+      for (int k = 0; k < count; k++) {
+        seen |= fds[k] == server->fds[j];
+      }
+      if (!seen && count < HANDOFF_MAX_FDS) {
+        fds[count++] = server->fds[j];
+      }
+    }
+  }
+  handoff_serve(path, fds, count, event_loops_drain, NULL);
+  if (handle >= 0) {
+    handoff_ack(handle);
+  }
+} /* event_loops_handoff */
+
+/* Set up the listening socket and accept watcher for this loop */
+Status event_loop_start(EventLoop *event_loop, int reuseport) {
+  Server *server = event_loop->server;
   Status rc;
 
-  rc = server_listen(server, 1);
+  /* Sockets from a handoff are listening already */
+  if (server->listeners > 0) {
+    rc = GREAT_SUCCESS;
+  } else if (reuseport) {
+    rc = server_listen_reuseport(server, 1);
+  } else {
+    rc = server_listen(server, 1);
+  }
   insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
 
-  /* set up the libev callback for new connections to our server */
-  server->io = calloc(1, sizeof(*server->io));
-  server->io->data = server;
-  ev_io_init(server->io, server_connect_cb, server->fd, EV_READ);
-  ev_io_start(loop, server->io);
-  //printf("Server now listening on %s:%hu\n", server->address, server->port);
+  ev_async_init(&event_loop->drain, event_loop_drain_cb);
+  event_loop->drain.data = event_loop;
+  ev_async_start(event_loop->loop, &event_loop->drain);
 
-  ev_run (loop, 0);
+  Timeouts *timeouts = &server->timeouts;
+  timerwheel_init(&event_loop->wheel, timer_now_ms() / SESSION_TIMER_TICK_MS);
+  if (timeouts->idle > 0 || timeouts->read > 0 || timeouts->lifetime > 0) {
+    ev_timer_init(&event_loop->tick, timer_tick_cb,
+                  SESSION_TIMER_TICK_MS / 1000., SESSION_TIMER_TICK_MS / 1000.);
+    event_loop->tick.data = event_loop;
+    ev_timer_start(event_loop->loop, &event_loop->tick);
+  }
+
+  /* set up the libev callbacks for new connections to our server */
+  server->io = calloc(server->listeners, sizeof(*server->io));
+  for (int i = 0; i < server->listeners; i++) {
+    server->io[i].data = server;
+    ev_io_init(&server->io[i], server_connect_cb, server->fds[i], EV_READ);
+    ev_io_start(event_loop->loop, &server->io[i]);
+  }
+  return GREAT_SUCCESS;
+} /* event_loop_start */
+
+void *event_loop_run(void *data) {
+  EventLoop *event_loop = data;
+
+  if (event_loop->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(event_loop->cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+      fprintf(stderr, "Failed pinning loop to cpu %d, error(%d): %s\n",
+              event_loop->cpu, err, strerror(err));
+    }
+  }
+
+  ev_run(event_loop->loop, 0);
+  return NULL;
+} /* event_loop_run */
+
+int main(int argc, char **argv) {
+  Server *server = server_new("0.0.0.0", 7000);
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int pin = 0;
+  int opt;
+  Status rc;
+
+  while ((opt = getopt(argc, argv, "l:p" SERVER_OPTIONS
+                       SERVER_TIMEOUT_OPTIONS SERVER_HANDOFF_OPTIONS)) != -1) {
+    switch (opt) {
+      case 'l': nloops = atol(optarg); break;
+      case 'p': pin = 1; break;
+      default:
+        if (server_option(server, opt, optarg) == GREAT_SUCCESS) {
+          break;
+        }
+        fprintf(stderr, "Usage: %s [-l loops] [-p] [options]\n"
+                "  -l loops     number of event loops (threads), each with "
+                "its own SO_REUSEPORT\n"
+                "               listeners\n"
+                "  -p           pin each loop to its own cpu\n"
+                SERVER_USAGE SERVER_TIMEOUT_USAGE SERVER_HANDOFF_USAGE,
+                argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+  insist_return(nloops > 0, TERRIBLE_FAILURE,
+                "Need at least one loop, got %ld", nloops);
+
+  eventlog_start();
+  admin_start(server->stats_address);
+  event_loops = calloc(nloops, sizeof(*event_loops));
+  for (long i = 0; i < nloops; i++) {
+    EventLoop *event_loop = &event_loops[i];
+    event_loop->server = (i == 0) ? server : server_copy(server);
+    event_loop->server->data = event_loop;
+    event_loop->loop = (i == 0) ? EV_DEFAULT : ev_loop_new(EVFLAG_AUTO);
+    event_loop->cpu = pin ? (int)(i % ncpus) : -1;
+  }
+
+  int handle = -1;
+  if (server->handoff_path != NULL) {
+    handle = event_loops_adopt(server->handoff_path);
+  }
+  for (long i = 0; i < nloops; i++) {
+    /* A single loop keeps the classic one-socket setup */
+    rc = event_loop_start(&event_loops[i], nloops > 1);
+    insist_return(rc == GREAT_SUCCESS, rc, "Failed starting loop %ld", i);
+  }
+  if (server->handoff_path != NULL) {
+    event_loops_handoff(server->handoff_path, handle);
+  }
+
+  /* The first loop runs on the main thread; the rest get their own. */
+  for (long i = 1; i < nloops; i++) {
+    int err = pthread_create(&event_loops[i].thread, NULL, event_loop_run,
+                             &event_loops[i]);
+    insist_return(err == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", err, strerror(err));
+  }
+  event_loops[0].thread = pthread_self();
+  event_loop_run(&event_loops[0]);
+
+  /* Loops only stop once drained */
+  for (long i = 1; i < nloops; i++) {
+    pthread_join(event_loops[i].thread, NULL);
+  }
+  fprintf(stderr, "Drained; exiting\n");
   return 0;
 } /* main */
@@ -0,0 +1,193 @@
+#define _BSD_SOURCE /* for struct timespec, etc */
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "eventlog.h"
+#include "insist.h"
+#include "session.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* Number of events the ring holds; must be a power of two */
+#define EVENTLOG_RING_SIZE 8192
+
+/* How long the drain thread sleeps when there is nothing to write */
+#define EVENTLOG_IDLE_NSEC 10000000 /* 10ms */
+
+typedef struct event_record {
+  struct timespec time;
+  EventLogLevel level;
+  EventType type;
+  int fd;
+  int error;
+  /* Big enough for the AF_INET and AF_INET6 addresses sessions hold */
+  union {
+    struct sockaddr address;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } peer;
+} EventRecord;
+
+/* Ring cells carry a sequence number like the cells in workqueue.c, so
+ * producers can claim cells with a single compare-and-swap. */
+typedef struct event_cell {
+  size_t sequence;
+  EventRecord record;
+} EventCell;
+
+EventLogLevel eventlog_level = EVENTLOG_OFF;
+
+/* Producers share the enqueue position and the drop counter; keep them off
+ * the drain thread's cache line. */
+static struct {
+  EventCell *ring;
+  size_t enqueue_position;
+  size_t dropped;
+  char pad[CACHE_LINE_SIZE - sizeof(EventCell *) - 2 * sizeof(size_t)];
+  size_t dequeue_position; /* only the drain thread touches this */
+} eventlog __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static const char *level_names[] = { "debug", "info", "warn", "error", "off" };
+static const char *event_names[] = {
+  "open", "close", "read_error", "write_error", "rejected", "shed",
+  "timeout"
+};
+
+static void *eventlog_drain(void *data);
+static void eventlog_write(FILE *out, EventRecord *record);
+
+void eventlog_start(void) {
+  const char *level = getenv("EVENTLOG_LEVEL");
+  EventLogLevel new_level = EVENTLOG_INFO;
+  pthread_t thread;
+  int err;
+
+  if (level != NULL) {
+    for (int i = EVENTLOG_DEBUG; i <= EVENTLOG_OFF; i++) {
+      if (strcmp(level, level_names[i]) == 0) {
+        new_level = i;
+      }
+    }
+  }
+
+  EventCell *ring = calloc(EVENTLOG_RING_SIZE, sizeof(*ring));
+  insist(ring != NULL, "calloc failed allocating the event log ring");
+  for (size_t i = 0; i < EVENTLOG_RING_SIZE; i++) {
+    ring[i].sequence = i;
+  }
+  eventlog.ring = ring;
+
+  err = pthread_create(&thread, NULL, eventlog_drain, NULL);
+  insist(err == 0, "pthread_create failed, error(%d): %s", err, strerror(err));
+  pthread_detach(thread);
+
+  eventlog_set_level(new_level);
+} /* eventlog_start */
+
+void eventlog_set_level(EventLogLevel level) {
+  __atomic_store_n(&eventlog_level, level, __ATOMIC_RELEASE);
+} /* eventlog_set_level */
+
+void eventlog_session_event(EventLogLevel level, EventType type,
+                            Session *session, int error) {
+  EventCell *cell;
+  size_t position = __atomic_load_n(&eventlog.enqueue_position,
+                                    __ATOMIC_RELAXED);
+
+  if (eventlog.ring == NULL) {
+    return; /* not started */
+  }
+
+  for (;;) {
+    cell = &eventlog.ring[position & (EVENTLOG_RING_SIZE - 1)];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&eventlog.enqueue_position, &position,
+                                      position + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Full. Never make the caller wait for the log. */
+      __atomic_add_fetch(&eventlog.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      position = __atomic_load_n(&eventlog.enqueue_position,
+                                 __ATOMIC_RELAXED);
+    }
+  }
+
+  EventRecord *record = &cell->record;
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->level = level;
+  record->type = type;
+  record->fd = session->fd;
+  record->error = error;
+  memcpy(&record->peer, &session->peer,
+         session->peer_length < sizeof(record->peer)
+         ? session->peer_length : sizeof(record->peer));
+  __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+} /* eventlog_session_event */
+
+/* Write out everything in the ring, then sleep a bit, forever. */
+void *eventlog_drain(void *data) {
+  FILE *out = stdout;
+  struct timespec idle = { 0, EVENTLOG_IDLE_NSEC };
+
+  for (;;) {
+    int written = 0;
+
+    for (;;) {
+      size_t position = eventlog.dequeue_position;
+      EventCell *cell = &eventlog.ring[position & (EVENTLOG_RING_SIZE - 1)];
+      size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      if (sequence != position + 1) {
+        break; /* empty, or the producer hasn't finished writing it */
+      }
+      eventlog_write(out, &cell->record);
+      __atomic_store_n(&cell->sequence, position + EVENTLOG_RING_SIZE,
+                       __ATOMIC_RELEASE);
+      eventlog.dequeue_position = position + 1;
+      written++;
+    }
+
+    size_t lost = __atomic_exchange_n(&eventlog.dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+      fprintf(out, "level=warn event=dropped count=%zd\n", lost);
+      written++;
+    }
+
+    if (written > 0) {
+      fflush(out);
+    } else {
+      nanosleep(&idle, NULL);
+    }
+  }
+  return NULL;
+} /* eventlog_drain */
+
+void eventlog_write(FILE *out, EventRecord *record) {
+  char timestamp[32];
+  char peer[SESSION_PEER_NAME_SIZE];
+  struct tm tm;
+
+  gmtime_r(&record->time.tv_sec, &tm);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  fprintf(out, "%s.%06ldZ level=%s event=%s fd=%d peer=%s", timestamp,
+          record->time.tv_nsec / 1000, level_names[record->level],
+          event_names[record->type], record->fd,
+          address_name(&record->peer.address, peer, sizeof(peer)));
+  if (record->error != 0) {
+    fprintf(out, " error=\"%s\"", strerror(record->error));
+  }
+  fputc('\n', out);
+} /* eventlog_write */
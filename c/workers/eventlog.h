@@ -0,0 +1,53 @@
+#ifndef _EVENTLOG_H_
+#define _EVENTLOG_H_
+
+/* An asynchronous log of connection events.
+ *
+ * Logging an event only copies a small fixed-size record (including the
+ * peer's binary address) into a lock-free ring. A background thread drains
+ * the ring, formats the records and writes them to stdout in batches, so
+ * threads accepting or reading never wait on stdout or on inet_ntop.
+ *
+ * If the ring is full, events are dropped and the drain thread reports how
+ * many were lost. Until eventlog_start() is called, nothing is logged. */
+
+struct session;
+
+typedef enum {
+  EVENTLOG_DEBUG = 0,
+  EVENTLOG_INFO,
+  EVENTLOG_WARN,
+  EVENTLOG_ERROR,
+  EVENTLOG_OFF
+} EventLogLevel;
+
+typedef enum {
+  EVENT_SESSION_OPEN = 0,
+  EVENT_SESSION_CLOSE,
+  EVENT_SESSION_READ_ERROR,
+  EVENT_SESSION_WRITE_ERROR,
+  EVENT_SESSION_REJECTED, /* turned away by admission control */
+  EVENT_SESSION_SHED, /* dropped from a full queue to make room */
+  EVENT_SESSION_TIMEOUT /* closed for being idle, slow or too old */
+} EventType;
+
+/* Start the drain thread. The level comes from the EVENTLOG_LEVEL
+ * environment variable (debug, info, warn, error or off), default info. */
+void eventlog_start(void);
+
+void eventlog_set_level(EventLogLevel level);
+
+/* Record an event about a session. 'error' is an errno value, or 0. */
+void eventlog_session_event(EventLogLevel level, EventType type,
+                            struct session *session, int error);
+
+/* Cheap check callers can use to skip work for events nobody will see */
+extern EventLogLevel eventlog_level;
+#define eventlog_session(level, type, session, error) \
+  do { \
+    if ((level) >= eventlog_level) { \
+      eventlog_session_event((level), (type), (session), (error)); \
+    } \
+  } while (0)
+
+#endif /* _EVENTLOG_H_ */
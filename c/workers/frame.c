@@ -0,0 +1,404 @@
+#define _GNU_SOURCE /* for memrchr */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_HAVE_AVX2
+#endif
+
+#include "frame.h"
+#include "insist.h"
+#include "session.h"
+#include "stats.h"
+
+typedef size_t (*LineScanner)(const Protocol *protocol, Session *session,
+                              const char *data, size_t length);
+
+static size_t scan_lines(const Protocol *protocol, Session *session,
+                         const char *data, size_t length);
+#ifdef FRAME_HAVE_AVX2
+static size_t scan_lines_avx2(const Protocol *protocol, Session *session,
+                              const char *data, size_t length);
+#endif
+static void frame_init(void) __attribute__((constructor));
+static ssize_t msgpack_object_size(const unsigned char *data, size_t length);
+static ssize_t frame_length_scan(const Protocol *protocol, Session *session,
+                                 const char *data, size_t length);
+static void frame_timed(Session *session, const char *frame, size_t length);
+static ssize_t frame_msgpack_scan(const Protocol *protocol, Session *session,
+                                  const char *data, size_t length);
+
+/* Picked once at startup based on what the cpu supports */
+static LineScanner line_scanner = scan_lines;
+
+void frame_init(void) {
+#ifdef FRAME_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    line_scanner = scan_lines_avx2;
+  }
+#endif
+} /* frame_init */
+
+int frame_use_simd(int enabled) {
+  line_scanner = scan_lines;
+  if (enabled) {
+    frame_init();
+  }
+  return line_scanner != scan_lines;
+} /* frame_use_simd */
+
+int framing_parse(const char *name, Framing *framing) {
+  if (strcmp(name, "line") == 0) {
+    *framing = FRAMING_LINE;
+  } else if (strcmp(name, "length") == 0) {
+    *framing = FRAMING_LENGTH;
+  } else if (strcmp(name, "msgpack") == 0) {
+    *framing = FRAMING_MSGPACK;
+  } else {
+    return -1;
+  }
+  return 0;
+} /* framing_parse */
+
+int frame_handler_parse(const char *name, FrameHandler *handler) {
+  if (strcmp(name, "print") == 0) {
+    *handler = frame_print;
+  } else if (strcmp(name, "echo") == 0) {
+    *handler = frame_echo;
+  } else {
+    return -1;
+  }
+  return 0;
+} /* frame_handler_parse */
+
+/* One memchr per line. glibc's memchr is vectorized already, but it has to
+ * set up again for every line, which dominates when lines are short. */
+size_t scan_lines(const Protocol *protocol, Session *session,
+                  const char *data, size_t length) {
+  const char *start = data;
+  const char *end = data + length;
+  const char *newline;
+
+  while ((newline = memchr(start, '\n', end - start)) != NULL) {
+    protocol->handler(session, start, newline - start);
+    start = newline + 1;
+  }
+  return start - data;
+} /* scan_lines */
+
+#ifdef FRAME_HAVE_AVX2
+/* Compare 64 bytes at a time against '\n' and walk the resulting bit mask,
+ * so one pass over the data finds every line in it, however short. Blocks
+ * without a newline, the common case for long lines, cost one test. */
+__attribute__((target("avx2")))
+size_t scan_lines_avx2(const Protocol *protocol, Session *session,
+                       const char *data, size_t length) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t start = 0;
+  size_t i;
+
+  for (i = 0; i + 64 <= length; i += 64) {
+    __m256i low = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *)(data + i)), newline);
+    __m256i high = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *)(data + i + 32)), newline);
+    __m256i any = _mm256_or_si256(low, high);
+    if (_mm256_testz_si256(any, any)) {
+      continue;
+    }
+
+    uint64_t mask = (uint32_t)_mm256_movemask_epi8(low)
+      | ((uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32);
+    while (mask != 0) {
+      size_t end = i + __builtin_ctzll(mask);
+      protocol->handler(session, data + start, end - start);
+      start = end + 1;
+      mask &= mask - 1;
+    }
+  }
+
+  /* Fewer than 64 bytes left */
+  for (; i < length; i++) {
+    if (data[i] == '\n') {
+      protocol->handler(session, data + start, i - start);
+      start = i + 1;
+    }
+  }
+  return start;
+} /* scan_lines_avx2 */
+#endif
+
+/* Size of the msgpack object at 'data', including everything nested in it.
+ * Returns 0 if it isn't all there yet, -1 if it isn't msgpack or is bigger
+ * than FRAME_MAX_SIZE.
+ *
+ * Containers just add their element count to the number of objects still
+ * to skip, so nesting depth costs nothing. */
+ssize_t msgpack_object_size(const unsigned char *data, size_t length) {
+  uint64_t objects = 1;
+  size_t offset = 0;
+
+  while (objects > 0) {
+    size_t header;
+    uint64_t payload = 0;
+    uint64_t children = 0;
+
+    if (offset >= length) {
+      return 0;
+    }
+    unsigned char type = data[offset];
+    const unsigned char *p = data + offset + 1;
+    size_t have = length - offset - 1;
+
+    /* Some types are followed by a big-endian size; make sure it's there */
+#define MSGPACK_NEED(n) if (have < (n)) { return 0; }
+#define MSGPACK_BE16 (((uint64_t)p[0] << 8) | p[1])
+#define MSGPACK_BE32 (((uint64_t)p[0] << 24) | ((uint64_t)p[1] << 16) \
+                      | ((uint64_t)p[2] << 8) | p[3])
+
+    if (type <= 0x7f || type >= 0xe0) { /* fixint */
+      header = 1;
+    } else if (type <= 0x8f) { /* fixmap */
+      header = 1;
+      children = 2 * (type & 0x0f);
+    } else if (type <= 0x9f) { /* fixarray */
+      header = 1;
+      children = type & 0x0f;
+    } else if (type <= 0xbf) { /* fixstr */
+      header = 1;
+      payload = type & 0x1f;
+    } else {
+      switch (type) {
+        case 0xc0: case 0xc2: case 0xc3: /* nil, false, true */
+          header = 1; break;
+        case 0xc4: case 0xd9: /* bin 8, str 8 */
+          MSGPACK_NEED(1); header = 2; payload = p[0]; break;
+        case 0xc5: case 0xda: /* bin 16, str 16 */
+          MSGPACK_NEED(2); header = 3; payload = MSGPACK_BE16; break;
+        case 0xc6: case 0xdb: /* bin 32, str 32 */
+          MSGPACK_NEED(4); header = 5; payload = MSGPACK_BE32; break;
+        case 0xc7: /* ext 8 */
+          MSGPACK_NEED(1); header = 3; payload = p[0]; break;
+        case 0xc8: /* ext 16 */
+          MSGPACK_NEED(2); header = 4; payload = MSGPACK_BE16; break;
+        case 0xc9: /* ext 32 */
+          MSGPACK_NEED(4); header = 6; payload = MSGPACK_BE32; break;
+        case 0xcc: case 0xd0: header = 2; break; /* (u)int 8 */
+        case 0xcd: case 0xd1: header = 3; break; /* (u)int 16 */
+        case 0xca: case 0xce: case 0xd2: header = 5; break; /* 32 bit */
+        case 0xcb: case 0xcf: case 0xd3: header = 9; break; /* 64 bit */
+        case 0xd4: header = 3; break; /* fixext 1 */
+        case 0xd5: header = 4; break; /* fixext 2 */
+        case 0xd6: header = 6; break; /* fixext 4 */
+        case 0xd7: header = 10; break; /* fixext 8 */
+        case 0xd8: header = 18; break; /* fixext 16 */
+        case 0xdc: /* array 16 */
+          MSGPACK_NEED(2); header = 3; children = MSGPACK_BE16; break;
+        case 0xdd: /* array 32 */
+          MSGPACK_NEED(4); header = 5; children = MSGPACK_BE32; break;
+        case 0xde: /* map 16 */
+          MSGPACK_NEED(2); header = 3; children = 2 * MSGPACK_BE16; break;
+        case 0xdf: /* map 32 */
+          MSGPACK_NEED(4); header = 5; children = 2 * MSGPACK_BE32; break;
+        default: /* 0xc1 is never used */
+          return -1;
+      }
+    }
+#undef MSGPACK_NEED
+#undef MSGPACK_BE16
+#undef MSGPACK_BE32
+
+    /* Every object still to come takes at least a byte */
+    if (offset + header + payload + objects - 1 + children > FRAME_MAX_SIZE) {
+      return -1;
+    }
+    offset += header + payload;
+    objects += children - 1;
+  }
+  return offset <= length ? (ssize_t)offset : 0;
+} /* msgpack_object_size */
+
+ssize_t frame_length_scan(const Protocol *protocol, Session *session,
+                          const char *data, size_t length) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  size_t offset = 0;
+
+  while (length - offset >= FRAME_LENGTH_HEADER) {
+    const unsigned char *p = bytes + offset;
+    size_t size = ((size_t)p[0] << 24) | ((size_t)p[1] << 16)
+      | ((size_t)p[2] << 8) | p[3];
+    if (size > FRAME_MAX_SIZE - FRAME_LENGTH_HEADER) {
+      /* Frames before this one are fine; report it when it comes first */
+      return offset > 0 ? (ssize_t)offset : -1;
+    }
+    if (length - offset - FRAME_LENGTH_HEADER < size) {
+      break;
+    }
+    if (protocol != NULL) {
+      protocol->handler(session, data + offset + FRAME_LENGTH_HEADER, size);
+    }
+    offset += FRAME_LENGTH_HEADER + size;
+  }
+  return offset;
+} /* frame_length_scan */
+
+ssize_t frame_msgpack_scan(const Protocol *protocol, Session *session,
+                           const char *data, size_t length) {
+  size_t offset = 0;
+  ssize_t size;
+
+  while ((size = msgpack_object_size((const unsigned char *)data + offset,
+                                     length - offset)) > 0) {
+    if (protocol != NULL) {
+      protocol->handler(session, data + offset, size);
+    }
+    offset += size;
+  }
+  return size < 0 && offset == 0 ? -1 : (ssize_t)offset;
+} /* frame_msgpack_scan */
+
+/* While stats are served, frame_scan hands frames to this instead, to time
+ * them from when the bytes they came in were handed over */
+static __thread FrameHandler timed_handler;
+static __thread uint64_t timed_start;
+
+void frame_timed(Session *session, const char *frame, size_t length) {
+  timed_handler(session, frame, length);
+  stats_frame(timed_start);
+} /* frame_timed */
+
+ssize_t frame_scan(const Protocol *protocol, Session *session,
+                   const char *data, size_t length) {
+  Protocol timed;
+
+  if (stats_enabled) {
+    timed.framing = protocol->framing;
+    timed.handler = frame_timed;
+    timed_handler = protocol->handler;
+    timed_start = stats_now();
+    protocol = &timed;
+  }
+
+  switch (protocol->framing) {
+    case FRAMING_LINE:
+      return line_scanner(protocol, session, data, length);
+    case FRAMING_LENGTH:
+      return frame_length_scan(protocol, session, data, length);
+    case FRAMING_MSGPACK:
+      return frame_msgpack_scan(protocol, session, data, length);
+  }
+  return -1;
+} /* frame_scan */
+
+ssize_t frame_complete(Framing framing, const char *data, size_t length) {
+  switch (framing) {
+    case FRAMING_LINE: {
+      const char *newline = memrchr(data, '\n', length);
+      return newline == NULL ? 0 : newline + 1 - data;
+    }
+    case FRAMING_LENGTH:
+      return frame_length_scan(NULL, NULL, data, length);
+    case FRAMING_MSGPACK:
+      return frame_msgpack_scan(NULL, NULL, data, length);
+  }
+  return -1;
+} /* frame_complete */
+
+int session_frames(Session *session) {
+  Buffer *input = &session->input;
+  size_t length;
+  char *data;
+  ssize_t used;
+
+  for (;;) {
+    data = buffer_peek(input, &length);
+    if (length == 0) {
+      return 0;
+    }
+    used = frame_scan(session->protocol, session, data, length);
+    if (used < 0) {
+      return -1;
+    }
+    if (used > 0) {
+      /* There may be more past the end of the ring */
+      buffer_consume(input, used);
+      continue;
+    }
+
+    if (length < input->length) {
+      /* A frame straddles the end of the ring; unwrap and look again */
+      buffer_straighten(input);
+      data = buffer_peek(input, &length);
+      used = frame_scan(session->protocol, session, data, length);
+      if (used < 0) {
+        return -1;
+      }
+      buffer_consume(input, used);
+      if (used > 0) {
+        continue;
+      }
+    }
+
+    if (input->length < BUFFER_MAX_SIZE) {
+      return 0; /* wait for the rest */
+    }
+    /* Full, and still no complete frame. Lines are cut here, like
+     * buffer_next_line does; the other framings already rejected anything
+     * this big. */
+    insist_return(session->protocol->framing == FRAMING_LINE, -1,
+                  "Full buffer without a complete frame");
+    data = buffer_take_all(input, &length);
+    session->protocol->handler(session, data, length);
+  }
+} /* session_frames */
+
+void session_frames_finish(Session *session) {
+  size_t length;
+  char *data;
+
+  if (session->protocol->framing != FRAMING_LINE) {
+    return;
+  }
+  data = buffer_take_all(&session->input, &length);
+  if (length > 0) {
+    session->protocol->handler(session, data, length);
+  }
+} /* session_frames_finish */
+
+void frame_print(Session *session, const char *frame, size_t length) {
+  char peer[SESSION_PEER_NAME_SIZE];
+
+  if (session->protocol->framing == FRAMING_LINE) {
+    printf("%s => '%.*s'\n", session_peer_name(session, peer, sizeof(peer)),
+           (int)length, frame);
+  } else {
+    printf("%s => %zd byte frame\n",
+           session_peer_name(session, peer, sizeof(peer)), length);
+  }
+} /* frame_print */
+
+void frame_echo(Session *session, const char *frame, size_t length) {
+  unsigned char header[FRAME_LENGTH_HEADER];
+
+  switch (session->protocol->framing) {
+    case FRAMING_LINE:
+      session_write(session, frame, length);
+      session_write(session, "\n", 1);
+      break;
+    case FRAMING_LENGTH:
+      header[0] = (length >> 24) & 0xff;
+      header[1] = (length >> 16) & 0xff;
+      header[2] = (length >> 8) & 0xff;
+      header[3] = length & 0xff;
+      session_write(session, (char *)header, sizeof(header));
+      session_write(session, frame, length);
+      break;
+    case FRAMING_MSGPACK:
+      /* The frame is the whole object, already encoded */
+      session_write(session, frame, length);
+      break;
+  }
+} /* frame_echo */
@@ -0,0 +1,74 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <sys/types.h>
+
+#include "buffer.h"
+#include "session.h"
+
+/* How a session's byte stream splits into messages */
+typedef enum framing {
+  FRAMING_LINE, /* newline-terminated; the newline isn't part of the frame */
+  FRAMING_LENGTH, /* 4-byte big-endian length, then that many bytes */
+  FRAMING_MSGPACK, /* one msgpack object after another */
+} Framing;
+
+#define FRAME_LENGTH_HEADER 4
+
+/* Biggest frame we'll wait for; anything that can't fit in a session's
+ * input buffer would never complete. */
+#define FRAME_MAX_SIZE BUFFER_MAX_SIZE
+
+/* Called with each complete frame. 'frame' points straight into the bytes
+ * that were read (the session's input buffer, or a receive buffer), so it
+ * is only valid until the handler returns. */
+typedef void (*FrameHandler)(Session *session, const char *frame,
+                             size_t length);
+
+typedef struct protocol {
+  Framing framing;
+  FrameHandler handler;
+} Protocol;
+
+/* Find "line", "length" or "msgpack". Returns -1 if 'name' is none of them.
+ */
+int framing_parse(const char *name, Framing *framing);
+
+/* Hand every complete frame at the start of 'data' to the protocol's
+ * handler. Returns how many bytes they took up (the rest is an incomplete
+ * frame), or -1 if the data can't be framed: a bad msgpack type or a frame
+ * bigger than FRAME_MAX_SIZE. Good frames ahead of a bad one are still
+ * handled; the -1 comes once the bad one is first. */
+ssize_t frame_scan(const Protocol *protocol, Session *session,
+                   const char *data, size_t length);
+
+/* Like frame_scan, but only measure: how many bytes at the start of 'data'
+ * are complete frames. */
+ssize_t frame_complete(Framing framing, const char *data, size_t length);
+
+/* Handle every complete frame in the session's input buffer, consuming
+ * them. Returns -1 on a framing error, after which the session should be
+ * closed. */
+int session_frames(Session *session);
+
+/* At EOF: with line framing, an unterminated last line is still handed to
+ * the handler. Anything else left over is an incomplete frame and dropped.
+ */
+void session_frames_finish(Session *session);
+
+/* Find the handler called "print" or "echo". Returns -1 if there is no
+ * such handler. */
+int frame_handler_parse(const char *name, FrameHandler *handler);
+
+/* A handler that prints each frame: lines as they are, other frames as
+ * their size. */
+void frame_print(Session *session, const char *frame, size_t length);
+
+/* A handler that sends each frame back, framed the same way. */
+void frame_echo(Session *session, const char *frame, size_t length);
+
+/* Turn the AVX2 newline scanner on or off (it is on whenever the cpu
+ * supports it), for comparing the two. Returns 1 if it is now in use. */
+int frame_use_simd(int enabled);
+
+#endif /* _FRAME_H_ */
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE /* for clock_gettime, etc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "insist.h"
+#include "session.h"
+#include "status.h"
+
+/* Measures framing throughput: how many frames per second frame_scan finds
+ * in a buffer of back-to-back frames, for each framing, and for lines with
+ * and without the AVX2 scanner. The handler only counts, so this is the cost
+ * of framing alone. */
+
+#define BENCH_BUFFER_SIZE (1 << 20)
+
+static long frames;
+
+static double now(void);
+static void count_frame(Session *session, const char *frame, size_t length);
+static size_t fill(Framing framing, char *data, size_t size,
+                   size_t frame_size);
+static void bench(const char *name, Framing framing, size_t frame_size,
+                  long rounds);
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.;
+} /* now */
+
+void count_frame(Session *session, const char *frame, size_t length) {
+  frames++;
+} /* count_frame */
+
+/* Fill 'data' with as many whole frames of 'frame_size' bytes (including
+ * any header or newline) as fit. Returns the bytes used. */
+size_t fill(Framing framing, char *data, size_t size, size_t frame_size) {
+  size_t used = 0;
+
+  while (used + frame_size <= size) {
+    char *frame = data + used;
+    size_t payload = frame_size - 1;
+    switch (framing) {
+      case FRAMING_LINE:
+        memset(frame, 'x', payload);
+        frame[payload] = '\n';
+        break;
+      case FRAMING_LENGTH:
+        payload = frame_size - FRAME_LENGTH_HEADER;
+        frame[0] = (payload >> 24) & 0xff;
+        frame[1] = (payload >> 16) & 0xff;
+        frame[2] = (payload >> 8) & 0xff;
+        frame[3] = payload & 0xff;
+        memset(frame + FRAME_LENGTH_HEADER, 'x', payload);
+        break;
+      case FRAMING_MSGPACK:
+        /* A str 8 (header of 2), so frame_size can be up to 257 */
+        payload = frame_size - 2;
+        frame[0] = (char)0xd9;
+        frame[1] = (char)payload;
+        memset(frame + 2, 'x', payload);
+        break;
+    }
+    used += frame_size;
+  }
+  return used;
+} /* fill */
+
+void bench(const char *name, Framing framing, size_t frame_size,
+           long rounds) {
+  Protocol protocol = { framing, count_frame };
+  char *data = malloc(BENCH_BUFFER_SIZE);
+  size_t length = fill(framing, data, BENCH_BUFFER_SIZE, frame_size);
+
+  frames = 0;
+  double start = now();
+  for (long i = 0; i < rounds; i++) {
+    ssize_t used = frame_scan(&protocol, NULL, data, length);
+    insist(used == (ssize_t)length, "frame_scan used %zd of %zd bytes", used,
+           length);
+  }
+  double duration = now() - start;
+
+  fprintf(stderr, "%-14s %4zd byte frames: %6.1fM frames/sec, %6.2f GB/sec\n",
+          name, frame_size, frames / duration / 1e6,
+          rounds * length / duration / 1e9);
+  free(data);
+} /* bench */
+
+int main(int argc, char **argv) {
+  long rounds = 200;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    switch (opt) {
+      case 'r': rounds = atol(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-r rounds]\n"
+                "Each round frames 1MB. Results go to stderr.\n", argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+
+  size_t sizes[] = { 16, 64, 256 };
+  for (int i = 0; i < 3; i++) {
+    frame_use_simd(0);
+    bench("line (memchr)", FRAMING_LINE, sizes[i], rounds);
+    bench(frame_use_simd(1) ? "line (avx2)" : "line (no avx2)",
+          FRAMING_LINE, sizes[i], rounds);
+    bench("length", FRAMING_LENGTH, sizes[i], rounds);
+    if (sizes[i] <= 257) {
+      bench("msgpack", FRAMING_MSGPACK, sizes[i], rounds);
+    }
+  }
+  return GREAT_SUCCESS;
+} /* main */
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE /* for accept4, SOCK_CLOEXEC, etc */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "insist.h"
+
+/* The acknowledgement a new server sends once it is accepting */
+#define HANDOFF_ACK 'k'
+
+typedef struct handoff {
+  int fd; /* the Unix socket we listen on */
+  int fds[HANDOFF_MAX_FDS];
+  int count;
+  HandoffDrain drain;
+  void *data;
+} Handoff;
+
+static int handoff_address(const char *path, struct sockaddr_un *address);
+static int handoff_send(Handoff *handoff, int client);
+static void *handoff_run(void *data);
+
+int handoff_address(const char *path, struct sockaddr_un *address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  insist_return(strlen(path) < sizeof(address->sun_path), -1,
+                "Handoff path '%s' is too long", path);
+  strcpy(address->sun_path, path);
+  return 0;
+} /* handoff_address */
+
+int handoff_receive(const char *path, int *fds, int *handle) {
+  struct sockaddr_un address;
+  uint32_t count;
+  struct iovec iov = { &count, sizeof(count) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  } control;
+  struct msghdr message;
+
+  if (handoff_address(path, &address) != 0) {
+    return 0;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  insist(fd >= 0, "socket() failed, errno(%d): %s", errno, strerror(errno));
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    /* Nobody there, or a stale socket left by a server that died */
+    close(fd);
+    return 0;
+  }
+
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  ssize_t bytes;
+  do {
+    bytes = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  } while (bytes < 0 && errno == EINTR);
+  if (bytes != sizeof(count)) {
+    fprintf(stderr, "Handoff from %s failed, errno(%d): %s\n", path,
+            bytes < 0 ? errno : 0, bytes < 0 ? strerror(errno) : "short read");
+    close(fd);
+    return 0;
+  }
+
+  int received = 0;
+  for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+      received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(header), received * sizeof(int));
+    }
+  }
+  insist(received == (int)count && !(message.msg_flags & MSG_CTRUNC),
+         "Handoff from %s sent %d of %u sockets", path, received,
+         (unsigned)count);
+
+  *handle = fd;
+  return received;
+} /* handoff_receive */
+
+void handoff_ack(int handle) {
+  char ack = HANDOFF_ACK;
+
+  if (send(handle, &ack, 1, MSG_NOSIGNAL) != 1) {
+    /* The old server is gone already; nothing left to tell it */
+    fprintf(stderr, "Handoff acknowledgement failed, errno(%d): %s\n", errno,
+            strerror(errno));
+  }
+  close(handle);
+} /* handoff_ack */
+
+void handoff_serve(const char *path, const int *fds, int count,
+                   HandoffDrain drain, void *data) {
+  struct sockaddr_un address;
+  pthread_t thread;
+
+  insist(count <= HANDOFF_MAX_FDS, "Can't hand off %d sockets", count);
+  Handoff *handoff = calloc(1, sizeof(*handoff));
+  memcpy(handoff->fds, fds, count * sizeof(int));
+  handoff->count = count;
+  handoff->drain = drain;
+  handoff->data = data;
+
+  insist(handoff_address(path, &address) == 0, "Bad handoff path");
+  handoff->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  insist(handoff->fd >= 0, "socket() failed, errno(%d): %s", errno,
+         strerror(errno));
+
+  /* Whoever had the path before us has given us its sockets by now, or is
+   * long gone. Connections it already accepted on the old socket are
+   * unaffected. */
+  unlink(path);
+  insist(bind(handoff->fd, (struct sockaddr *)&address, sizeof(address)) == 0,
+         "bind(%s) failed, errno(%d): %s", path, errno, strerror(errno));
+  insist(listen(handoff->fd, 1) == 0, "listen(%s) failed, errno(%d): %s",
+         path, errno, strerror(errno));
+
+  int err = pthread_create(&thread, NULL, handoff_run, handoff);
+  insist(err == 0, "pthread_create failed, error(%d): %s", err, strerror(err));
+  pthread_detach(thread);
+} /* handoff_serve */
+
+/* Send our sockets and wait for the acknowledgement. Returns 0 once the
+ * new server has them, -1 if it went away first. */
+int handoff_send(Handoff *handoff, int client) {
+  uint32_t count = handoff->count;
+  struct iovec iov = { &count, sizeof(count) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  } control;
+  struct msghdr message;
+  char ack;
+
+  memset(&control, 0, sizeof(control));
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * handoff->count);
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * handoff->count);
+  memcpy(CMSG_DATA(header), handoff->fds, sizeof(int) * handoff->count);
+
+  if (sendmsg(client, &message, MSG_NOSIGNAL) != sizeof(count)) {
+    return -1;
+  }
+  /* No timeout: a new server that is still starting up may take a while,
+   * and one that dies closes the connection. */
+  ssize_t bytes;
+  do {
+    bytes = read(client, &ack, 1);
+  } while (bytes < 0 && errno == EINTR);
+  return bytes == 1 && ack == HANDOFF_ACK ? 0 : -1;
+} /* handoff_send */
+
+void *handoff_run(void *data) {
+  Handoff *handoff = data;
+
+  for (;;) {
+    int client = accept4(handoff->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      insist(errno == EINTR || errno == ECONNABORTED,
+             "accept4() on handoff socket failed, errno(%d): %s", errno,
+             strerror(errno));
+      continue;
+    }
+    int rc = handoff_send(handoff, client);
+    close(client);
+    if (rc == 0) {
+      break;
+    }
+    fprintf(stderr, "Handoff abandoned by the new server; still serving\n");
+  }
+
+  /* The path belongs to the new server now; leave it be */
+  close(handoff->fd);
+  handoff->drain(handoff->data);
+  free(handoff);
+  return NULL;
+} /* handoff_run */
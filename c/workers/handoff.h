@@ -0,0 +1,41 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+/* Most listening sockets one handoff carries; the kernel's limit for one
+ * message (SCM_MAX_FD) */
+#define HANDOFF_MAX_FDS 253
+
+/* Handing listening sockets from a running server to its replacement.
+ *
+ * A server started with a handoff path serves handoffs on a Unix socket
+ * there. A new server started with the same path first connects to it: the
+ * old one sends its listening sockets over with SCM_RIGHTS, and the new one
+ * starts accepting on them, takes over the path for the next restart, and
+ * acknowledges. Only then does the old server stop accepting and drain its
+ * sessions. The listening sockets stay open throughout, so nobody connecting
+ * meanwhile is refused; the kernel queues them for whichever process
+ * accepts first. If the new server dies before acknowledging, the old one
+ * carries on as if nothing happened.
+ *
+ * Sessions are not handed over. Their fds could be, but not what is
+ * buffered for them on either side, so the old server finishes them
+ * itself (bounded by -i and -T, if given). */
+
+/* Ask a server at 'path' for its listening sockets. Returns how many were
+ * put in 'fds' (at most HANDOFF_MAX_FDS), with the connection to
+ * acknowledge on in '*handle', or 0 if no server answers at 'path'. */
+int handoff_receive(const char *path, int *fds, int *handle);
+
+/* Tell the old server we are accepting; it stops and drains. */
+void handoff_ack(int handle);
+
+typedef void (*HandoffDrain)(void *data);
+
+/* Serve handoffs of 'fds' at 'path', replacing whatever is there, from a
+ * thread of its own. Once a new server has taken them and acknowledged,
+ * 'drain' is called with 'data' on that thread, and nothing more is served.
+ */
+void handoff_serve(const char *path, const int *fds, int count,
+                   HandoffDrain drain, void *data);
+
+#endif /* _HANDOFF_H_ */
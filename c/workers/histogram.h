@@ -0,0 +1,40 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A log-linear histogram in the style of HdrHistogram.
+ *
+ * Values below 2^HISTOGRAM_PRECISION are counted exactly. Above that, each
+ * power of two is split into 2^(HISTOGRAM_PRECISION - 1) equal buckets, so
+ * any recorded value is off by less than 1/64th (1.6%). Recording is a
+ * couple of shifts and an increment; the whole 64-bit range fits in a fixed
+ * array with no allocation. */
+#define HISTOGRAM_PRECISION 7
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_PRECISION - 1))
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_PRECISION + 2) * HISTOGRAM_HALF)
+
+typedef struct histogram {
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_init(Histogram *histogram);
+void histogram_record(Histogram *histogram, uint64_t value);
+
+/* Add all of 'source' into 'histogram' */
+void histogram_merge(Histogram *histogram, const Histogram *source);
+
+/* The value at a percentile (0 to 100), rounded up to its bucket's top */
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+double histogram_mean(const Histogram *histogram);
+
+/* Print the percentile distribution in HdrHistogram's .hgrm text format,
+ * dividing values by 'scale' (e.g. 1000.0 to print nanoseconds as usec). The
+ * output can be fed to the HdrHistogram plotter. */
+void histogram_print(const Histogram *histogram, FILE *out, double scale);
+
+#endif /* _HISTOGRAM_H_ */
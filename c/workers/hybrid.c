@@ -0,0 +1,502 @@
+#define _GNU_SOURCE /* for inet_aton, accept4, etc */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "eventlog.h"
+#include "frame.h"
+#include "insist.h"
+#include "session.h"
+#include "server.h"
+#include "status.h"
+#include "workqueue.h"
+
+/* State shared between one libev loop and the worker pool serving it */
+typedef struct hybrid {
+  struct ev_loop *loop;
+
+  /** Work units going from the loop to the workers */
+  WorkQueue *work;
+  /** Signalled once per work unit pushed so idle workers can sleep */
+  sem_t work_available;
+
+  /** Finished work units going from the workers back to the loop */
+  WorkQueue *results;
+  ev_async results_ready;
+
+  /** Connections we stopped reading from because the work queue was full */
+  struct connection *throttled;
+} Hybrid;
+
+/* Per-connection bookkeeping. Only ever touched on the loop thread.
+ *
+ * A connection has at most one work unit out at a time, so its answers
+ * come back in the order it asked. Input that arrives meanwhile waits in
+ * the session's buffer and goes out as the next work unit. */
+typedef struct connection {
+  Hybrid *hybrid;
+  Session *session;
+  /** Work units for this connection that have not come back yet */
+  int pending;
+  int closing;
+  int throttled;
+  struct connection *next_throttled;
+} Connection;
+
+/* Complete frames handed to a worker. The loop does the framing, so a
+ * frame is never split between two work units. */
+typedef struct work {
+  Session *session;
+  /** What the handler said back; the loop sends it when the work returns */
+  Output output;
+  size_t length;
+  int whole; /* the data is one frame as is, not something to frame */
+  char data[];
+} Work;
+
+static void server_connect_cb(EV_P_ ev_io *io, int revents);
+static void session_io_cb(EV_P_ ev_io *io, int revents);
+static void results_ready_cb(EV_P_ ev_async *async, int revents);
+static int connection_dispatch(Connection *connection);
+static int connection_send(Connection *connection);
+static void connection_update(Connection *connection);
+static void connection_close(Connection *connection);
+static void connection_throttle(Connection *connection);
+static Work *work_new(Session *session, const char *data, size_t length,
+                      int whole);
+static int work_take(Session *session, Work **work);
+static void work_dispatch(Connection *connection, Work *work);
+static void work_handle(Work *work);
+static void *worker_run(void *data);
+
+/* Called when a new connection occurs. This method sets up handling for the
+ * new connection. */
+void server_connect_cb(struct ev_loop *loop, ev_io *io, int revents) {
+  Server *server = (struct server *)io->data;
+  Hybrid *hybrid = server->data;
+
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+
+  /* Accept a batch of pending connections; see evented.c */
+  for (int i = 0; i < SERVER_ACCEPT_BATCH; i++) {
+    int fd = accept4(io->fd, (struct sockaddr *)&address, &address_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      insist_return(errno == EAGAIN || errno == EINTR
+                    || errno == ECONNABORTED, (void)(0),
+                    "Expected accept4() to fail eventually with EAGAIN, "
+                    "but errno(%d): %s", errno, strerror(errno));
+      return;
+    }
+
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    Connection *connection = calloc(1, sizeof(*connection));
+    connection->hybrid = hybrid;
+    connection->session = session;
+    session->data = connection;
+    session->protocol = &server->protocol;
+
+    session->io = calloc(1, sizeof(*session->io));
+    session->io->data = session;
+    ev_io_init(session->io, session_io_cb, fd, EV_READ);
+    ev_io_start(loop, session->io);
+    address_len = sizeof(address);
+  }
+} /* server_connect_cb */
+
+/* Read everything available and ship complete frames off to the workers.
+ * The loop does no processing of its own unless the work queue is full. */
+void session_io_cb(struct ev_loop *loop, ev_io *io, int revents) {
+  Session *session = io->data;
+  Connection *connection = session->data;
+  ssize_t bytes;
+
+  while ((revents & EV_READ)
+         && !(session->flags & (SESSION_READ_PAUSED | SESSION_CLOSING))
+         && !connection->throttled) {
+    bytes = session_read(session);
+    if (bytes == 0) {
+      /* EOF. Finish answering what the peer sent, then close. */
+      session->flags |= SESSION_CLOSING;
+    } else if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* EAGAIN occurs when the socket has no more data to read; ENOBUFS
+       * when the input buffer is full while a work unit is still out. */
+      if (errno != EAGAIN && errno != ENOBUFS) {
+        eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                         errno);
+        connection_close(connection);
+        return;
+      }
+      if (errno == EAGAIN) {
+        buffer_trim(&session->input);
+      }
+      break;
+    }
+
+    if (connection_dispatch(connection) != 0) {
+      return;
+    }
+  }
+
+  /* Work handled right here (the queue was full) may have answers ready.
+   * If we were waiting for the socket to drain, only EV_WRITE says when. */
+  if ((revents & EV_WRITE) || !(session->flags & SESSION_WRITE_WAITING)) {
+    if (connection_send(connection) != 0) {
+      return;
+    }
+  }
+  connection_update(connection);
+} /* session_io_cb */
+
+/* Ship the complete frames in the input buffer off as one work unit, unless
+ * one is already out. Returns -1 if the connection was closed because the
+ * input can't be framed. */
+int connection_dispatch(Connection *connection) {
+  Session *session = connection->session;
+  Work *work;
+
+  if (connection->pending > 0 || connection->closing) {
+    return 0;
+  }
+
+  if (work_take(session, &work) != 0) {
+    /* Input that can't be framed; hang up */
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                     EPROTO);
+    connection_close(connection);
+    return -1;
+  }
+
+  if (work == NULL && (session->flags & SESSION_CLOSING)
+      && session->protocol->framing == FRAMING_LINE
+      && session->input.length > 0) {
+    /* At EOF, an unterminated last line still counts as a line */
+    size_t length;
+    char *data = buffer_take_all(&session->input, &length);
+    work = work_new(session, data, length, 1);
+  }
+
+  if (work != NULL) {
+    work_dispatch(connection, work);
+  }
+  return 0;
+} /* connection_dispatch */
+
+/* Send what the socket will take. Returns -1 if the connection was closed
+ * because of an error. */
+int connection_send(Connection *connection) {
+  Session *session = connection->session;
+  int rc = session_flush(session);
+
+  if (rc < 0) {
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_WRITE_ERROR, session, errno);
+    connection_close(connection);
+    return -1;
+  }
+  if (rc > 0) {
+    session->flags |= SESSION_WRITE_WAITING;
+  } else {
+    session->flags &= ~SESSION_WRITE_WAITING;
+  }
+  return 0;
+} /* connection_send */
+
+/* Point the watcher at whatever this connection is waiting for, or close
+ * it if the peer is gone and everything it asked for has been answered.
+ * As in evented.c, EV_WRITE is only asked for while the kernel's send
+ * buffer is full, and reading pauses between the output watermarks. */
+void connection_update(Connection *connection) {
+  Session *session = connection->session;
+  ev_io *io = session->io;
+  int events = 0;
+
+  if ((session->flags & SESSION_CLOSING) && connection->pending == 0
+      && session->output.length == 0) {
+    connection_close(connection);
+    return;
+  }
+
+  if (session->output.length >= SESSION_OUTPUT_HIGH_WATER) {
+    session->flags |= SESSION_READ_PAUSED;
+  } else if (session->output.length <= SESSION_OUTPUT_LOW_WATER) {
+    session->flags &= ~SESSION_READ_PAUSED;
+  }
+
+  /* A full input buffer waits for the work unit that's out to come back */
+  if (!(session->flags & (SESSION_READ_PAUSED | SESSION_CLOSING))
+      && !connection->throttled && session->input.length < BUFFER_MAX_SIZE) {
+    events |= EV_READ;
+  }
+  if (session->flags & SESSION_WRITE_WAITING) {
+    events |= EV_WRITE;
+  }
+  /* libev keeps flags of its own in io->events */
+  if (events == (io->events & (EV_READ | EV_WRITE)) && ev_is_active(io)) {
+    return;
+  }
+
+  ev_io_stop(connection->hybrid->loop, io);
+  ev_io_set(io, session->fd, events);
+  if (events != 0) {
+    ev_io_start(connection->hybrid->loop, io);
+  }
+} /* connection_update */
+
+Work *work_new(Session *session, const char *data, size_t length, int whole) {
+  Work *work = malloc(sizeof(*work) + length);
+  insist(work != NULL, "malloc failed for %zd bytes of work", length);
+  work->session = session;
+  output_init(&work->output);
+  work->length = length;
+  work->whole = whole;
+  memcpy(work->data, data, length);
+  return work;
+} /* work_new */
+
+/* Copy every complete frame at the front of the session's input into one
+ * work unit. Sets *work to NULL if there isn't a complete frame yet. Returns
+ * -1 if the input can't be framed. */
+int work_take(Session *session, Work **work) {
+  Buffer *input = &session->input;
+  Framing framing = session->protocol->framing;
+  size_t length;
+  char *data = buffer_peek(input, &length);
+  ssize_t complete;
+
+  *work = NULL;
+  if (length == 0) {
+    return 0;
+  }
+  complete = frame_complete(framing, data, length);
+  if (complete == 0 && length < input->length) {
+    /* A frame straddles the end of the ring */
+    buffer_straighten(input);
+    data = buffer_peek(input, &length);
+    complete = frame_complete(framing, data, length);
+  }
+  if (complete < 0) {
+    return -1;
+  }
+
+  if (complete == 0) {
+    if (input->length < BUFFER_MAX_SIZE) {
+      return 0; /* wait for the rest */
+    }
+    /* Full without a complete frame: cut a line here, see session_frames */
+    if (framing != FRAMING_LINE) {
+      return -1;
+    }
+    data = buffer_take_all(input, &length);
+    *work = work_new(session, data, length, 1);
+    return 0;
+  }
+
+  *work = work_new(session, data, complete, 0);
+  buffer_consume(input, complete);
+  return 0;
+} /* work_take */
+
+void work_dispatch(Connection *connection, Work *work) {
+  Hybrid *hybrid = connection->hybrid;
+
+  if (workqueue_push(hybrid->work, work) != 0) {
+    /* The workers are behind. We already own this data, so handle it here
+     * and stop reading from this peer until some results come back. */
+    work_handle(work);
+    output_splice(&connection->session->output, &work->output);
+    free(work);
+    connection_throttle(connection);
+    return;
+  }
+  connection->pending++;
+  sem_post(&hybrid->work_available);
+} /* work_dispatch */
+
+/* Called on the loop thread after workers finish with some work units. */
+void results_ready_cb(struct ev_loop *loop, ev_async *async, int revents) {
+  Hybrid *hybrid = async->data;
+  Work *work;
+
+  while ((work = workqueue_pop(hybrid->results)) != NULL) {
+    Connection *connection = work->session->data;
+    Session *session = connection->session;
+    connection->pending--;
+
+    if (connection->closing) {
+      output_release(&work->output);
+      free(work);
+      if (connection->pending == 0 && !connection->throttled) {
+        session_free(session);
+        free(connection);
+      }
+      continue;
+    }
+
+    output_splice(&session->output, &work->output);
+    free(work);
+    /* Whatever piled up in the input meanwhile goes out next */
+    if (connection_dispatch(connection) != 0) {
+      continue;
+    }
+    if (!(session->flags & SESSION_WRITE_WAITING)
+        && connection_send(connection) != 0) {
+      continue;
+    }
+    connection_update(connection);
+  }
+
+  /* There is room in the work queue again, so resume throttled peers */
+  while (hybrid->throttled != NULL) {
+    Connection *connection = hybrid->throttled;
+    hybrid->throttled = connection->next_throttled;
+    connection->throttled = 0;
+    if (!connection->closing) {
+      connection_update(connection);
+    } else if (connection->pending == 0) {
+      session_free(connection->session);
+      free(connection);
+    }
+  }
+} /* results_ready_cb */
+
+void connection_close(Connection *connection) {
+  Session *session = connection->session;
+
+  ev_io_stop(connection->hybrid->loop, session->io);
+  free(session->io);
+  session->io = NULL;
+  connection->closing = 1;
+
+  /* Workers may still be holding work units that point at this session; if
+   * so, the last result to come back does the freeing. */
+  if (connection->pending == 0 && !connection->throttled) {
+    session_free(session);
+    free(connection);
+  }
+} /* connection_close */
+
+void connection_throttle(Connection *connection) {
+  Hybrid *hybrid = connection->hybrid;
+
+  if (connection->closing || connection->throttled) {
+    return;
+  }
+  /* connection_update stops the reading */
+  connection->throttled = 1;
+  connection->next_throttled = hybrid->throttled;
+  hybrid->throttled = connection;
+} /* connection_throttle */
+
+/* The actual 'work': hand each frame to the handler. Runs on a worker
+ * thread, except when the loop has to do it itself. Answers collect in the
+ * work unit, since the session's own output belongs to the loop. */
+void work_handle(Work *work) {
+  Session *session = work->session;
+
+  session_write_redirect(&work->output);
+  if (work->whole) {
+    session->protocol->handler(session, work->data, work->length);
+  } else {
+    frame_scan(session->protocol, session, work->data, work->length);
+  }
+  session_write_redirect(NULL);
+} /* work_handle */
+
+void *worker_run(void *data) {
+  Hybrid *hybrid = data;
+  Work *work;
+
+  for (;;) {
+    while (sem_wait(&hybrid->work_available) == -1 && errno == EINTR) {
+      /* interrupted, try again */
+    }
+
+    /* Every post follows a completed push, so an item is on its way. */
+    while ((work = workqueue_pop(hybrid->work)) == NULL) {
+      sched_yield();
+    }
+
+    work_handle(work);
+
+    while (workqueue_push(hybrid->results, work) != 0) {
+      sched_yield();
+    }
+    ev_async_send(hybrid->loop, &hybrid->results_ready);
+  }
+  return NULL;
+} /* worker_run */
+
+int main(int argc, char **argv) {
+  struct ev_loop *loop = EV_DEFAULT;
+  Server *server = server_new("0.0.0.0", 7000);
+  Hybrid *hybrid = calloc(1, sizeof(*hybrid));
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  long queue_size = 4096;
+  Status rc;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:q:" SERVER_OPTIONS)) != -1) {
+    switch (opt) {
+      case 'w': nworkers = atol(optarg); break;
+      case 'q': queue_size = atol(optarg); break;
+      default:
+        if (server_option(server, opt, optarg) == GREAT_SUCCESS) {
+          break;
+        }
+        fprintf(stderr, "Usage: %s [-w workers] [-q queue_size] [options]\n"
+                SERVER_USAGE, argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+  insist_return(nworkers > 0, TERRIBLE_FAILURE,
+                "Need at least one worker, got %ld", nworkers);
+  insist_return(queue_size > 0, TERRIBLE_FAILURE,
+                "Need a positive queue size, got %ld", queue_size);
+
+  hybrid->loop = loop;
+  hybrid->work = workqueue_new(queue_size);
+  /* Room for everything queued plus everything the workers hold, so a
+   * worker almost never has to wait to hand back a result. */
+  hybrid->results = workqueue_new(queue_size + nworkers);
+  sem_init(&hybrid->work_available, 0, 0);
+  ev_async_init(&hybrid->results_ready, results_ready_cb);
+  hybrid->results_ready.data = hybrid;
+  ev_async_start(loop, &hybrid->results_ready);
+
+  for (long i = 0; i < nworkers; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, worker_run, hybrid);
+    insist_return(err == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", err, strerror(err));
+    pthread_detach(thread);
+  }
+
+  eventlog_start();
+  admin_start(server->stats_address);
+  rc = server_listen(server, 1);
+  insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
+
+  /* set up the libev callbacks for new connections to our server */
+  server->data = hybrid;
+  server->io = calloc(server->listeners, sizeof(*server->io));
+  for (int i = 0; i < server->listeners; i++) {
+    server->io[i].data = server;
+    ev_io_init(&server->io[i], server_connect_cb, server->fds[i], EV_READ);
+    ev_io_start(loop, &server->io[i]);
+  }
+  printf("Server listening on %d sockets with %ld workers\n",
+         server->listeners, nworkers);
+
+  ev_run(loop, 0);
+  return 0;
+} /* main */
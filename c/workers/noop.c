@@ -4,6 +4,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "admin.h"
+#include "eventlog.h"
 #include "insist.h"
 #include "session.h"
 #include "server.h"
@@ -14,32 +16,46 @@ static void server_accept(Server *server);
 /* Called when a new connection occurs. This method sets up handling for the
  * new connection. */
 void server_accept(Server *server) {
-  struct sockaddr address;
+  struct sockaddr_storage address;
   socklen_t address_len = sizeof(address);
 
   /* Try to accept all pending connections */
   int fd;
-  while ((fd = accept(server->fd, &address, &address_len)) >= 0) {
+  while ((fd = server_accept_next(server, (struct sockaddr *)&address,
+                                  &address_len, 0)) >= 0) {
     /* Create a new session for this connection */
-    Session *session = session_new(fd, &address, address_len);
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    address_len = sizeof(address);
     session->data = server;
+    session->protocol = &server->protocol;
     session->fd = fd;
 
     /* Do nothing ... */
   }
 
-  fprintf(stderr, "accept(%d, ...) failed, errno(%d): %s\n",
-          server->fd, errno, strerror(errno));
+  fprintf(stderr, "accept failed, errno(%d): %s\n", errno, strerror(errno));
 } /* server_accept */
 
-int main(void) {
+int main(int argc, char **argv) {
   Server *server = server_new("0.0.0.0", 7000);
-  //Server *server = server_new("::", 7000);
+  int opt;
   Status rc;
 
+  while ((opt = getopt(argc, argv, SERVER_OPTIONS)) != -1) {
+    if (server_option(server, opt, optarg) != GREAT_SUCCESS) {
+      fprintf(stderr, "Usage: %s [options]\n" SERVER_USAGE, argv[0]);
+      return TERRIBLE_FAILURE;
+    }
+  }
+
+  eventlog_start();
+  admin_start(server->stats_address);
   rc = server_listen(server, 0);
   insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
-  printf("fd: %d\n", server->fd);
+  for (int i = 0; i < server->listeners; i++) {
+    printf("fd: %d\n", server->fds[i]);
+  }
 
   server_accept(server);
   return 0;
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE /* for MSG_NOSIGNAL */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "buffer.h"
+#include "insist.h"
+#include "output.h"
+#include "stats.h"
+
+static OutputChunk *output_chunk_new(size_t wanted);
+static void output_chunk_free(OutputChunk *chunk);
+
+/* A chunk with room for at least 'wanted' bytes if that fits in the biggest
+ * pool block, otherwise the biggest there is. Ordinary writes share
+ * OUTPUT_CHUNK_SIZE chunks; a big one gets a chunk to itself, so it is
+ * copied once. */
+OutputChunk *output_chunk_new(size_t wanted) {
+  size_t block = OUTPUT_CHUNK_SIZE;
+
+  while (block < BUFFER_MAX_SIZE && block - sizeof(OutputChunk) < wanted) {
+    block *= 2;
+  }
+  OutputChunk *chunk = (OutputChunk *)buffer_block_get(block);
+  chunk->next = NULL;
+  chunk->capacity = block - sizeof(OutputChunk);
+  chunk->start = 0;
+  chunk->end = 0;
+  return chunk;
+} /* output_chunk_new */
+
+void output_chunk_free(OutputChunk *chunk) {
+  buffer_block_put((char *)chunk, chunk->capacity + sizeof(OutputChunk));
+} /* output_chunk_free */
+
+void output_init(Output *output) {
+  output->head = NULL;
+  output->tail = NULL;
+  output->length = 0;
+} /* output_init */
+
+void output_release(Output *output) {
+  while (output->head != NULL) {
+    OutputChunk *chunk = output->head;
+    output->head = chunk->next;
+    output_chunk_free(chunk);
+  }
+  output_init(output);
+} /* output_release */
+
+void output_append(Output *output, const char *data, size_t length) {
+  output->length += length;
+
+  while (length > 0) {
+    OutputChunk *tail = output->tail;
+    if (tail == NULL || tail->end == tail->capacity) {
+      tail = output_chunk_new(length);
+      if (output->tail == NULL) {
+        output->head = tail;
+      } else {
+        output->tail->next = tail;
+      }
+      output->tail = tail;
+    }
+
+    size_t room = tail->capacity - tail->end;
+    size_t copy = room < length ? room : length;
+    memcpy(tail->data + tail->end, data, copy);
+    tail->end += copy;
+    data += copy;
+    length -= copy;
+  }
+} /* output_append */
+
+void output_splice(Output *to, Output *from) {
+  if (from->head == NULL) {
+    return;
+  }
+  if (to->tail == NULL) {
+    to->head = from->head;
+  } else {
+    to->tail->next = from->head;
+  }
+  to->tail = from->tail;
+  to->length += from->length;
+  output_init(from);
+} /* output_splice */
+
+int output_iovec(Output *output, struct iovec *iov, int max) {
+  int count = 0;
+
+  for (OutputChunk *chunk = output->head; chunk != NULL && count < max;
+       chunk = chunk->next) {
+    iov[count].iov_base = chunk->data + chunk->start;
+    iov[count].iov_len = chunk->end - chunk->start;
+    count++;
+  }
+  return count;
+} /* output_iovec */
+
+void output_consume(Output *output, size_t bytes) {
+  insist(bytes <= output->length, "Consuming %zd bytes of %zd queued",
+         bytes, output->length);
+  output->length -= bytes;
+
+  while (bytes > 0) {
+    OutputChunk *chunk = output->head;
+    size_t queued = chunk->end - chunk->start;
+    if (bytes < queued) {
+      chunk->start += bytes;
+      return;
+    }
+    bytes -= queued;
+    output->head = chunk->next;
+    if (output->head == NULL) {
+      output->tail = NULL;
+    }
+    output_chunk_free(chunk);
+  }
+} /* output_consume */
+
+int output_flush(Output *output, int fd) {
+  struct iovec iov[OUTPUT_IOV_MAX];
+  struct msghdr message;
+
+  while (output->length > 0) {
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = output_iovec(output, iov, OUTPUT_IOV_MAX);
+
+    /* sendmsg rather than writev for MSG_NOSIGNAL: a peer that went away
+     * is an error to handle, not a reason to die. */
+    ssize_t bytes = sendmsg(fd, &message, MSG_NOSIGNAL);
+    stats_add(sends, 1);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        stats_add(sends_eagain, 1);
+        return 1;
+      }
+      return -1;
+    }
+    stats_add(bytes_out, bytes);
+    output_consume(output, bytes);
+  }
+  return 0;
+} /* output_flush */
@@ -0,0 +1,59 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Size of the chunks small writes are copied into */
+#define OUTPUT_CHUNK_SIZE (16 << 10)
+
+/* Most chunks sent with one sendmsg() */
+#define OUTPUT_IOV_MAX 64
+
+/* A queue of bytes waiting to be sent to a peer.
+ *
+ * Writes are copied onto the end of the last chunk while it has room, so
+ * many small responses coalesce into a few chunks, and the chunks go out
+ * together in one sendmsg(). Chunks come from the buffer pool (see
+ * buffer_block_get) and go back to it as soon as they have been sent, so
+ * an idle queue holds no memory. */
+typedef struct output_chunk {
+  struct output_chunk *next;
+  size_t capacity; /* bytes of data[] */
+  size_t start; /* offset of the first unsent byte */
+  size_t end; /* offset just past the last byte */
+  char data[];
+} OutputChunk;
+
+typedef struct output {
+  OutputChunk *head;
+  OutputChunk *tail;
+  size_t length; /* unsent bytes in all chunks */
+} Output;
+
+void output_init(Output *output);
+
+/* Drop anything unsent and give the chunks back. */
+void output_release(Output *output);
+
+/* Copy data onto the end of the queue. */
+void output_append(Output *output, const char *data, size_t length);
+
+/* Move everything queued in 'from' onto the end of 'to', without copying.
+ * 'from' is left empty. */
+void output_splice(Output *to, Output *from);
+
+/* Point up to 'max' iovecs at the unsent data, in order. Returns how many
+ * were used. The data stays put until output_consume. */
+int output_iovec(Output *output, struct iovec *iov, int max);
+
+/* Mark 'bytes' bytes sent, releasing chunks that are done. */
+void output_consume(Output *output, size_t bytes);
+
+/* Send as much as the socket will take. Returns 0 once everything is sent,
+ * 1 if the socket's send buffer filled up first (EAGAIN), or -1 with errno
+ * set on any other error. Never raises SIGPIPE. */
+int output_flush(Output *output, int fd);
+
+#endif /* _OUTPUT_H_ */
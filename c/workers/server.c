@@ -1,99 +1,336 @@
-#define _BSD_SOURCE /* for inet_aton, etc */
-#include <arpa/inet.h>
+#define _GNU_SOURCE /* for getaddrinfo, accept4, etc */
 #include <errno.h>
+#include <fcntl.h>
 
 #ifdef EVENTED
 #include <ev.h>
-#endif 
+#endif
 
-#include <fcntl.h>
-#include <netinet/in.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "frame.h"
 #include "insist.h"
 #include "session.h"
 #include "server.h"
 #include "status.h"
 
+static int server_resolve(Server *server, const char *address,
+                          struct addrinfo **result);
+static int server_listen_one(Server *server, struct addrinfo *address,
+                             int nonblocking, int reuseport, int v6only);
+static int server_listen_common(Server *server, int nonblocking,
+                                int reuseport);
+static void server_close(Server *server);
+
 /* Make this Server listen on the network */
 int server_listen(Server *server, int nonblocking) {
-  int rc;
+  return server_listen_common(server, nonblocking, 0);
+} /* server_listen */
 
-  /* TODO(sissel): Support dns lookups? */
+/* Like server_listen, but sets SO_REUSEPORT so that several sockets (one per
+ * thread, usually) can bind the same address and port. The kernel then
+ * spreads incoming connections across all of them. */
+int server_listen_reuseport(Server *server, int nonblocking) {
+  return server_listen_common(server, nonblocking, 1);
+} /* server_listen_reuseport */
 
-  /* Assume ipv6, we'll shrink to ipv4 if needed later */
-  socklen_t socklen = sizeof(struct sockaddr_in6);
-  struct sockaddr *sockaddr = malloc(socklen);
+/* Look up "host", "host:port" or "[ipv6]:port". A bare IPv6 address has
+ * more than one colon, so it can't be mistaken for host:port. */
+int server_resolve(Server *server, const char *address,
+                   struct addrinfo **result) {
+  char host[256];
+  char port[8];
+  const char *colon = strrchr(address, ':');
+  struct addrinfo hints;
+  int rc;
 
-  /* Try IPv6 first ... */
-  if (inet_pton(AF_INET6, server->address,
-                &((struct sockaddr_in6 *)sockaddr)->sin6_addr) == 1) {
-    /* This appears to be a valid ipv6 address */
-    sockaddr->sa_family = AF_INET6;
-    ((struct sockaddr_in6 *)sockaddr)->sin6_port = htons(server->port);
-    //printf("Using ipv6\n");
-  } else {
-    /* Shrink down to ipv4 */
-    socklen = sizeof(struct sockaddr_in);
-    sockaddr = realloc(sockaddr, socklen);
-    if (inet_pton(AF_INET, server->address, 
-                  &((struct sockaddr_in *)sockaddr)->sin_addr) == 1) {
-      /* This appears to be a valid ipv4 address */
-      sockaddr->sa_family = AF_INET;
-      //printf("Using ipv4\n");
-      ((struct sockaddr_in *)sockaddr)->sin_port = htons(server->port);
-    } else {
-      free(sockaddr);
-      fprintf(stderr, "Invalid address: %s, can't listen.\n", server->address);
-      return TERRIBLE_FAILURE;
+  snprintf(port, sizeof(port), "%hu", server->port);
+  if (address[0] == '[') {
+    const char *end = strchr(address, ']');
+    insist_return(end != NULL, TERRIBLE_FAILURE, "Missing ']' in %s", address);
+    snprintf(host, sizeof(host), "%.*s", (int)(end - address - 1), address + 1);
+    if (end[1] == ':') {
+      snprintf(port, sizeof(port), "%s", end + 2);
     }
-  } /* parse ipv4/ipv6 address */
+  } else if (colon != NULL && strchr(address, ':') == colon) {
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+    snprintf(port, sizeof(port), "%s", colon + 1);
+  } else {
+    snprintf(host, sizeof(host), "%s", address);
+  }
 
-  //printf("Family: %d\n", sockaddr->sa_family);
-  server->fd = socket(sockaddr->sa_family, SOCK_STREAM, 0);
-  insist_return(server->fd != -1, TERRIBLE_FAILURE,
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  /* '*' (or nothing) is every local address, IPv4 and IPv6 */
+  int wildcard = host[0] == '\0' || strcmp(host, "*") == 0;
+  rc = getaddrinfo(wildcard ? NULL : host, port, &hints, result);
+  insist_return(rc == 0, TERRIBLE_FAILURE, "Can't resolve %s: %s", address,
+                gai_strerror(rc));
+  return GREAT_SUCCESS;
+} /* server_resolve */
+
+int server_listen_one(Server *server, struct addrinfo *address,
+                      int nonblocking, int reuseport, int v6only) {
+  char name[SESSION_PEER_NAME_SIZE];
+  int val = 1;
+  int rc;
+
+  insist_return(server->listeners < SERVER_MAX_LISTENERS, TERRIBLE_FAILURE,
+                "Too many addresses to listen on (max %d)",
+                SERVER_MAX_LISTENERS);
+  address_name(address->ai_addr, name, sizeof(name));
+
+  /* Set non-blocking at creation rather than with fcntl(F_SETFL) later, which
+   * would also clear any other file status flags. */
+  int fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC
+                  | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+  insist_return(fd != -1, TERRIBLE_FAILURE,
                 "socket() call failed; error(%d): %s", errno, strerror(errno))
+  server->fds[server->listeners++] = fd;
 
   /* Enable socket reuse. This is mainly necessary in cases of restarts that
    * leave open sockets in CLOSE_WAIT or other states that are not LISTEN */
-  int val = 1; /* enable reuseaddr */
-  rc = setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
   insist_return(rc != -1, TERRIBLE_FAILURE, "setsockopt with SO_REUSEADDR "
                 "returned %d, error %s", rc, strerror(errno));
 
+  if (reuseport) {
+    rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    insist_return(rc != -1, TERRIBLE_FAILURE, "setsockopt with SO_REUSEPORT "
+                  "returned %d, error %s", rc, strerror(errno));
+  }
+
+  /* Always set this rather than relying on the net.ipv6.bindv6only sysctl */
+  if (address->ai_family == AF_INET6) {
+    rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    insist_return(rc != -1, TERRIBLE_FAILURE, "setsockopt with IPV6_V6ONLY "
+                  "returned %d, error %s", rc, strerror(errno));
+  }
+
+  /* The kernel finishes handshakes on its own and only wakes us once the
+   * client has sent something (or the timeout passes), so connections that
+   * never say anything never cost an accept. */
+  if (server->defer_accept > 0) {
+    rc = setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &server->defer_accept,
+                    sizeof(server->defer_accept));
+    insist_return(rc != -1, TERRIBLE_FAILURE, "setsockopt with "
+                  "TCP_DEFER_ACCEPT returned %d, error %s", rc,
+                  strerror(errno));
+  }
+
+  /* Lets returning clients send their first request in the SYN */
+  if (server->fastopen > 0) {
+    rc = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &server->fastopen,
+                    sizeof(server->fastopen));
+    insist_return(rc != -1, TERRIBLE_FAILURE, "setsockopt with TCP_FASTOPEN "
+                  "returned %d, error %s", rc, strerror(errno));
+  }
+
   /* Bind on the port/address requested */
-  rc = bind(server->fd, sockaddr, socklen);
-  free(sockaddr); /* don't need this anymore */
-  insist_return(rc == 0, TERRIBLE_FAILURE, 
-                "bind on %s:%hu returned %d , error(%d): %s",
-                server->address, server->port, rc, errno, strerror(errno));
-
-  if (nonblocking) {
-    /* Enable non-blocking */
-    rc = fcntl(server->fd, F_SETFL, O_NONBLOCK);
-    insist_return(rc != -1, TERRIBLE_FAILURE, "fcntl to set ON_NONBLOCK returned "
-                  "%d, error(%d): %s", rc, errno, strerror(errno));
+  rc = bind(fd, address->ai_addr, address->ai_addrlen);
+  insist_return(rc == 0, TERRIBLE_FAILURE, "bind on %s returned %d, "
+                "error(%d): %s", name, rc, errno, strerror(errno));
+
+  rc = listen(fd, server->backlog);
+  insist_return(rc == 0, TERRIBLE_FAILURE, "listen(%d, %d) failed, "
+                "error(%d): %s", fd, server->backlog, errno, strerror(errno));
+
+  return GREAT_SUCCESS;
+} /* server_listen_one */
+
+int server_listen_common(Server *server, int nonblocking, int reuseport) {
+  struct addrinfo *resolved[SERVER_MAX_LISTENERS];
+  int have_ipv4 = 0;
+  int rc = GREAT_SUCCESS;
+
+  /* Resolve everything first: whether IPv6 sockets should also take IPv4
+   * depends on whether we're listening on IPv4 separately. Both at once
+   * would fight over the port. */
+  for (int i = 0; i < server->address_count; i++) {
+    if (server_resolve(server, server->addresses[i], &resolved[i])
+        != GREAT_SUCCESS) {
+      while (--i >= 0) {
+        freeaddrinfo(resolved[i]);
+      }
+      return TERRIBLE_FAILURE;
+    }
+    for (struct addrinfo *ai = resolved[i]; ai != NULL; ai = ai->ai_next) {
+      have_ipv4 |= ai->ai_family == AF_INET;
+    }
+  }
+  int v6only = server->v6only == -1 ? have_ipv4 : server->v6only;
+
+  server->listeners = 0;
+  for (int i = 0; i < server->address_count && rc == GREAT_SUCCESS; i++) {
+    for (struct addrinfo *ai = resolved[i]; ai != NULL; ai = ai->ai_next) {
+      /* /etc/hosts can list the same address twice for one name */
+      int duplicate = 0;
+      for (struct addrinfo *seen = resolved[i]; seen != ai;
+           seen = seen->ai_next) {
+        duplicate |= seen->ai_addrlen == ai->ai_addrlen
+          && memcmp(seen->ai_addr, ai->ai_addr, ai->ai_addrlen) == 0;
+      }
+      if (duplicate) {
+        continue;
+      }
+
+      rc = server_listen_one(server, ai, nonblocking, reuseport, v6only);
+      if (rc != GREAT_SUCCESS) {
+        break;
+      }
+    }
+  }
+
+  for (int i = 0; i < server->address_count; i++) {
+    freeaddrinfo(resolved[i]);
+  }
+  if (rc != GREAT_SUCCESS) {
+    server_close(server);
+  }
+  return rc;
+} /* server_listen_common */
+
+void server_close(Server *server) {
+  for (int i = 0; i < server->listeners; i++) {
+    close(server->fds[i]);
+    server->fds[i] = -1;
   }
+  server->listeners = 0;
+} /* server_close */
 
-  rc = listen(server->fd, 100);
-  insist_return(rc == 0, TERRIBLE_FAILURE, "listen(%d, 5) failed, "
-                "error(%d): %s", server->fd, errno, strerror(errno));
+void server_adopt(Server *server, const int *fds, int count, int nonblocking) {
+  insist(count <= SERVER_MAX_LISTENERS, "Can't listen on %d sockets", count);
+  for (int i = 0; i < count; i++) {
+    server->fds[i] = fds[i];
+    if (nonblocking) {
+      fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+  }
+  server->listeners = count;
+} /* server_adopt */
 
+int server_accept_next(Server *server, struct sockaddr *address,
+                       socklen_t *address_len, int flags) {
+  struct pollfd polls[SERVER_MAX_LISTENERS + 1];
+  int count = server->listeners;
+  int fd;
+
+  if (count == 1 && server->wake_fd < 0) {
+    fd = accept4(server->fds[0], address, address_len, flags);
+    if (fd >= 0 || errno != EAGAIN) {
+      return fd;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    polls[i].fd = server->fds[i];
+    polls[i].events = POLLIN;
+  }
+  polls[count].fd = server->wake_fd; /* ignored by poll if -1 */
+  polls[count].events = POLLIN;
+
+  for (;;) {
+    if (poll(polls, count + 1, -1) == -1) {
+      return -1;
+    }
+    if (polls[count].revents != 0) {
+      errno = ECANCELED;
+      return -1;
+    }
+
+    /* Start after the listener we took from last, so a busy one can't
+     * starve the others */
+    for (int n = 0; n < count; n++) {
+      int i = (server->next_listener + n) % count;
+      if (polls[i].revents != 0) {
+        server->next_listener = i + 1;
+        fd = accept4(server->fds[i], address, address_len, flags);
+        /* EAGAIN: another process sharing the socket got there first */
+        if (fd >= 0 || errno != EAGAIN) {
+          return fd;
+        }
+      }
+    }
+  }
+} /* server_accept_next */
+
+int server_option(Server *server, int opt, const char *arg) {
+  switch (opt) {
+    case 'L':
+      /* The first -L replaces the address the server was made with */
+      if (!server->addresses_given) {
+        server->address_count = 0;
+        server->addresses_given = 1;
+      }
+      insist_return(server->address_count < SERVER_MAX_LISTENERS,
+                    TERRIBLE_FAILURE, "Too many addresses (max %d)",
+                    SERVER_MAX_LISTENERS);
+      server->addresses[server->address_count++] = arg;
+      break;
+    case 'B': server->backlog = atoi(arg); break;
+    case '6': server->v6only = 1; break;
+    case 'D': server->defer_accept = atoi(arg); break;
+    case 'F': server->fastopen = atoi(arg); break;
+    case 'A': server->stats_address = arg; break;
+    case 'U': server->handoff_path = arg; break;
+    case 'f':
+      insist_return(framing_parse(arg, &server->protocol.framing) == 0,
+                    TERRIBLE_FAILURE, "Unknown framing '%s'", arg);
+      break;
+    case 'i': server->timeouts.idle = atof(arg) * 1000; break;
+    case 'r': server->timeouts.read = atof(arg) * 1000; break;
+    case 'T': server->timeouts.lifetime = atof(arg) * 1000; break;
+    case 'H':
+      insist_return(frame_handler_parse(arg, &server->protocol.handler) == 0,
+                    TERRIBLE_FAILURE, "Unknown handler '%s'", arg);
+      break;
+    default:
+      return TERRIBLE_FAILURE;
+  }
   return GREAT_SUCCESS;
-} /* server_listen */
+} /* server_option */
 
 Server *server_new(const char *address, unsigned short port) {
   Server *server = calloc(1, sizeof(Server));
-  server->address = address;
+  server->addresses[0] = address;
+  server->address_count = 1;
   server->port = port;
-  server->fd = -1;
+  server->backlog = SERVER_DEFAULT_BACKLOG;
+  server->v6only = -1;
+  server->protocol.framing = FRAMING_LINE;
+  server->protocol.handler = frame_print;
+  server->wake_fd = -1;
 
   return server;
 } /* server_new */
+
+Server *server_copy(const Server *server) {
+  Server *copy = server_new(NULL, server->port);
+  memcpy(copy->addresses, server->addresses, sizeof(server->addresses));
+  copy->address_count = server->address_count;
+  copy->addresses_given = server->addresses_given;
+  copy->backlog = server->backlog;
+  copy->v6only = server->v6only;
+  copy->defer_accept = server->defer_accept;
+  copy->fastopen = server->fastopen;
+  copy->protocol = server->protocol;
+  copy->timeouts = server->timeouts;
+  copy->stats_address = server->stats_address;
+  copy->handoff_path = server->handoff_path;
+  copy->wake_fd = server->wake_fd;
+  copy->data = server->data;
+
+  return copy;
+} /* server_copy */
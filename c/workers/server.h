@@ -1,20 +1,119 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <sys/socket.h>
+
+#include "frame.h"
+
 #ifdef EVENTED
 #include <ev.h>
 #endif
 
+/* Most connections an event-driven model accepts per wakeup before going
+ * back to serving existing sessions. */
+#define SERVER_ACCEPT_BATCH 64
+
+/* Most addresses (and most sockets they resolve to) a server listens on */
+#define SERVER_MAX_LISTENERS 16
+
+#define SERVER_DEFAULT_BACKLOG 1024
+
+/* getopt letters handled by server_option; each model appends these to its
+ * own, and SERVER_USAGE to its usage message. */
+#define SERVER_OPTIONS "L:B:6D:F:f:H:A:"
+#define SERVER_USAGE \
+  "  -L address   listen on host, host:port or [ipv6]:port; repeat for more\n" \
+  "               (hostnames may resolve to several addresses, '*' means\n" \
+  "               every IPv4 and IPv6 address)\n" \
+  "  -B backlog   listen backlog (default 1024)\n" \
+  "  -6           IPv6 sockets take only IPv6; by default they also take\n" \
+  "               IPv4 unless we're listening on an IPv4 address too\n" \
+  "  -D seconds   TCP_DEFER_ACCEPT: don't accept until the client sends\n" \
+  "  -F queue     TCP_FASTOPEN with this many pending fast opens\n" \
+  "  -f framing   how input splits into messages: line (the default),\n" \
+  "               length (4-byte big-endian length prefix) or msgpack\n" \
+  "  -H handler   what to do with each message: print (the default) or\n" \
+  "               echo (send it back)\n" \
+  "  -A address   serve live statistics on this address (default port\n" \
+  "               7001); send 'stats' or 'msgpack' lines to it\n"
+
+/* Session timeouts, also handled by server_option, for the models that
+ * enforce them */
+#define SERVER_TIMEOUT_OPTIONS "i:r:T:"
+#define SERVER_TIMEOUT_USAGE \
+  "  -i seconds   close sessions that have been idle this long\n" \
+  "  -r seconds   close sessions that take longer than this to send a\n" \
+  "               whole message, once it has started\n" \
+  "  -T seconds   close sessions once they are this old\n"
+
+/* Listening socket handoff (see handoff.h), also handled by server_option,
+ * for the models that support it */
+#define SERVER_HANDOFF_OPTIONS "U:"
+#define SERVER_HANDOFF_USAGE \
+  "  -U path      take over the listening sockets of a server running\n" \
+  "               with the same path, if there is one, which then drains;\n" \
+  "               then serve them to our own replacement there\n"
+
 typedef struct server {
 #ifdef EVENTED
-  ev_io *io; /* TODO(sissel): move this outside the Server struct */
+  /* One per listener. TODO(sissel): move this outside the Server struct */
+  ev_io *io;
 #endif
-  int fd;
-  const char *address;
-  unsigned short port;
+  /** Listening sockets, once server_listen has succeeded */
+  int fds[SERVER_MAX_LISTENERS];
+  int listeners;
+  /** Where server_accept_next looks first, to take turns between listeners */
+  int next_listener;
+
+  /** Addresses to listen on, as given to server_new or -L */
+  const char *addresses[SERVER_MAX_LISTENERS];
+  int address_count;
+  int addresses_given; /* set once -L replaces the server_new address */
+  unsigned short port; /* for addresses that don't name one */
+
+  int backlog;
+  int v6only; /* IPV6_V6ONLY: 1, 0, or -1 to decide from the addresses */
+  int defer_accept; /* seconds, or 0 for none */
+  int fastopen; /* TCP_FASTOPEN queue length, or 0 for none */
+
+  /** Framing and frame handler for every session on this server */
+  Protocol protocol;
+  Timeouts timeouts;
+
+  /** Where to serve statistics (see admin_start), or NULL */
+  const char *stats_address;
+
+  /** Unix socket path for listening socket handoffs, or NULL */
+  const char *handoff_path;
+  /** If not -1, server_accept_next gives up once this is readable */
+  int wake_fd;
+
+  void *data; /* arbitrary data associated with this server */
 } Server;
 
 Server *server_new(const char *address, unsigned short port);
+
+/* A new, not yet listening, server with the same addresses and options */
+Server *server_copy(const Server *server);
+
+/* Handle one of the SERVER_OPTIONS getopt options. Returns TERRIBLE_FAILURE
+ * if 'opt' isn't one of them or 'arg' is bad. */
+int server_option(Server *server, int opt, const char *arg);
+
+/* Listen on every address the server was given. */
 int server_listen(Server *server, int nonblocking);
+int server_listen_reuseport(Server *server, int nonblocking);
+
+/* Listen on sockets that are listening already, handed over by another
+ * process, instead. With 'nonblocking' they are made nonblocking; they are
+ * never made blocking, since the other process shares that setting. */
+void server_adopt(Server *server, const int *fds, int count, int nonblocking);
+
+/* For blocking servers: wait for a connection on any listener and accept it
+ * with accept4 'flags'. Same return and errno as accept4, or -1 with errno
+ * ECANCELED once the wake_fd is readable. Nonblocking listeners are waited
+ * on, not reported as EAGAIN. */
+int server_accept_next(Server *server, struct sockaddr *address,
+                       socklen_t *address_len, int flags);
 
 #endif /* _SERVER_H_ */
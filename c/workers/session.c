@@ -3,51 +3,287 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "eventlog.h"
+#include "insist.h"
+#include "stats.h"
+
+static Session *session_alloc(void);
+static void session_release(Session *session);
+
+/* Where session_write goes instead, if set; see session_write_redirect */
+static __thread Output *write_redirect;
+
+#ifndef SESSION_NO_POOL
+/* Sessions come from a pool instead of calloc/free on every connection.
+ *
+ * Each thread keeps its own free list so the common case takes no locks.
+ * Sessions are often freed on a different thread than they were created on
+ * (worker vs acceptor), so threads that build up too many free sessions
+ * hand a batch over to a shared list, and threads that run dry take a batch
+ * from it before allocating more. Memory is never returned to the system. */
+#define SESSION_SLAB_COUNT 64 /* sessions allocated at once */
+#define SESSION_CACHE_DEPTH 256 /* free sessions a thread may keep */
+#define SESSION_BATCH 64 /* sessions moved to or from the shared list */
+
+typedef struct free_session {
+  struct free_session *next;
+} FreeSession;
+
+static __thread FreeSession *cache;
+static __thread size_t cache_count;
+static __thread int cache_registered;
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static FreeSession *shared;
+
+/* Hands a thread's cache to the shared list when the thread exits */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void cache_key_create(void);
+static void session_cache_register(void);
+static void session_cache_flush(void *unused);
+
+void cache_key_create(void) {
+  pthread_key_create(&cache_key, session_cache_flush);
+} /* cache_key_create */
+
+/* Called before a thread first caches anything, whether it got it by
+ * allocating or by releasing */
+void session_cache_register(void) {
+  if (!cache_registered) {
+    pthread_once(&cache_key_once, cache_key_create);
+    pthread_setspecific(cache_key, (void *)1);
+    cache_registered = 1;
+  }
+} /* session_cache_register */
+
+void session_cache_flush(void *unused) {
+  pthread_mutex_lock(&shared_lock);
+  while (cache != NULL) {
+    FreeSession *session = cache;
+    cache = session->next;
+    session->next = shared;
+    shared = session;
+  }
+  cache_count = 0;
+  pthread_mutex_unlock(&shared_lock);
+} /* session_cache_flush */
+
+static void session_cache_refill(void) {
+  FreeSession *session;
+
+  /* A thread that only allocates still leaves the rest of a batch cached */
+  session_cache_register();
+
+  pthread_mutex_lock(&shared_lock);
+  while (shared != NULL && cache_count < SESSION_BATCH) {
+    session = shared;
+    shared = session->next;
+    session->next = cache;
+    cache = session;
+    cache_count++;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (cache != NULL) {
+    return;
+  }
+
+  Session *slab;
+  int rc = posix_memalign((void **)&slab, SESSION_ALIGNMENT,
+                          SESSION_SLAB_COUNT * sizeof(*slab));
+  insist(rc == 0, "posix_memalign failed allocating sessions, error(%d): %s",
+         rc, strerror(rc));
+  for (int i = 0; i < SESSION_SLAB_COUNT; i++) {
+    session = (FreeSession *)&slab[i];
+    session->next = cache;
+    cache = session;
+    cache_count++;
+  }
+} /* session_cache_refill */
+
+Session *session_alloc(void) {
+  if (cache == NULL) {
+    session_cache_refill();
+  }
+  FreeSession *session = cache;
+  cache = session->next;
+  cache_count--;
+  return (Session *)session;
+} /* session_alloc */
+
+void session_release(Session *session) {
+  FreeSession *released = (FreeSession *)session;
+
+  session_cache_register();
+
+  released->next = cache;
+  cache = released;
+  cache_count++;
+
+  if (cache_count <= SESSION_CACHE_DEPTH) {
+    return;
+  }
+
+  /* Too many; give a batch to threads that need them */
+  pthread_mutex_lock(&shared_lock);
+  for (int i = 0; i < SESSION_BATCH; i++) {
+    released = cache;
+    cache = released->next;
+    cache_count--;
+    released->next = shared;
+    shared = released;
+  }
+  pthread_mutex_unlock(&shared_lock);
+} /* session_release */
+#else
+/* Plain allocation, for comparison (see session_bench.c) */
+Session *session_alloc(void) {
+  Session *session;
+  int rc = posix_memalign((void **)&session, SESSION_ALIGNMENT,
+                          sizeof(*session));
+  insist(rc == 0, "posix_memalign failed allocating a session, error(%d): %s",
+         rc, strerror(rc));
+  return session;
+} /* session_alloc */
+
+void session_release(Session *session) {
+  free(session);
+} /* session_release */
+#endif /* SESSION_NO_POOL */
+
 Session *session_new(int fd, struct sockaddr *address, socklen_t address_len) {
-  Session *session = calloc(1, sizeof(*session));
-  socklen_t address_size;
-  void *sin_addr = NULL;
-
-  switch (address->sa_family) {
-    case AF_INET: 
-      address_size = INET_ADDRSTRLEN;
-      session->peer_port = ntohs(((struct sockaddr_in *)address)->sin_port);
-      sin_addr = &((struct sockaddr_in *)address)->sin_addr;
-      break;
-    case AF_INET6: 
-      address_size = INET6_ADDRSTRLEN;
-      session->peer_port = ntohs(((struct sockaddr_in6 *)address)->sin6_port);
-      sin_addr = &((struct sockaddr_in6 *)address)->sin6_addr;
-      break;
-    default:
-      fprintf(stderr, "Unsupported address family: %d\n", address->sa_family);
-      abort();
+  Session *session;
+
+  if (address->sa_family != AF_INET && address->sa_family != AF_INET6) {
+    fprintf(stderr, "Unsupported address family: %d\n", address->sa_family);
+    abort();
   }
+  insist(address_len <= sizeof(session->peer),
+         "address length %d is larger than sockaddr_storage", address_len);
 
+  session = session_alloc();
+  memset(session, 0, sizeof(*session));
   session->fd = fd;
-  session->peer_address = calloc(1, address_size);
-  const char *ret;
-  ret = inet_ntop(address->sa_family, sin_addr, session->peer_address, address_size);
-  if (ret == NULL) {
-    free(session);
-    fprintf(stderr, "inet_ntop(%d, ...) failed, error(%d): %s\n",
-            address->sa_family, errno, strerror(errno));
-    return NULL;
-  }
-
-  printf("New server connection from %s:%hu\n", session->peer_address,
-         session->peer_port);
+  buffer_init(&session->input);
+  output_init(&session->output);
+  clock_gettime(CLOCK_MONOTONIC, &session->start_time);
+  session->active_time = (uint64_t)session->start_time.tv_sec * 1000
+    + session->start_time.tv_nsec / 1000000;
+
+  /* Keep the address as-is; formatting it is only worth doing if someone
+   * actually wants to print it. */
+  memcpy(&session->peer, address, address_len);
+  session->peer_length = address_len;
+
+  eventlog_session(EVENTLOG_INFO, EVENT_SESSION_OPEN, session, 0);
+  stats_add(accepts, 1);
   return session;
 } /* session_new */
 
 void session_free(Session *session) {
-  //printf("Closing session from %s:%hu\n", session->peer_address,
-         //session->peer_port);
+  eventlog_session(EVENTLOG_DEBUG, EVENT_SESSION_CLOSE, session, 0);
+  stats_add(closes, 1);
   close(session->fd);
-  free(session->peer_address);
-  free(session);
+  buffer_release(&session->input);
+  output_release(&session->output);
+  session_release(session);
 } /* session_free */
 
+/* Read whatever is available into this session's input buffer. Returns what
+ * read(2) did, or -1 with errno set to ENOBUFS if the buffer is full. */
+ssize_t session_read(Session *session) {
+  size_t available;
+  char *space = buffer_write_space(&session->input, &available);
+  ssize_t bytes;
+
+  if (space == NULL) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  bytes = read(session->fd, space, available);
+  stats_add(reads, 1);
+  if (bytes > 0) {
+    buffer_commit(&session->input, bytes);
+    stats_add(bytes_in, bytes);
+  } else if (bytes < 0 && errno == EAGAIN) {
+    stats_add(reads_eagain, 1);
+  }
+  return bytes;
+} /* session_read */
+
+void session_write(Session *session, const char *data, size_t length) {
+  output_append(write_redirect != NULL ? write_redirect : &session->output,
+                data, length);
+} /* session_write */
+
+int session_flush(Session *session) {
+  return output_flush(&session->output, session->fd);
+} /* session_flush */
+
+void session_write_redirect(Output *output) {
+  write_redirect = output;
+} /* session_write_redirect */
+
+int session_touch(Session *session, uint64_t now) {
+  __atomic_store_n(&session->active_time, now, __ATOMIC_RELAXED);
+  if (session->input.length == 0) {
+    __atomic_store_n(&session->frame_time, 0, __ATOMIC_RELAXED);
+  } else if (session->frame_time == 0) {
+    __atomic_store_n(&session->frame_time, now, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+} /* session_touch */
+
+uint64_t session_deadline(Session *session, const Timeouts *timeouts) {
+  uint64_t deadline = UINT64_MAX;
+  uint64_t frame_time = __atomic_load_n(&session->frame_time,
+                                        __ATOMIC_RELAXED);
+
+  if (timeouts->idle > 0) {
+    uint64_t idle = __atomic_load_n(&session->active_time, __ATOMIC_RELAXED)
+      + timeouts->idle;
+    deadline = idle < deadline ? idle : deadline;
+  }
+  if (timeouts->read > 0 && frame_time != 0) {
+    uint64_t read = frame_time + timeouts->read;
+    deadline = read < deadline ? read : deadline;
+  }
+  if (timeouts->lifetime > 0) {
+    uint64_t lifetime = (uint64_t)session->start_time.tv_sec * 1000
+      + session->start_time.tv_nsec / 1000000 + timeouts->lifetime;
+    deadline = lifetime < deadline ? lifetime : deadline;
+  }
+  return deadline == UINT64_MAX ? 0 : deadline;
+} /* session_deadline */
+
+const char *session_peer_name(Session *session, char *name, size_t size) {
+  return address_name((struct sockaddr *)&session->peer, name, size);
+} /* session_peer_name */
+
+const char *address_name(const struct sockaddr *address, char *name,
+                         size_t size) {
+  char host[INET6_ADDRSTRLEN];
+  unsigned short port;
+
+  if (address->sa_family == AF_INET6) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)address;
+    inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+    port = ntohs(in6->sin6_port);
+    snprintf(name, size, "[%s]:%hu", host, port);
+  } else {
+    struct sockaddr_in *in = (struct sockaddr_in *)address;
+    inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+    port = ntohs(in->sin_port);
+    snprintf(name, size, "%s:%hu", host, port);
+  }
+  return name;
+} /* address_name */
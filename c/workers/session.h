@@ -4,26 +4,111 @@
 
 #define _BSD_SOURCE
 #include <arpa/inet.h>
+#include <sys/types.h>
 #include <time.h>
 
+#include "buffer.h"
+#include "output.h"
+#include "timerwheel.h"
+
 #ifdef EVENTED
 #include <ev.h>
 #endif
 
+#define SESSION_ALIGNMENT 64 /* cache line size */
+
+/* Stop reading from a peer once this much output is waiting for it, and
+ * start again once it is down to the low-water mark. */
+#define SESSION_OUTPUT_HIGH_WATER (256 << 10)
+#define SESSION_OUTPUT_LOW_WATER (64 << 10)
+
+/* Limits on how long a session may live, in milliseconds; 0 is no limit.
+ * idle: since anything was last read or sent. read: since a frame started
+ * arriving without being completed. lifetime: since the session started. */
+typedef struct timeouts {
+  uint64_t idle;
+  uint64_t read;
+  uint64_t lifetime;
+} Timeouts;
+
+/* Resolution of session timeouts. Coarse on purpose: the wheel ticks this
+ * often whether or not anything is due. */
+#define SESSION_TIMER_TICK_MS 100
+
+/* Session flags, for models that wait on both directions */
+#define SESSION_READ_PAUSED 0x1 /* output is over the high-water mark */
+#define SESSION_WRITE_WAITING 0x2 /* waiting for the socket to take more */
+#define SESSION_CLOSING 0x4 /* peer is done; close once output is sent */
+#define SESSION_READING 0x8 /* a receive is outstanding (io_uring) */
+
+/* Room for "[ipv6 address]:port" */
+#define SESSION_PEER_NAME_SIZE (INET6_ADDRSTRLEN + 8)
+
 typedef struct session {
+  /* Fields touched on every read come first, so they share a cache line */
+  int fd;
 #ifdef EVENTED
   ev_io *io; /* TODO(sissel): move this outside the Server struct */
 #endif
-  int fd;
-  char *peer_address;
-  unsigned short peer_port;
+  /** Bytes read from the peer but not yet consumed */
+  Buffer input;
+  /** How input splits into frames, and who gets them (see frame.h) */
+  const struct protocol *protocol;
+  /** Bytes queued for the peer but not yet sent */
+  Output output;
+  unsigned flags;
 
   void *data; /* arbitrary data associated with this session */
+
   /** When this session was started */
   struct timespec start_time;
-} Session;
+
+  /** Enforces the session's timeouts; see session_deadline */
+  Timer timer;
+  /** timer_now_ms() when we last read or sent anything */
+  uint64_t active_time;
+  /** timer_now_ms() when the incomplete frame in 'input' started, or 0 */
+  uint64_t frame_time;
+
+  /** The peer's address, as accept() gave it to us. Use session_peer_name()
+   * to get something printable. */
+  socklen_t peer_length;
+  struct sockaddr_storage peer;
+} __attribute__((aligned(SESSION_ALIGNMENT))) Session;
 
 Session *session_new(int fd, struct sockaddr *address, socklen_t address_len);
 void session_free(Session *session);
+ssize_t session_read(Session *session);
+
+/* Queue a response for the peer. Nothing is sent until session_flush, so
+ * everything a batch of input produces goes out in as few sends as
+ * possible. */
+void session_write(Session *session, const char *data, size_t length);
+
+/* Send queued output; see output_flush for the return values. */
+int session_flush(Session *session);
+
+/* Until called again with NULL, session_write on this thread appends to
+ * 'output' instead of the session's own queue. Worker threads use this to
+ * answer for a session that belongs to another thread (see hybrid.c). */
+void session_write_redirect(Output *output);
+
+/* Note activity at 'now' (timer_now_ms). Call after reading or sending.
+ * Returns 1 if an incomplete frame started arriving, which can bring the
+ * session's deadline forward. These fields may be read from a timer
+ * thread, so they are stored atomically. */
+int session_touch(Session *session, uint64_t now);
+
+/* When this session times out under 'timeouts' (timer_now_ms time), or 0
+ * if it never does. */
+uint64_t session_deadline(Session *session, const Timeouts *timeouts);
+
+/* Format the peer as "address:port" into 'name', which should be at least
+ * SESSION_PEER_NAME_SIZE bytes. Returns 'name'. */
+const char *session_peer_name(Session *session, char *name, size_t size);
+
+/* The same, for any AF_INET or AF_INET6 address */
+const char *address_name(const struct sockaddr *address, char *name,
+                         size_t size);
 
 #endif /* _SESSION_H_ */
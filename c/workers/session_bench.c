@@ -0,0 +1,146 @@
+#define _BSD_SOURCE /* for inet_aton, etc */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "insist.h"
+#include "session.h"
+#include "status.h"
+
+/* Measures the cost of setting up and tearing down sessions.
+ *
+ * 'churn' creates and frees sessions with no sockets involved, which shows
+ * the allocator cost alone. 'accept' accepts real loopback connections made
+ * by a second thread and wraps each in a session, which is what the servers
+ * do for every new connection.
+ *
+ * Build with 'make session_bench session_bench_nopool' to compare the
+ * session pool against plain allocation. */
+
+typedef struct connector {
+  struct sockaddr_in address;
+  long count;
+} Connector;
+
+static double now(void);
+static void *connector_run(void *data);
+static void bench_churn(long count);
+static Status bench_accept(long count);
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.;
+} /* now */
+
+void bench_churn(long count) {
+  /* Hold a bunch of sessions at once so the allocator can't simply hand the
+   * same one back every time */
+  const int batch = 1000;
+  Session **sessions = calloc(batch, sizeof(*sessions));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(12345);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  double start = now();
+  for (long i = 0; i < count; i += batch) {
+    for (int j = 0; j < batch; j++) {
+      sessions[j] = session_new(-1, (struct sockaddr *)&address,
+                                sizeof(address));
+    }
+    for (int j = 0; j < batch; j++) {
+      session_free(sessions[j]);
+    }
+  }
+  double duration = now() - start;
+
+  fprintf(stderr, "churn: %ld sessions in %.3fs, %.0f sessions/sec\n",
+          count, duration, count / duration);
+  free(sessions);
+} /* bench_churn */
+
+void *connector_run(void *data) {
+  Connector *connector = data;
+
+  for (long i = 0; i < connector->count; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    insist(fd != -1, "socket() failed, error(%d): %s", errno, strerror(errno));
+    int rc = connect(fd, (struct sockaddr *)&connector->address,
+                     sizeof(connector->address));
+    insist(rc == 0, "connect() failed, error(%d): %s", errno, strerror(errno));
+    close(fd);
+  }
+  return NULL;
+} /* connector_run */
+
+Status bench_accept(long count) {
+  Connector connector;
+  socklen_t length = sizeof(connector.address);
+  pthread_t thread;
+  int rc;
+
+  memset(&connector.address, 0, sizeof(connector.address));
+  connector.address.sin_family = AF_INET;
+  connector.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connector.count = count;
+
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  insist_return(server != -1, TERRIBLE_FAILURE,
+                "socket() failed, error(%d): %s", errno, strerror(errno));
+  rc = bind(server, (struct sockaddr *)&connector.address, length);
+  insist_return(rc == 0, TERRIBLE_FAILURE,
+                "bind() failed, error(%d): %s", errno, strerror(errno));
+  rc = listen(server, 1024);
+  insist_return(rc == 0, TERRIBLE_FAILURE,
+                "listen() failed, error(%d): %s", errno, strerror(errno));
+  /* Find out which port we got */
+  getsockname(server, (struct sockaddr *)&connector.address, &length);
+
+  double start = now();
+  pthread_create(&thread, NULL, connector_run, &connector);
+  for (long i = 0; i < count; i++) {
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    int fd = accept(server, (struct sockaddr *)&address, &address_len);
+    insist_return(fd >= 0, TERRIBLE_FAILURE,
+                  "accept() failed, error(%d): %s", errno, strerror(errno));
+    session_free(session_new(fd, (struct sockaddr *)&address, address_len));
+  }
+  pthread_join(thread, NULL);
+  double duration = now() - start;
+
+  fprintf(stderr, "accept: %ld connections in %.3fs, %.0f accepts/sec\n",
+          count, duration, count / duration);
+  close(server);
+  return GREAT_SUCCESS;
+} /* bench_accept */
+
+int main(int argc, char **argv) {
+  long churn = 1000000;
+  long accepts = 20000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:a:")) != -1) {
+    switch (opt) {
+      case 'c': churn = atol(optarg); break;
+      case 'a': accepts = atol(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-c churn_count] [-a accept_count]\n"
+                "Results go to stderr.\n",
+                argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+
+  bench_churn(churn);
+  return bench_accept(accepts);
+} /* main */
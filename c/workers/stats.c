@@ -0,0 +1,335 @@
+#define _BSD_SOURCE /* for clock_gettime, etc */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "insist.h"
+#include "stats.h"
+
+__thread Stats *stats_local;
+int stats_enabled;
+
+/* The registry: every thread's block, blocks left by threads that have
+ * exited, and what those threads counted. The lock is only taken when a
+ * thread starts or stops counting, and by readers. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Stats *active;
+static Stats *spare;
+static Stats retired;
+static Histogram retired_latency;
+static int thread_count;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t start_time;
+
+/* Counters in the order they are reported */
+static const struct {
+  const char *name;
+  size_t offset;
+} counters[] = {
+  { "accepts", offsetof(Stats, accepts) },
+  { "closes", offsetof(Stats, closes) },
+  { "bytes_in", offsetof(Stats, bytes_in) },
+  { "bytes_out", offsetof(Stats, bytes_out) },
+  { "reads", offsetof(Stats, reads) },
+  { "reads_eagain", offsetof(Stats, reads_eagain) },
+  { "sends", offsetof(Stats, sends) },
+  { "sends_eagain", offsetof(Stats, sends_eagain) },
+};
+#define STATS_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+/* Frame latency percentiles reported, and their names */
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p99.9" };
+#define STATS_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static void stats_key_create(void);
+static void stats_retire(void *data);
+static uint64_t stats_counter(const Stats *stats, size_t i);
+static void stats_total(Stats *total, Histogram *latency);
+static void msgpack_map(FILE *out, uint32_t size);
+static void msgpack_array(FILE *out, uint32_t size);
+static void msgpack_str(FILE *out, const char *str);
+static void msgpack_uint(FILE *out, uint64_t value);
+static void msgpack_double(FILE *out, double value);
+static void msgpack_be(FILE *out, uint64_t value, int bytes);
+
+void stats_key_create(void) {
+  pthread_key_create(&stats_key, stats_retire);
+} /* stats_key_create */
+
+Stats *stats_register(void) {
+  Stats *stats;
+
+  pthread_once(&stats_key_once, stats_key_create);
+
+  pthread_mutex_lock(&registry_lock);
+  if (spare != NULL) {
+    stats = spare;
+    spare = stats->next;
+  } else {
+    int rc = posix_memalign((void **)&stats, STATS_CACHE_LINE_SIZE,
+                            sizeof(*stats));
+    insist(rc == 0, "posix_memalign failed allocating stats, error(%d): %s",
+           rc, strerror(rc));
+    memset(stats, 0, sizeof(*stats));
+    stats->id = thread_count++;
+  }
+  stats->next = active;
+  active = stats;
+  pthread_mutex_unlock(&registry_lock);
+
+  stats_local = stats;
+  pthread_setspecific(stats_key, stats);
+  return stats;
+} /* stats_register */
+
+/* A thread is exiting: keep what it counted and put its block aside */
+void stats_retire(void *data) {
+  Stats *stats = data;
+
+  pthread_mutex_lock(&registry_lock);
+  for (Stats **link = &active; *link != NULL; link = &(*link)->next) {
+    if (*link == stats) {
+      *link = stats->next;
+      break;
+    }
+  }
+  for (size_t i = 0; i < STATS_COUNTERS; i++) {
+    *(uint64_t *)((char *)&retired + counters[i].offset)
+      += stats_counter(stats, i);
+    *(uint64_t *)((char *)stats + counters[i].offset) = 0;
+  }
+  if (stats->frame_latency != NULL) {
+    histogram_merge(&retired_latency, stats->frame_latency);
+    histogram_init(stats->frame_latency);
+  }
+  stats->next = spare;
+  spare = stats;
+  pthread_mutex_unlock(&registry_lock);
+
+  stats_local = NULL;
+} /* stats_retire */
+
+void stats_enable(void) {
+  start_time = stats_now();
+  stats_enabled = 1;
+} /* stats_enable */
+
+uint64_t stats_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+} /* stats_now */
+
+void stats_frame(uint64_t start) {
+  Stats *stats = stats_thread();
+  Histogram *latency = __atomic_load_n(&stats->frame_latency,
+                                       __ATOMIC_ACQUIRE);
+
+  if (latency == NULL) {
+    latency = malloc(sizeof(*latency));
+    insist(latency != NULL, "malloc failed allocating a histogram");
+    histogram_init(latency);
+    __atomic_store_n(&stats->frame_latency, latency, __ATOMIC_RELEASE);
+  }
+  /* Read without the owner's cooperation, like the counters; a reader may
+   * see a bucket counted before the total is, which only skews that one
+   * report by a frame. */
+  histogram_record(latency, stats_now() - start);
+} /* stats_frame */
+
+uint64_t stats_counter(const Stats *stats, size_t i) {
+  return __atomic_load_n((uint64_t *)((char *)stats + counters[i].offset),
+                         __ATOMIC_RELAXED);
+} /* stats_counter */
+
+/* Add every thread up. Called with the registry locked. */
+void stats_total(Stats *total, Histogram *latency) {
+  memset(total, 0, sizeof(*total));
+  histogram_init(latency);
+
+  for (size_t i = 0; i < STATS_COUNTERS; i++) {
+    *(uint64_t *)((char *)total + counters[i].offset)
+      = stats_counter(&retired, i);
+  }
+  histogram_merge(latency, &retired_latency);
+
+  for (Stats *stats = active; stats != NULL; stats = stats->next) {
+    for (size_t i = 0; i < STATS_COUNTERS; i++) {
+      *(uint64_t *)((char *)total + counters[i].offset)
+        += stats_counter(stats, i);
+    }
+    Histogram *frame_latency = __atomic_load_n(&stats->frame_latency,
+                                               __ATOMIC_ACQUIRE);
+    if (frame_latency != NULL) {
+      histogram_merge(latency, frame_latency);
+    }
+  }
+} /* stats_total */
+
+void stats_text(FILE *out) {
+  Stats total;
+  Histogram latency;
+
+  pthread_mutex_lock(&registry_lock);
+  stats_total(&total, &latency);
+
+  fprintf(out, "uptime %.3f\n", (stats_now() - start_time) / 1e9);
+  for (size_t i = 0; i < STATS_COUNTERS; i++) {
+    fprintf(out, "%s %llu\n", counters[i].name,
+            (unsigned long long)stats_counter(&total, i));
+  }
+  fprintf(out, "active %llu\n", total.accepts > total.closes
+          ? (unsigned long long)(total.accepts - total.closes) : 0ULL);
+  fprintf(out, "reads_eagain_rate %.4f\n", total.reads == 0 ? 0.0
+          : (double)total.reads_eagain / total.reads);
+  fprintf(out, "frames %llu\n", (unsigned long long)latency.total);
+  fprintf(out, "frame_latency_usec_mean %.3f\n",
+          histogram_mean(&latency) / 1000.0);
+  for (size_t i = 0; i < STATS_PERCENTILES; i++) {
+    fprintf(out, "frame_latency_usec_%s %.3f\n", percentile_names[i],
+            histogram_percentile(&latency, percentiles[i]) / 1000.0);
+  }
+  fprintf(out, "frame_latency_usec_max %.3f\n", latency.max / 1000.0);
+
+  for (Stats *stats = active; stats != NULL; stats = stats->next) {
+    fprintf(out, "thread %d", stats->id);
+    for (size_t i = 0; i < STATS_COUNTERS; i++) {
+      fprintf(out, " %s=%llu", counters[i].name,
+              (unsigned long long)stats_counter(stats, i));
+    }
+    fprintf(out, "\n");
+  }
+  pthread_mutex_unlock(&registry_lock);
+
+  /* A blank line ends the reply */
+  fprintf(out, "\n");
+} /* stats_text */
+
+void stats_msgpack(FILE *out) {
+  Stats total;
+  Histogram latency;
+  int threads = 0;
+
+  pthread_mutex_lock(&registry_lock);
+  stats_total(&total, &latency);
+
+  msgpack_map(out, STATS_COUNTERS + 6);
+  msgpack_str(out, "uptime");
+  msgpack_double(out, (stats_now() - start_time) / 1e9);
+  for (size_t i = 0; i < STATS_COUNTERS; i++) {
+    msgpack_str(out, counters[i].name);
+    msgpack_uint(out, stats_counter(&total, i));
+  }
+  msgpack_str(out, "active");
+  msgpack_uint(out, total.accepts > total.closes
+               ? total.accepts - total.closes : 0);
+  msgpack_str(out, "reads_eagain_rate");
+  msgpack_double(out, total.reads == 0 ? 0.0
+                 : (double)total.reads_eagain / total.reads);
+  msgpack_str(out, "frames");
+  msgpack_uint(out, latency.total);
+
+  msgpack_str(out, "frame_latency_usec");
+  msgpack_map(out, STATS_PERCENTILES + 2);
+  msgpack_str(out, "mean");
+  msgpack_double(out, histogram_mean(&latency) / 1000.0);
+  for (size_t i = 0; i < STATS_PERCENTILES; i++) {
+    msgpack_str(out, percentile_names[i]);
+    msgpack_double(out, histogram_percentile(&latency, percentiles[i])
+                   / 1000.0);
+  }
+  msgpack_str(out, "max");
+  msgpack_double(out, latency.max / 1000.0);
+
+  msgpack_str(out, "threads");
+  for (Stats *stats = active; stats != NULL; stats = stats->next) {
+    threads++;
+  }
+  msgpack_array(out, threads);
+  for (Stats *stats = active; stats != NULL; stats = stats->next) {
+    msgpack_map(out, STATS_COUNTERS + 1);
+    msgpack_str(out, "id");
+    msgpack_uint(out, stats->id);
+    for (size_t i = 0; i < STATS_COUNTERS; i++) {
+      msgpack_str(out, counters[i].name);
+      msgpack_uint(out, stats_counter(stats, i));
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+} /* stats_msgpack */
+
+/* Just enough of a msgpack encoder for the above, smallest forms first */
+void msgpack_map(FILE *out, uint32_t size) {
+  if (size < 16) {
+    fputc(0x80 | size, out);
+  } else if (size <= 0xffff) {
+    fputc(0xde, out);
+    msgpack_be(out, size, 2);
+  } else {
+    fputc(0xdf, out);
+    msgpack_be(out, size, 4);
+  }
+} /* msgpack_map */
+
+void msgpack_array(FILE *out, uint32_t size) {
+  if (size < 16) {
+    fputc(0x90 | size, out);
+  } else if (size <= 0xffff) {
+    fputc(0xdc, out);
+    msgpack_be(out, size, 2);
+  } else {
+    fputc(0xdd, out);
+    msgpack_be(out, size, 4);
+  }
+} /* msgpack_array */
+
+/* Only short, known strings get here: keys */
+void msgpack_str(FILE *out, const char *str) {
+  size_t length = strlen(str);
+
+  if (length < 32) {
+    fputc(0xa0 | length, out);
+  } else {
+    fputc(0xd9, out);
+    fputc(length, out);
+  }
+  fwrite(str, 1, length, out);
+} /* msgpack_str */
+
+void msgpack_uint(FILE *out, uint64_t value) {
+  if (value < 0x80) {
+    fputc(value, out);
+  } else if (value <= 0xff) {
+    fputc(0xcc, out);
+    fputc(value, out);
+  } else if (value <= 0xffff) {
+    fputc(0xcd, out);
+    msgpack_be(out, value, 2);
+  } else if (value <= 0xffffffff) {
+    fputc(0xce, out);
+    msgpack_be(out, value, 4);
+  } else {
+    fputc(0xcf, out);
+    msgpack_be(out, value, 8);
+  }
+} /* msgpack_uint */
+
+void msgpack_double(FILE *out, double value) {
+  uint64_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  fputc(0xcb, out);
+  msgpack_be(out, bits, 8);
+} /* msgpack_double */
+
+void msgpack_be(FILE *out, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    fputc((value >> (i * 8)) & 0xff, out);
+  }
+} /* msgpack_be */
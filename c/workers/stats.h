@@ -0,0 +1,85 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+#define STATS_CACHE_LINE_SIZE 64
+
+/* Live server statistics.
+ *
+ * Each thread counts into a block of its own, aligned and padded to cache
+ * lines so no two threads ever write the same line. Only the owning thread
+ * writes its block, so counting is an ordinary add and a relaxed store, no
+ * lock and no atomic read-modify-write. Readers add the blocks up with
+ * relaxed loads; the totals are each a moment old, not a snapshot taken
+ * all at once.
+ *
+ * Threads get a block the first time they count something. When a thread
+ * exits its counts are folded into the totals and the block is kept for the
+ * next new thread, so thread-per-connection servers don't grow a block per
+ * connection they have ever had. */
+typedef struct stats {
+  uint64_t accepts; /* sessions started */
+  uint64_t closes; /* sessions ended */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t reads; /* read(2) calls, or receive completions */
+  uint64_t reads_eagain; /* reads that found nothing to read */
+  uint64_t sends; /* sendmsg(2) calls, or send completions */
+  uint64_t sends_eagain; /* sends that found the socket buffer full */
+
+  /** Nanoseconds from the bytes a frame came in being handed to the framing
+   * layer to its handler returning. Only kept once stats_enable is called. */
+  Histogram *frame_latency;
+
+  /* Bookkeeping for the registry in stats.c */
+  int id;
+  struct stats *next;
+} __attribute__((aligned(STATS_CACHE_LINE_SIZE))) Stats;
+
+extern __thread Stats *stats_local;
+
+/* Set by stats_enable; timing frames costs a clock read each, so it is only
+ * done when someone can look at the result. */
+extern int stats_enabled;
+
+/* Start timing frames, and the clock uptime is reported from */
+void stats_enable(void);
+
+/* This thread's block, registering it on first use */
+Stats *stats_register(void);
+
+static inline Stats *stats_thread(void) {
+  return stats_local != NULL ? stats_local : stats_register();
+}
+
+/* Add to one of this thread's counters */
+#define stats_add(counter, n) \
+  do { \
+    Stats *stats_ = stats_thread(); \
+    __atomic_store_n(&stats_->counter, stats_->counter + (n), \
+                     __ATOMIC_RELAXED); \
+  } while (0)
+
+/* Nanoseconds on the monotonic clock */
+uint64_t stats_now(void);
+
+/* Record one frame handled 'start' (from stats_now) nanoseconds ago */
+void stats_frame(uint64_t start);
+
+/* Write every total, then each thread's counters, as "name value" lines
+ * ending with a blank one. */
+void stats_text(FILE *out);
+
+/* The same as one msgpack map:
+ *   { "uptime": seconds, <counter>: n, ..., "active": n,
+ *     "reads_eagain_rate": r, "frames": n,
+ *     "frame_latency_usec": { "mean": us, "p50": us, ..., "max": us },
+ *     "threads": [ { "id": n, <counter>: n, ... }, ... ] } */
+void stats_msgpack(FILE *out);
+
+#endif /* _STATS_H_ */
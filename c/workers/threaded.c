@@ -1,81 +1,481 @@
-#define _BSD_SOURCE /* for inet_aton, etc */
+#define _GNU_SOURCE /* for inet_aton, pipe2, etc */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <pthread.h>
 
+#include "admin.h"
+#include "eventlog.h"
+#include "frame.h"
+#include "handoff.h"
 #include "insist.h"
 #include "session.h"
 #include "server.h"
 #include "status.h"
+#include "timerwheel.h"
+
+/* What to do with a new connection when the backlog queue is full */
+typedef enum {
+  POLICY_BLOCK = 0, /* stop accepting until a worker frees up a slot */
+  POLICY_REJECT,    /* close the new connection */
+  POLICY_SHED       /* close the oldest queued connection to make room */
+} AdmissionPolicy;
+
+/* A bounded queue of accepted sessions waiting for a worker */
+typedef struct session_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  Session **sessions;
+  size_t capacity;
+  size_t head; /* index of the oldest session */
+  size_t count;
+  AdmissionPolicy policy;
+} SessionQueue;
+
+/* Session timeouts for every thread. Sessions share one wheel, advanced by
+ * a thread of its own; readers only touch it when a session starts, ends,
+ * or starts a frame, so the lock is rarely contended. A session whose time
+ * is up gets shut down, which wakes its reader with EOF. */
+typedef struct session_timers {
+  pthread_mutex_t lock;
+  TimerWheel wheel;
+  const Timeouts *timeouts;
+  int enabled;
+} SessionTimers;
+
+static SessionTimers timers = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Sessions open, queued or being handled, so a draining server knows when
+ * it's done */
+static size_t sessions;
+
+/* Written once our listening sockets have been handed off, to wake the
+ * accept loop */
+static int drain_fd = -1;
 
 static void server_accept(Server *server);
+static void server_accept_pooled(Server *server, SessionQueue *queue);
 static void *session_read_loop(void *data);
+static void *worker_run(void *data);
+static void session_handle(Session *session);
+static void session_close(Session *session);
+static void server_drain(void *data);
+static void server_handoff(Server *server);
+static void server_drained(void);
+static void session_timers_start(Server *server);
+static void session_timer_update(Session *session);
+static void session_timer_expired(Timer *timer, void *data);
+static void *session_timers_run(void *data);
+static SessionQueue *session_queue_new(size_t capacity, AdmissionPolicy policy);
+static void session_queue_push(SessionQueue *queue, Session *session);
+static Session *session_queue_pop(SessionQueue *queue);
 
 /* Called when a new connection occurs. This method sets up handling for the
  * new connection. */
 void server_accept(Server *server) {
-  struct sockaddr address;
+  struct sockaddr_storage address;
   socklen_t address_len = sizeof(address);
 
   /* Try to accept all pending connections */
   int fd;
-  while ((fd = accept(server->fd, &address, &address_len)) >= 0) {
+  while ((fd = server_accept_next(server, (struct sockaddr *)&address,
+                                  &address_len, 0)) >= 0) {
     /* Create a new session for this connection */
-    Session *session = session_new(fd, &address, address_len);
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    address_len = sizeof(address);
     session->data = server;
+    session->protocol = &server->protocol;
     session->fd = fd;
+    __atomic_add_fetch(&sessions, 1, __ATOMIC_RELAXED);
+    session_timer_update(session);
 
     /* Start a thread to handle this connection */
-    pthread_t *thread = malloc(sizeof(*thread));
-    pthread_create(thread, NULL, session_read_loop, session);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, session_read_loop, session);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create failed, error(%d): %s\n", err,
+              strerror(err));
+      session_close(session);
+      continue;
+    }
+    /* Nobody joins these threads, let them clean up after themselves */
+    pthread_detach(thread);
   }
 
-  fprintf(stderr, "accept(%d, ...) failed, errno(%d): %s\n",
-          server->fd, errno, strerror(errno));
+  if (errno != ECANCELED) {
+    fprintf(stderr, "accept failed, errno(%d): %s\n", errno,
+            strerror(errno));
+  }
 } /* server_accept */
 
+/* Accept connections and queue them for the worker pool. */
+void server_accept_pooled(Server *server, SessionQueue *queue) {
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+
+  int fd;
+  while ((fd = server_accept_next(server, (struct sockaddr *)&address,
+                                  &address_len, 0)) >= 0) {
+    Session *session = session_new(fd, (struct sockaddr *)&address,
+                                   address_len);
+    address_len = sizeof(address);
+    session->data = server;
+    session->protocol = &server->protocol;
+    session->fd = fd;
+    __atomic_add_fetch(&sessions, 1, __ATOMIC_RELAXED);
+    /* Timeouts run while waiting for a worker too, so connections that
+     * give up in the queue don't tie one up once they get there */
+    session_timer_update(session);
+    session_queue_push(queue, session);
+  }
+
+  if (errno != ECANCELED) {
+    fprintf(stderr, "accept failed, errno(%d): %s\n", errno,
+            strerror(errno));
+  }
+} /* server_accept_pooled */
+
 void *session_read_loop(void *data) {
-  Session *session = (Session *)data;
-  static ssize_t bufsize = 4096;
-  static char buffer[4096];
+  session_handle((Session *)data);
+  return NULL;
+} /* session_read_loop */
+
+/* A pool worker: handle queued sessions one at a time, forever. */
+void *worker_run(void *data) {
+  SessionQueue *queue = data;
+
+  for (;;) {
+    session_handle(session_queue_pop(queue));
+  }
+  return NULL;
+} /* worker_run */
+
+/* Read from this session until it closes, then free it. */
+void session_handle(Session *session) {
   ssize_t bytes;
   int done = 0;
 
   while (!done) {
-    bytes = read(session->fd, buffer, bufsize);
+    bytes = session_read(session);
     if (bytes == 0) {
-      /* EOF, close up... */
-      session_free(session);
+      /* EOF, flush any unterminated last line and close up... */
+      session_frames_finish(session);
       done = 1;
     } else if (bytes < 0) {
       /* EAGAIN occurs when the socket has no more data to read */
       if (errno != EAGAIN) {
-        fprintf(stderr, "read(%d, ...) error(%d): %s\n", session->fd,
-                errno, strerror(errno));
+        eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                         errno);
       }
       done = 1;
-    } else {
-      printf("%s:%hu => '%.*s'\n", session->peer_address, session->peer_port,
-             (int)bytes, buffer);
+      continue;
+    } else if (session_frames(session) != 0) {
+      /* Handle every complete frame we have, straight out of the buffer.
+       * If the input can't be framed, there's no recovering; hang up. */
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                       EPROTO);
+      done = 1;
+      continue;
+    }
+
+    /* Answer everything from this read in one go. The socket blocks, so
+     * this waits for a slow reader, and we don't read more from it in the
+     * meantime; that is all the backpressure this model needs. */
+    if (session_flush(session) != 0) {
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_WRITE_ERROR, session,
+                       errno);
+      done = 1;
+    }
+
+    /* Activity only pushes deadlines back, which the timer finds out about
+     * when it fires. A frame starting can bring one forward, though. */
+    if (timers.enabled && session_touch(session, timer_now_ms())) {
+      session_timer_update(session);
     }
   } /* looping forever */
 
   /* Socket closed, let's clean up */
+  session_close(session);
+} /* session_handle */
+
+void session_close(Session *session) {
+  if (timers.enabled) {
+    pthread_mutex_lock(&timers.lock);
+    timerwheel_cancel(&timers.wheel, &session->timer);
+    pthread_mutex_unlock(&timers.lock);
+  }
   session_free(session);
+  __atomic_sub_fetch(&sessions, 1, __ATOMIC_RELAXED);
+} /* session_close */
+
+/* Called on the handoff thread once our replacement is accepting */
+void server_drain(void *data) {
+  char wake = 1;
+
+  fprintf(stderr, "Listening sockets handed off; draining\n");
+  if (write(drain_fd, &wake, 1) != 1) {
+    fprintf(stderr, "Failed waking the accept loop, errno(%d): %s\n", errno,
+            strerror(errno));
+  }
+} /* server_drain */
+
+/* Take over the listening sockets of the server at the handoff path if
+ * there is one, otherwise listen, then offer them to our own replacement.
+ * They are nonblocking either way: another process may be accepting from
+ * them too, and a blocking accept could wait on a connection it took, long
+ * after we should have stopped. */
+void server_handoff(Server *server) {
+  int fds[HANDOFF_MAX_FDS];
+  int handle;
+  int pipe_fds[2];
+  int count = handoff_receive(server->handoff_path, fds, &handle);
+
+  if (count > 0) {
+    server_adopt(server, fds, count, 1);
+    printf("Took over %d listening sockets from %s\n", count,
+           server->handoff_path);
+  } else {
+    Status rc = server_listen(server, 1);
+    insist(rc == GREAT_SUCCESS, "Server failed to start listening");
+  }
+
+  insist(pipe2(pipe_fds, O_CLOEXEC) == 0, "pipe2 failed, errno(%d): %s",
+         errno, strerror(errno));
+  server->wake_fd = pipe_fds[0];
+  drain_fd = pipe_fds[1];
+  handoff_serve(server->handoff_path, server->fds, server->listeners,
+                server_drain, NULL);
+  if (count > 0) {
+    handoff_ack(handle);
+  }
+} /* server_handoff */
+
+/* Wait for the sessions we have to finish. They're in threads of their
+ * own, so there is nothing to do but look now and then. */
+void server_drained(void) {
+  struct timespec tick = { 0, 100 * 1000000L };
+
+  while (__atomic_load_n(&sessions, __ATOMIC_RELAXED) > 0) {
+    nanosleep(&tick, NULL);
+  }
+  fprintf(stderr, "Drained; exiting\n");
+} /* server_drained */
+
+void session_timers_start(Server *server) {
+  Timeouts *timeouts = &server->timeouts;
+  pthread_t thread;
+
+  if (timeouts->idle == 0 && timeouts->read == 0 && timeouts->lifetime == 0) {
+    return;
+  }
+  timers.timeouts = timeouts;
+  timerwheel_init(&timers.wheel, timer_now_ms() / SESSION_TIMER_TICK_MS);
+  timers.enabled = 1;
+
+  int err = pthread_create(&thread, NULL, session_timers_run, NULL);
+  insist(err == 0, "pthread_create failed, error(%d): %s", err,
+         strerror(err));
+  pthread_detach(thread);
+} /* session_timers_start */
+
+/* Make sure the session's timer fires no later than its deadline */
+void session_timer_update(Session *session) {
+  if (!timers.enabled) {
+    return;
+  }
+
+  uint64_t deadline = session_deadline(session, timers.timeouts);
+  uint64_t tick = (deadline + SESSION_TIMER_TICK_MS - 1)
+    / SESSION_TIMER_TICK_MS;
+
+  if (deadline == 0) {
+    return;
+  }
+  pthread_mutex_lock(&timers.lock);
+  if (!timer_pending(&session->timer) || tick < session->timer.expires) {
+    timerwheel_schedule(&timers.wheel, &session->timer, tick);
+  }
+  pthread_mutex_unlock(&timers.lock);
+} /* session_timer_update */
+
+/* Called with the lock held, so the session can't be freed under us. The
+ * deadline may have moved on since the timer was set; if so, wait for the
+ * new one. Otherwise shut the socket down and let the reader clean up. */
+void session_timer_expired(Timer *timer, void *data) {
+  Session *session = timer_container(timer, Session, timer);
+  uint64_t deadline = session_deadline(session, timers.timeouts);
+  uint64_t tick = (deadline + SESSION_TIMER_TICK_MS - 1)
+    / SESSION_TIMER_TICK_MS;
+
+  if (tick > timers.wheel.now) {
+    timerwheel_schedule(&timers.wheel, timer, tick);
+    return;
+  }
+  eventlog_session(EVENTLOG_INFO, EVENT_SESSION_TIMEOUT, session, ETIMEDOUT);
+  shutdown(session->fd, SHUT_RDWR);
+} /* session_timer_expired */
+
+void *session_timers_run(void *data) {
+  struct timespec tick = { 0, SESSION_TIMER_TICK_MS * 1000000L };
+
+  for (;;) {
+    nanosleep(&tick, NULL);
+    pthread_mutex_lock(&timers.lock);
+    timerwheel_advance(&timers.wheel, timer_now_ms() / SESSION_TIMER_TICK_MS,
+                       session_timer_expired, NULL);
+    pthread_mutex_unlock(&timers.lock);
+  }
   return NULL;
-} /* session_read_loop */
+} /* session_timers_run */
 
-int main(void) {
+SessionQueue *session_queue_new(size_t capacity, AdmissionPolicy policy) {
+  SessionQueue *queue = calloc(1, sizeof(*queue));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  queue->sessions = calloc(capacity, sizeof(*queue->sessions));
+  queue->capacity = capacity;
+  queue->policy = policy;
+  return queue;
+} /* session_queue_new */
+
+/* Queue a session for the workers, applying the admission policy if the
+ * queue is full. */
+void session_queue_push(SessionQueue *queue, Session *session) {
+  Session *victim = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == queue->capacity) {
+    switch (queue->policy) {
+      case POLICY_BLOCK:
+        /* Not accepting leaves new connections in the kernel's listen
+         * backlog, and past that, clients see connection timeouts. */
+        while (queue->count == queue->capacity) {
+          pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        break;
+      case POLICY_REJECT:
+        pthread_mutex_unlock(&queue->lock);
+        eventlog_session(EVENTLOG_WARN, EVENT_SESSION_REJECTED, session, 0);
+        session_close(session);
+        return;
+      case POLICY_SHED:
+        /* The oldest waiter has waited the longest; it is the most likely
+         * to have given up on us already. */
+        victim = queue->sessions[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        break;
+    }
+  }
+
+  queue->sessions[(queue->head + queue->count) % queue->capacity] = session;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (victim != NULL) {
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_SHED, victim, 0);
+    session_close(victim);
+  }
+} /* session_queue_push */
+
+Session *session_queue_pop(SessionQueue *queue) {
+  Session *session;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  session = queue->sessions[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return session;
+} /* session_queue_pop */
+
+int main(int argc, char **argv) {
   Server *server = server_new("0.0.0.0", 7000);
-  //Server *server = server_new("::", 7000);
+  long nworkers = 0;
+  long backlog = 1024;
+  AdmissionPolicy policy = POLICY_BLOCK;
   Status rc;
+  int opt;
 
-  rc = server_listen(server, 0);
-  insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
-  printf("fd: %d\n", server->fd);
+  while ((opt = getopt(argc, argv, "w:q:P:" SERVER_OPTIONS
+                       SERVER_TIMEOUT_OPTIONS SERVER_HANDOFF_OPTIONS)) != -1) {
+    switch (opt) {
+      case 'w': nworkers = atol(optarg); break;
+      case 'q': backlog = atol(optarg); break;
+      case 'P':
+        if (strcmp(optarg, "block") == 0) {
+          policy = POLICY_BLOCK;
+        } else if (strcmp(optarg, "reject") == 0) {
+          policy = POLICY_REJECT;
+        } else if (strcmp(optarg, "shed") == 0) {
+          policy = POLICY_SHED;
+        } else {
+          fprintf(stderr, "Unknown policy '%s'\n", optarg);
+          return TERRIBLE_FAILURE;
+        }
+        break;
+      default:
+        if (server_option(server, opt, optarg) == GREAT_SUCCESS) {
+          break;
+        }
+        fprintf(stderr, "Usage: %s [-w workers] [-q backlog] "
+                "[-P block|reject|shed] [options]\n"
+                "  -w workers  size of the worker pool; 0 (the default) "
+                "starts one thread per connection\n"
+                "  -q backlog  accepted connections allowed to wait for a "
+                "worker\n"
+                "  -P policy   what to do when the backlog is full\n"
+                SERVER_USAGE SERVER_TIMEOUT_USAGE SERVER_HANDOFF_USAGE,
+                argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+  insist_return(nworkers >= 0, TERRIBLE_FAILURE,
+                "Worker count can't be negative, got %ld", nworkers);
+  insist_return(backlog > 0, TERRIBLE_FAILURE,
+                "Need a positive backlog, got %ld", backlog);
 
-  server_accept(server);
+  eventlog_start();
+  admin_start(server->stats_address);
+  if (server->handoff_path != NULL) {
+    server_handoff(server);
+  } else {
+    rc = server_listen(server, 0);
+    insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
+  }
+  for (int i = 0; i < server->listeners; i++) {
+    printf("fd: %d\n", server->fds[i]);
+  }
+  session_timers_start(server);
+
+  if (nworkers == 0) {
+    server_accept(server);
+    server_drained();
+    return 0;
+  }
+
+  SessionQueue *queue = session_queue_new(backlog, policy);
+  for (long i = 0; i < nworkers; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, worker_run, queue);
+    insist_return(err == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", err, strerror(err));
+    pthread_detach(thread);
+  }
+  server_accept_pooled(server, queue);
+  server_drained();
   return 0;
 } /* main */
@@ -0,0 +1,119 @@
+#define _BSD_SOURCE /* for clock_gettime, etc */
+#include <string.h>
+#include <time.h>
+
+#include "insist.h"
+#include "timerwheel.h"
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+
+/* Ticks the wheel covers; timers due later wait in the last slot */
+#define TIMERWHEEL_RANGE ((uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+static void timerwheel_place(TimerWheel *wheel, Timer *timer);
+static void timerwheel_cascade(TimerWheel *wheel, int level);
+
+void timerwheel_init(TimerWheel *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->now = now;
+} /* timerwheel_init */
+
+/* File a timer under the slot for its expiry: the lowest level whose span
+ * reaches that far. */
+void timerwheel_place(TimerWheel *wheel, Timer *timer) {
+  uint64_t expires = timer->expires;
+  uint64_t delta = expires - wheel->now;
+  int level = 0;
+
+  if (delta >= TIMERWHEEL_RANGE) {
+    expires = wheel->now + TIMERWHEEL_RANGE - 1;
+    delta = TIMERWHEEL_RANGE - 1;
+  }
+  while (delta >= ((uint64_t)1 << (TIMERWHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  Timer **slot = &wheel->slots[level]
+    [(expires >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK];
+  timer->next = *slot;
+  if (timer->next != NULL) {
+    timer->next->prev = &timer->next;
+  }
+  timer->prev = slot;
+  *slot = timer;
+} /* timerwheel_place */
+
+void timerwheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires) {
+  timerwheel_cancel(wheel, timer);
+  timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+  timerwheel_place(wheel, timer);
+  wheel->count++;
+} /* timerwheel_schedule */
+
+void timerwheel_cancel(TimerWheel *wheel, Timer *timer) {
+  if (timer->prev == NULL) {
+    return;
+  }
+  *timer->prev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  wheel->count--;
+} /* timerwheel_cancel */
+
+/* The current slot of 'level' now covers ticks that belong to the level
+ * below; re-file its timers there. */
+void timerwheel_cascade(TimerWheel *wheel, int level) {
+  Timer **slot = &wheel->slots[level]
+    [(wheel->now >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK];
+  Timer *timer = *slot;
+
+  *slot = NULL;
+  while (timer != NULL) {
+    Timer *next = timer->next;
+    timerwheel_place(wheel, timer);
+    timer = next;
+  }
+} /* timerwheel_cascade */
+
+void timerwheel_advance(TimerWheel *wheel, uint64_t now,
+                        TimerExpired expired, void *data) {
+  while (wheel->now < now) {
+    if (wheel->count == 0) {
+      /* Nothing to step through */
+      wheel->now = now;
+      return;
+    }
+    wheel->now++;
+
+    /* Crossing into a new slot of a higher level: refill the levels below
+     * it, highest first, since each feeds the one under it. */
+    int level = 0;
+    while (level + 1 < TIMERWHEEL_LEVELS
+           && (wheel->now & (((uint64_t)1 << (TIMERWHEEL_BITS * (level + 1)))
+                             - 1)) == 0) {
+      level++;
+    }
+    for (; level > 0; level--) {
+      timerwheel_cascade(wheel, level);
+    }
+
+    Timer **slot = &wheel->slots[0][wheel->now & TIMERWHEEL_MASK];
+    while (*slot != NULL) {
+      Timer *timer = *slot;
+      insist(timer->expires == wheel->now, "Timer due at tick %llu found "
+             "at tick %llu", (unsigned long long)timer->expires,
+             (unsigned long long)wheel->now);
+      timerwheel_cancel(wheel, timer);
+      expired(timer, data);
+    }
+  }
+} /* timerwheel_advance */
+
+uint64_t timer_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} /* timer_now_ms */
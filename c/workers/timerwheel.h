@@ -0,0 +1,62 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A hierarchical timing wheel.
+ *
+ * Four levels of 64 slots each. Level 0 holds timers due within the next
+ * 64 ticks, one slot per tick; level 1 holds those due within 64^2 ticks,
+ * one slot per 64 ticks; and so on. Scheduling and cancelling are O(1)
+ * (timers are intrusive, doubly-linked list entries), and advancing costs
+ * one slot per tick plus, every 64 ticks, re-filing one slot of the level
+ * above. Timers further out than 64^4 ticks are parked in the last slot
+ * and re-filed until they are in range.
+ *
+ * Nothing here is thread safe; callers that share a wheel lock it. */
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4
+
+typedef struct timer {
+  struct timer *next;
+  struct timer **prev; /* NULL while not scheduled */
+  uint64_t expires; /* tick this timer is due at */
+} Timer;
+
+typedef struct timer_wheel {
+  uint64_t now; /* current tick */
+  size_t count; /* timers scheduled */
+  Timer *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} TimerWheel;
+
+/* Called for each timer that comes due. The timer is no longer scheduled
+ * by then, so the callback may schedule it again or free it. */
+typedef void (*TimerExpired)(Timer *timer, void *data);
+
+/* Get the struct a timer is embedded in */
+#define timer_container(timer, type, member) \
+  ((type *)((char *)(timer) - offsetof(type, member)))
+
+void timerwheel_init(TimerWheel *wheel, uint64_t now);
+
+/* Schedule 'timer' for tick 'expires', moving it if it was already
+ * scheduled. A tick that has already passed means the next one. */
+void timerwheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires);
+
+/* Unschedule 'timer'. Harmless if it isn't scheduled. */
+void timerwheel_cancel(TimerWheel *wheel, Timer *timer);
+
+/* Move time forward to tick 'now', expiring everything due by then. */
+void timerwheel_advance(TimerWheel *wheel, uint64_t now,
+                        TimerExpired expired, void *data);
+
+static inline int timer_pending(const Timer *timer) {
+  return timer->prev != NULL;
+}
+
+/* Milliseconds on the monotonic clock */
+uint64_t timer_now_ms(void);
+
+#endif /* _TIMERWHEEL_H_ */
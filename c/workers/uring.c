@@ -0,0 +1,463 @@
+#define _GNU_SOURCE /* for inet_aton, etc */
+#include <errno.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admin.h"
+#include "eventlog.h"
+#include "frame.h"
+#include "insist.h"
+#include "session.h"
+#include "server.h"
+#include "stats.h"
+#include "status.h"
+
+/* Submission queue size for each ring */
+#define URING_ENTRIES 1024
+
+/* All receives pick their buffers from this provided buffer group */
+#define URING_BUFFER_GROUP 0
+
+/* user_data of a multishot accept is the index of its listener, which is
+ * always below this. Everything else uses its Session pointer, with what
+ * kind of request it is in the low bits (sessions are cache-line aligned,
+ * so those are free). */
+#define URING_ACCEPT_LIMIT SERVER_MAX_LISTENERS
+#define URING_OP_RECV 0
+#define URING_OP_SEND 1
+#define URING_OP_CANCEL 2
+#define URING_OP_MASK 3
+
+/* Most output chunks one sendmsg takes */
+#define URING_SEND_IOV 8
+
+/* The message header for a sendmsg. The kernel has copied it by the time
+ * the submission returns (IORING_FEAT_SUBMIT_STABLE), so these only live
+ * until the next submit. */
+typedef struct uring_send {
+  struct msghdr message;
+  struct iovec iov[URING_SEND_IOV];
+} UringSend;
+
+/* One io_uring, its provided buffers and the thread running it.
+ *
+ * Accepts and receives are both multishot: one submission keeps producing
+ * completions until it fails or the peer goes away, so in steady state the
+ * only syscall is io_uring_enter waiting for the next batch of completions.
+ * Received data lands in buffers the kernel picks from a registered buffer
+ * ring, which we hand back once the data has been handled. */
+typedef struct uring_loop {
+  pthread_t thread;
+  struct io_uring ring;
+  Server *server;
+
+  struct io_uring_buf_ring *buffers;
+  char *buffer_memory;
+  unsigned buffer_count; /* a power of two */
+  unsigned buffer_size;
+  /** Buffers handed back since the buffer ring tail last moved */
+  unsigned buffers_returned;
+
+  /** One per submission queue entry; sends_used since the last submit */
+  UringSend sends[URING_ENTRIES];
+  unsigned sends_used;
+} UringLoop;
+
+static struct io_uring_sqe *uring_get_sqe(UringLoop *uring_loop);
+static void uring_accept(UringLoop *uring_loop, int listener);
+static void uring_recv(UringLoop *uring_loop, Session *session);
+static void uring_send(UringLoop *uring_loop, Session *session);
+static void uring_recv_cancel(UringLoop *uring_loop, Session *session);
+static void uring_buffer_return(UringLoop *uring_loop, unsigned short id);
+static void uring_accept_done(UringLoop *uring_loop, int listener,
+                              struct io_uring_cqe *cqe);
+static void uring_recv_done(UringLoop *uring_loop, Session *session,
+                            struct io_uring_cqe *cqe);
+static void uring_send_done(UringLoop *uring_loop, Session *session,
+                            struct io_uring_cqe *cqe);
+static void uring_session_abort(Session *session);
+static void uring_session_update(UringLoop *uring_loop, Session *session);
+static int session_received(Session *session, char *data, size_t length);
+static void frame_discard(Session *session, const char *frame, size_t length);
+static Status uring_loop_init(UringLoop *uring_loop);
+static void *uring_loop_run(void *data);
+
+/* Sessions we've hung up on keep this until their receive winds down */
+static const Protocol discard_protocol = { FRAMING_LINE, frame_discard };
+
+struct io_uring_sqe *uring_get_sqe(UringLoop *uring_loop) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&uring_loop->ring);
+
+  if (sqe == NULL) {
+    /* Submission queue is full; push it to the kernel to make room */
+    io_uring_submit(&uring_loop->ring);
+    uring_loop->sends_used = 0;
+    sqe = io_uring_get_sqe(&uring_loop->ring);
+    insist(sqe != NULL, "io_uring_get_sqe returned NULL right after submit");
+  }
+  return sqe;
+} /* uring_get_sqe */
+
+void uring_accept(UringLoop *uring_loop, int listener) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring_loop);
+
+  /* Multishot accept reuses one request for every connection, so there is
+   * no single address buffer to give it; peers are looked up on accept. */
+  io_uring_prep_multishot_accept(sqe, uring_loop->server->fds[listener], NULL,
+                                 NULL, SOCK_CLOEXEC);
+  io_uring_sqe_set_data64(sqe, listener);
+} /* uring_accept */
+
+void uring_recv(UringLoop *uring_loop, Session *session) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring_loop);
+
+  io_uring_prep_recv_multishot(sqe, session->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  io_uring_sqe_set_data64(sqe, (uintptr_t)session | URING_OP_RECV);
+  session->flags |= SESSION_READING;
+} /* uring_recv */
+
+/* Send as much queued output as one sendmsg takes. One send at a time per
+ * session; output queued meanwhile waits for it and goes out in the next. */
+void uring_send(UringLoop *uring_loop, Session *session) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring_loop);
+  UringSend *send = &uring_loop->sends[uring_loop->sends_used++];
+
+  memset(&send->message, 0, sizeof(send->message));
+  send->message.msg_iov = send->iov;
+  send->message.msg_iovlen = output_iovec(&session->output, send->iov,
+                                          URING_SEND_IOV);
+  io_uring_prep_sendmsg(sqe, session->fd, &send->message, MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, (uintptr_t)session | URING_OP_SEND);
+  session->flags |= SESSION_WRITE_WAITING;
+} /* uring_send */
+
+/* A multishot receive can't be paused, only cancelled; it then completes
+ * with -ECANCELED, and uring_session_update starts a new one later. */
+void uring_recv_cancel(UringLoop *uring_loop, Session *session) {
+  struct io_uring_sqe *sqe = uring_get_sqe(uring_loop);
+
+  io_uring_prep_cancel64(sqe, (uintptr_t)session | URING_OP_RECV, 0);
+  io_uring_sqe_set_data64(sqe, (uintptr_t)session | URING_OP_CANCEL);
+} /* uring_recv_cancel */
+
+void uring_buffer_return(UringLoop *uring_loop, unsigned short id) {
+  io_uring_buf_ring_add(uring_loop->buffers,
+                        uring_loop->buffer_memory
+                        + (size_t)id * uring_loop->buffer_size,
+                        uring_loop->buffer_size, id,
+                        io_uring_buf_ring_mask(uring_loop->buffer_count),
+                        uring_loop->buffers_returned);
+  uring_loop->buffers_returned++;
+} /* uring_buffer_return */
+
+void uring_accept_done(UringLoop *uring_loop, int listener,
+                       struct io_uring_cqe *cqe) {
+  if (cqe->res >= 0) {
+    int fd = cqe->res;
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+
+    if (getpeername(fd, (struct sockaddr *)&address, &address_len) == -1) {
+      /* Already gone */
+      close(fd);
+    } else {
+      Session *session = session_new(fd, (struct sockaddr *)&address,
+                                     address_len);
+      session->data = uring_loop;
+      session->protocol = &uring_loop->server->protocol;
+      uring_recv(uring_loop, session);
+    }
+  } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+    fprintf(stderr, "accept(%d, ...) failed, error(%d): %s\n",
+            uring_loop->server->fds[listener], -cqe->res, strerror(-cqe->res));
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    /* The kernel ended the multishot accept; start another */
+    uring_accept(uring_loop, listener);
+  }
+} /* uring_accept_done */
+
+void uring_recv_done(UringLoop *uring_loop, Session *session,
+                     struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    session->flags &= ~SESSION_READING;
+  }
+
+  stats_add(reads, 1);
+  if (cqe->res > 0) {
+    unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    stats_add(bytes_in, cqe->res);
+    int rc = session_received(session, uring_loop->buffer_memory
+                              + (size_t)id * uring_loop->buffer_size,
+                              cqe->res);
+    uring_buffer_return(uring_loop, id);
+    if (rc != 0) {
+      /* Input that can't be framed; hang up */
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                       EPROTO);
+      uring_session_abort(session);
+    }
+  } else if (cqe->res == 0) {
+    /* EOF, flush any unterminated last line. The peer may only have shut
+     * down its side, so answer what it sent before closing up. */
+    session_frames_finish(session);
+    session->flags |= SESSION_CLOSING;
+  } else if (cqe->res == -ENOBUFS) {
+    /* Ran out of provided buffers. They come back as we handle the rest of
+     * this batch; the receive is restarted below. */
+  } else if (cqe->res == -ECANCELED) {
+    /* We paused reading; see uring_session_update */
+  } else {
+    eventlog_session(EVENTLOG_WARN, EVENT_SESSION_READ_ERROR, session,
+                     -cqe->res);
+    uring_session_abort(session);
+  }
+
+  uring_session_update(uring_loop, session);
+} /* uring_recv_done */
+
+void uring_send_done(UringLoop *uring_loop, Session *session,
+                     struct io_uring_cqe *cqe) {
+  session->flags &= ~SESSION_WRITE_WAITING;
+
+  stats_add(sends, 1);
+  if (cqe->res >= 0) {
+    stats_add(bytes_out, cqe->res);
+    output_consume(&session->output, cqe->res);
+  } else {
+    /* No point sending the rest. Sessions we hung up on ourselves are
+     * expected to fail here. */
+    if (session->protocol != &discard_protocol) {
+      eventlog_session(EVENTLOG_WARN, EVENT_SESSION_WRITE_ERROR, session,
+                       -cqe->res);
+    }
+    output_release(&session->output);
+    uring_session_abort(session);
+  }
+
+  uring_session_update(uring_loop, session);
+} /* uring_send_done */
+
+/* Give up on a session: throw away further input and close it once the
+ * requests holding pointers to it have completed. */
+void uring_session_abort(Session *session) {
+  session->protocol = &discard_protocol;
+  session->flags |= SESSION_CLOSING;
+  if (!(session->flags & SESSION_WRITE_WAITING)) {
+    /* Nothing in flight points at the output, so it can go now */
+    output_release(&session->output);
+  }
+  if (session->flags & (SESSION_READING | SESSION_WRITE_WAITING)) {
+    /* Makes the receive see EOF and any send fail, so they wind down */
+    shutdown(session->fd, SHUT_RDWR);
+  }
+} /* uring_session_abort */
+
+/* After any completion: send what's queued, pause or resume reading around
+ * the output watermarks, and free the session once it is closing and
+ * nothing in flight refers to it. */
+void uring_session_update(UringLoop *uring_loop, Session *session) {
+  unsigned flags = session->flags;
+
+  if (!(flags & SESSION_WRITE_WAITING) && session->output.length > 0) {
+    uring_send(uring_loop, session);
+  }
+
+  if (session->output.length >= SESSION_OUTPUT_HIGH_WATER) {
+    if (!(flags & SESSION_READ_PAUSED)) {
+      session->flags |= SESSION_READ_PAUSED;
+      if (flags & SESSION_READING) {
+        uring_recv_cancel(uring_loop, session);
+      }
+    }
+  } else if (session->output.length <= SESSION_OUTPUT_LOW_WATER) {
+    session->flags &= ~SESSION_READ_PAUSED;
+  }
+
+  flags = session->flags;
+  if (!(flags & (SESSION_READING | SESSION_READ_PAUSED | SESSION_CLOSING))) {
+    uring_recv(uring_loop, session);
+  } else if ((flags & SESSION_CLOSING)
+             && !(flags & (SESSION_READING | SESSION_WRITE_WAITING))) {
+    session_free(session);
+  }
+} /* uring_session_update */
+
+/* Handle received bytes. Complete frames are handled straight out of the
+ * kernel's buffer; only a trailing partial frame is copied, into the
+ * session's input buffer, to wait for the rest of it. Returns -1 if the
+ * input can't be framed. */
+int session_received(Session *session, char *data, size_t length) {
+  if (session->input.length == 0) {
+    ssize_t used = frame_scan(session->protocol, session, data, length);
+    if (used < 0) {
+      return -1;
+    }
+    data += used;
+    length -= used;
+  }
+
+  while (length > 0) {
+    size_t appended = buffer_append(&session->input, data, length);
+    data += appended;
+    length -= appended;
+    if (session_frames(session) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+} /* session_received */
+
+void frame_discard(Session *session, const char *frame, size_t length) {
+  /* nothing */
+} /* frame_discard */
+
+Status uring_loop_init(UringLoop *uring_loop) {
+  int rc;
+
+  rc = io_uring_queue_init(URING_ENTRIES, &uring_loop->ring, 0);
+  insist_return(rc == 0, TERRIBLE_FAILURE,
+                "io_uring_queue_init failed, error(%d): %s", -rc,
+                strerror(-rc));
+  insist_return(uring_loop->ring.features & IORING_FEAT_SUBMIT_STABLE,
+                TERRIBLE_FAILURE, "io_uring lacks IORING_FEAT_SUBMIT_STABLE "
+                "(linux 5.5+), which sends rely on");
+
+  uring_loop->buffers = io_uring_setup_buf_ring(&uring_loop->ring,
+                                                uring_loop->buffer_count,
+                                                URING_BUFFER_GROUP, 0, &rc);
+  insist_return(uring_loop->buffers != NULL, TERRIBLE_FAILURE,
+                "io_uring_setup_buf_ring failed, error(%d): %s", -rc,
+                strerror(-rc));
+
+  uring_loop->buffer_memory = malloc((size_t)uring_loop->buffer_count
+                                     * uring_loop->buffer_size);
+  insist_return(uring_loop->buffer_memory != NULL, TERRIBLE_FAILURE,
+                "malloc failed for %u receive buffers",
+                uring_loop->buffer_count);
+  for (unsigned i = 0; i < uring_loop->buffer_count; i++) {
+    uring_buffer_return(uring_loop, i);
+  }
+  io_uring_buf_ring_advance(uring_loop->buffers, uring_loop->buffers_returned);
+  uring_loop->buffers_returned = 0;
+
+  for (int i = 0; i < uring_loop->server->listeners; i++) {
+    uring_accept(uring_loop, i);
+  }
+  return GREAT_SUCCESS;
+} /* uring_loop_init */
+
+void *uring_loop_run(void *data) {
+  UringLoop *uring_loop = data;
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  int rc;
+
+  for (;;) {
+    rc = io_uring_submit_and_wait(&uring_loop->ring, 1);
+    insist(rc >= 0 || rc == -EINTR || rc == -EBUSY,
+           "io_uring_submit_and_wait failed, error(%d): %s", -rc,
+           strerror(-rc));
+    uring_loop->sends_used = 0;
+
+    unsigned count = 0;
+    io_uring_for_each_cqe(&uring_loop->ring, head, cqe) {
+      uint64_t user_data = io_uring_cqe_get_data64(cqe);
+      Session *session = (Session *)(uintptr_t)(user_data & ~URING_OP_MASK);
+      if (user_data < URING_ACCEPT_LIMIT) {
+        uring_accept_done(uring_loop, (int)user_data, cqe);
+      } else if ((user_data & URING_OP_MASK) == URING_OP_RECV) {
+        uring_recv_done(uring_loop, session, cqe);
+      } else if ((user_data & URING_OP_MASK) == URING_OP_SEND) {
+        uring_send_done(uring_loop, session, cqe);
+      }
+      /* A cancel's completion says nothing the receive's doesn't */
+      count++;
+    }
+    io_uring_cq_advance(&uring_loop->ring, count);
+
+    /* Publish all the buffers we handed back in one go */
+    if (uring_loop->buffers_returned > 0) {
+      io_uring_buf_ring_advance(uring_loop->buffers,
+                                uring_loop->buffers_returned);
+      uring_loop->buffers_returned = 0;
+    }
+  }
+  return NULL;
+} /* uring_loop_run */
+
+int main(int argc, char **argv) {
+  Server *server = server_new("0.0.0.0", 7000);
+  long nthreads = 1;
+  unsigned buffer_count = 1024;
+  long buffer_size = 4096;
+  int opt;
+  Status rc;
+
+  while ((opt = getopt(argc, argv, "t:b:s:" SERVER_OPTIONS)) != -1) {
+    switch (opt) {
+      case 't': nthreads = atol(optarg); break;
+      case 'b': buffer_count = atoi(optarg); break;
+      case 's': buffer_size = atol(optarg); break;
+      default:
+        if (server_option(server, opt, optarg) == GREAT_SUCCESS) {
+          break;
+        }
+        fprintf(stderr, "Usage: %s [-t threads] [-b buffers] [-s size] "
+                "[options]\n"
+                "  -t threads   rings (threads), each with its own "
+                "SO_REUSEPORT listeners\n"
+                "  -b buffers   provided receive buffers per ring (power of "
+                "two, up to 32768)\n"
+                "  -s size      bytes per receive buffer (up to 65536)\n"
+                SERVER_USAGE, argv[0]);
+        return TERRIBLE_FAILURE;
+    }
+  }
+  insist_return(nthreads > 0, TERRIBLE_FAILURE,
+                "Need at least one thread, got %ld", nthreads);
+  insist_return(buffer_count > 0 && buffer_count <= 32768
+                && (buffer_count & (buffer_count - 1)) == 0,
+                TERRIBLE_FAILURE, "Buffer count must be a power of two up "
+                "to 32768, got %u", buffer_count);
+  insist_return(buffer_size > 0 && buffer_size <= 65536, TERRIBLE_FAILURE,
+                "Buffer size must be 1 to 65536 bytes, got %ld", buffer_size);
+
+  eventlog_start();
+  admin_start(server->stats_address);
+  UringLoop *uring_loops = calloc(nthreads, sizeof(*uring_loops));
+  for (long i = 0; i < nthreads; i++) {
+    UringLoop *uring_loop = &uring_loops[i];
+    uring_loop->server = (i == 0) ? server : server_copy(server);
+    uring_loop->buffer_count = buffer_count;
+    uring_loop->buffer_size = buffer_size;
+
+    /* io_uring doesn't need non-blocking sockets */
+    if (nthreads > 1) {
+      rc = server_listen_reuseport(uring_loop->server, 0);
+    } else {
+      rc = server_listen(uring_loop->server, 0);
+    }
+    insist_return(rc == GREAT_SUCCESS, rc, "Server failed to start listening")
+
+    rc = uring_loop_init(uring_loop);
+    insist_return(rc == GREAT_SUCCESS, rc, "Failed setting up io_uring");
+  }
+
+  for (long i = 1; i < nthreads; i++) {
+    int err = pthread_create(&uring_loops[i].thread, NULL, uring_loop_run,
+                             &uring_loops[i]);
+    insist_return(err == 0, TERRIBLE_FAILURE,
+                  "pthread_create failed, error(%d): %s", err, strerror(err));
+  }
+  uring_loops[0].thread = pthread_self();
+  uring_loop_run(&uring_loops[0]);
+  return 0;
+} /* main */
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE /* for posix_memalign */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "insist.h"
+#include "workqueue.h"
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct workqueue_cell {
+  size_t sequence;
+  void *item;
+} WorkQueueCell;
+
+/* Keep the producer and consumer positions on separate cache lines so
+ * enqueuers and dequeuers don't fight over the same line. */
+struct workqueue {
+  WorkQueueCell *cells;
+  size_t mask;
+  char pad0[CACHE_LINE_SIZE - sizeof(WorkQueueCell *) - sizeof(size_t)];
+  size_t enqueue_position;
+  char pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+  size_t dequeue_position;
+  char pad2[CACHE_LINE_SIZE - sizeof(size_t)];
+};
+
+WorkQueue *workqueue_new(size_t capacity) {
+  WorkQueue *queue;
+  size_t size = 2;
+
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  insist(posix_memalign((void **)&queue, CACHE_LINE_SIZE, sizeof(*queue)) == 0,
+         "posix_memalign failed allocating a WorkQueue");
+  queue->cells = calloc(size, sizeof(*queue->cells));
+  insist(queue->cells != NULL, "calloc failed allocating %zd queue cells",
+         size);
+  queue->mask = size - 1;
+  queue->enqueue_position = 0;
+  queue->dequeue_position = 0;
+
+  for (size_t i = 0; i < size; i++) {
+    queue->cells[i].sequence = i;
+  }
+  return queue;
+} /* workqueue_new */
+
+void workqueue_free(WorkQueue *queue) {
+  free(queue->cells);
+  free(queue);
+} /* workqueue_free */
+
+int workqueue_push(WorkQueue *queue, void *item) {
+  WorkQueueCell *cell;
+  size_t position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+
+  for (;;) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+
+    if (diff == 0) {
+      /* This cell is free; try to claim it. */
+      if (__atomic_compare_exchange_n(&queue->enqueue_position, &position,
+                                      position + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+      /* CAS failure reloaded 'position' for us, try again. */
+    } else if (diff < 0) {
+      /* The consumer hasn't emptied this cell yet: the queue is full */
+      return -1;
+    } else {
+      position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->item = item;
+  __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+  return 0;
+} /* workqueue_push */
+
+void *workqueue_pop(WorkQueue *queue) {
+  WorkQueueCell *cell;
+  size_t position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+
+  for (;;) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue->dequeue_position, &position,
+                                      position + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Nothing has been published to this cell yet: the queue is empty */
+      return NULL;
+    } else {
+      position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  void *item = cell->item;
+  /* Mark the cell free for the producer one lap ahead of us */
+  __atomic_store_n(&cell->sequence, position + queue->mask + 1,
+                   __ATOMIC_RELEASE);
+  return item;
+} /* workqueue_pop */
@@ -0,0 +1,27 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+#include <stddef.h>
+
+/* A bounded, lock-free, multi-producer multi-consumer queue of pointers.
+ *
+ * This is Dmitry Vyukov's array-based MPMC queue: every cell carries a
+ * sequence number that tells producers and consumers whether the cell is
+ * ready for them, so the only contended operation is a single
+ * compare-and-swap on the enqueue or dequeue position.
+ *
+ * The queue never blocks. Callers that want to sleep while the queue is empty
+ * must pair it with their own wakeup mechanism (semaphore, ev_async, etc). */
+typedef struct workqueue WorkQueue;
+
+/* Create a new queue. 'capacity' is rounded up to a power of two. */
+WorkQueue *workqueue_new(size_t capacity);
+void workqueue_free(WorkQueue *queue);
+
+/* Returns 0 on success, -1 if the queue is full. */
+int workqueue_push(WorkQueue *queue, void *item);
+
+/* Returns the oldest item, or NULL if the queue is empty. */
+void *workqueue_pop(WorkQueue *queue);
+
+#endif /* _WORKQUEUE_H_ */